@@ -11,6 +11,8 @@
 #include <stddef.h>
 #include "ddriver.h"
 #include "errno.h"
+#include <linux/falloc.h>
+#include <pthread.h>
 #include "types.h"
 #include "stdint.h"
 
@@ -36,33 +38,76 @@ int   			   newfs_write(const char *, const char *, size_t, off_t,
 					                  struct fuse_file_info *);
 int   			   newfs_read(const char *, char *, size_t, off_t,
 					                 struct fuse_file_info *);
+int   			   newfs_write_buf(const char *, struct fuse_bufvec *, off_t,
+					                      struct fuse_file_info *);
+int   			   newfs_read_buf(const char *, struct fuse_bufvec **, size_t, off_t,
+					                     struct fuse_file_info *);
 int   			   newfs_access(const char *, int);
 int   			   newfs_unlink(const char *);
 int   			   newfs_rmdir(const char *);
 int   			   newfs_rename(const char *, const char *);
 int   			   newfs_utimens(const char *, const struct timespec tv[2]);
 int   			   newfs_truncate(const char *, off_t);
+int   			   newfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
+int   			   newfs_release(const char *, struct fuse_file_info *);
+int   			   newfs_releasedir(const char *, struct fuse_file_info *);
+int   			   newfs_fsync(const char *, int, struct fuse_file_info *);
 
 /******************************************************************************
 * SECTION: newfs_utils.c
 *******************************************************************************/
 char* 			   newfs_get_fname(const char *);    
-int 			   newfs_calc_lvl(const char *);
 int                newfs_driver_read(int , uint8_t *, int);
 int                newfs_driver_write(int , uint8_t *, int);
 int                newfs_alloc_dentry(struct newfs_inode* , struct newfs_dentry*);
 struct             newfs_inode* newfs_alloc_inode(struct newfs_dentry *);
 int                newfs_sync_inode(struct newfs_inode *);
+void               newfs_mark_inode_dirty(struct newfs_inode *);
+void               newfs_touch_inode(struct newfs_inode *, int);
+void               newfs_set_times(struct newfs_inode *, const struct timespec tv[2]);
+int                newfs_sync_dirty_inodes();
+void               newfs_free_inode(struct newfs_inode *);
 struct             newfs_inode* newfs_read_inode(struct newfs_dentry * , int);
 struct             newfs_dentry* newfs_get_dentry(struct newfs_inode * , int);
-struct             newfs_dentry* newfs_lookup(const char * , boolean* , boolean*);
+int                newfs_find_dirent(struct newfs_inode *, const char *, int);
+struct             newfs_dentry* newfs_lookup(const char * , boolean* , boolean*, int);
+void               newfs_lookup_unlock(struct newfs_dentry *, boolean, int);
+void               newfs_negotiate_conn(struct fuse_conn_info * conn, struct custom_options options);
 int 			   newfs_mount(struct custom_options options);
 int 			   newfs_umount();
 int 			   newfs_alloc_data_blk(struct newfs_inode * inode, int blk_idx);
+int                newfs_bmap(struct newfs_inode * inode, int blk);
+int                newfs_bmap_run(struct newfs_inode * inode, int blk, int max, int * dno);
+int                newfs_inode_read(struct newfs_inode * inode, uint8_t * buf, int size, int offset);
+int                newfs_inode_write(struct newfs_inode * inode, const uint8_t * buf, int size, int offset);
+int                newfs_inode_stage_write(struct newfs_inode * inode, const uint8_t * buf, int size, int offset);
+int                newfs_inode_flush_stage(struct newfs_inode * inode);
+int                newfs_inode_read_buf(struct newfs_inode * inode, struct fuse_bufvec ** pbufv, int size, int offset);
+int                newfs_inode_write_buf(struct newfs_inode * inode, struct fuse_bufvec * src, int offset);
+void               newfs_free_bufvec(struct fuse_bufvec * bufv);
+int                newfs_inode_truncate(struct newfs_inode * inode, int size);
+int                newfs_inode_fallocate(struct newfs_inode * inode, int offset, int len, boolean keep_size);
 int 			   newfs_drop_inode(struct newfs_inode * inode);
 int 			   newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry);
+struct             newfs_dentry* newfs_lookup_child(struct newfs_inode * dir, const char * name, boolean * is_find);
+int                newfs_create(struct newfs_dentry * parent, const char * name, NEWFS_FILE_TYPE ftype,
+                                struct newfs_dentry ** pdentry);
+int                newfs_remove(struct newfs_dentry * dentry);
+int                newfs_move(struct newfs_dentry * from, struct newfs_dentry * to_parent, const char * name);
+void               newfs_fill_stat(struct newfs_inode * inode, struct stat * st);
+void               newfs_inode_get(struct newfs_inode * inode);
+void               newfs_inode_put(struct newfs_inode * inode);
+
+/******************************************************************************
+* SECTION: newfs_pool.c
+*******************************************************************************/
+int                newfs_pool_start(int nr_workers);
+void               newfs_pool_stop();
+void               newfs_pool_submit(void (*fn)(void *), void * arg, NEWFS_TASK_PRIO prio, int * pending);
+void               newfs_pool_wait(int * pending);
+void               newfs_pool_drain();
 
 #endif  /* _newfs_H_ */
\ No newline at end of file
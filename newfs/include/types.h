@@ -9,6 +9,18 @@ typedef enum newfs_file_type {
     NEWFS_DIR
 } NEWFS_FILE_TYPE;
 
+typedef enum newfs_task_prio {
+    NEWFS_TASK_FG,                      /* 前台：有线程在等它完成，优先执行 */
+    NEWFS_TASK_BG,                      /* 后台：维护工作，没有前台任务时才执行 */
+    NEWFS_TASK_PRIOS
+} NEWFS_TASK_PRIO;
+
+typedef enum newfs_remap {
+    NEWFS_REMAP_WRITTEN,                /* 去掉预分配的未写标记 */
+    NEWFS_REMAP_UNWRITTEN,              /* 重新标为未写：保留数据块，读出全0 */
+    NEWFS_REMAP_PUNCH                   /* 归还数据块，成为空洞 */
+} NEWFS_REMAP;
+
 /******************************************************************************
 * SECTION: Macro
 *******************************************************************************/
@@ -17,7 +29,7 @@ typedef enum newfs_file_type {
 #define UINT32_BITS             32
 #define UINT8_BITS              8
 
-#define NEWFS_MAGIC_NUM           0x20110505 
+#define NEWFS_MAGIC_NUM           0x20110506  /* 磁盘布局每变一次加一，旧布局的镜像不会被误解析 */
 #define NEWFS_SUPER_OFS           0
 #define NEWFS_ROOT_INO            0
 
@@ -33,6 +45,10 @@ typedef enum newfs_file_type {
 #define NEWFS_ERROR_IO            EIO     /* Error Input/Output */
 #define NEWFS_ERROR_INVAL         EINVAL  /* Invalid Args */
 #define NEWFS_ERROR_NOTDIR        ENOTDIR
+#define NEWFS_ERROR_FBIG          EFBIG   /* File too large */
+#define NEWFS_ERROR_OPNOTSUPP     EOPNOTSUPP
+#define NEWFS_ERROR_NAMETOOLONG   ENAMETOOLONG
+#define NEWFS_ERROR_NOMEM         ENOMEM
 
 #define NEWFS_MAX_FILE_NAME     128
 #define SUPER_BLKS              1
@@ -42,6 +58,25 @@ typedef enum newfs_file_type {
 #define MAX_INODE_PER_BLK       16
 #define DATA_BLKS               4056
 #define NEWFS_DATA_PER_FILE     6
+#define NEWFS_INLINE_EXTS       2       /* inode中内嵌的区段数 */
+#define NEWFS_INLINE_DATA_MAX   36      /* 内嵌在inode中的文件数据的最大字节数 */
+#define NEWFS_EXT_MAGIC         0xF30A  /* 区段树块的魔数 */
+#define NEWFS_IO_RUN_BLKS       64      /* 一次合并传输的最大块数 */
+#define NEWFS_FLUSH_WORKERS     4       /* 卸载时并行写回的线程数 */
+#define NEWFS_FLUSH_MIN_INODES  16      /* 脏inode不到这么多时不开线程，直接写回 */
+#define NEWFS_AG_BITS           512     /* 每个分配组管理的位数，即位图中的64字节 */
+#define NEWFS_POOL_WORKERS      4       /* 线程池的默认线程数 */
+#define NEWFS_POOL_DEQUE_CAP    64      /* 每个线程任务队列的初始容量 */
+#define NEWFS_STAGE_BLKS        64      /* 写合并缓冲区的块数 */
+#define NEWFS_MAX_WRITE         (128 * 1024)    /* 默认单个写请求的最大字节数 */
+#define NEWFS_MAX_READAHEAD     (128 * 1024)    /* 默认内核预读的最大字节数 */
+#define NEWFS_CACHE_TIMEOUT     1.0     /* 默认内核缓存属性和名称查找结果的秒数 */
+#define NEWFS_ATIME_MAX_AGE     (24 * 60 * 60)  /* 读访问最多隔这么久才更新一次 atime */
+#define NEWFS_PACK_MAGIC        0x504B  /* 小文件共享块的魔数 */
+#define NEWFS_PACK_TBL_MAGIC    0x5054  /* 共享块表的魔数 */
+#define NEWFS_DIRENTS_INIT_CAP  8       /* 子项数组初始容量 */
+#define NEWFS_NAMES_INIT_CAP    256     /* 名称字符串区初始容量 */
+#define NEWFS_RCU_BATCH         32      /* 延迟释放攒够这么多项才尝试回收一次 */
 #define NEWFS_DEFAULT_PERM      0777
 
 /******************************************************************************
@@ -55,11 +90,22 @@ typedef enum newfs_file_type {
 #define NEWFS_INODE_SZ()                  (sizeof(struct newfs_inode_d))
 #define NEWFS_BLKS_SZ(blks)               ((blks) * NEWFS_BLK_SZ())
 #define NEWFS_INODES_SZ(ino)              ((ino) * NEWFS_INODE_SZ())
-#define MAX_DENTRY_PER_BLK()              (NEWFS_BLK_SZ() / sizeof(struct newfs_dentry))
+#define NEWFS_PTRS_PER_BLK()              (NEWFS_BLK_SZ() / (int)sizeof(int))
+#define NEWFS_MAX_FILE_BLKS()             (NEWFS_DATA_PER_FILE + NEWFS_PTRS_PER_BLK() + \
+                                           NEWFS_PTRS_PER_BLK() * NEWFS_PTRS_PER_BLK())
+#define NEWFS_EXTS_PER_BLK()              ((NEWFS_BLK_SZ() - (int)sizeof(struct newfs_ext_hdr_d)) / \
+                                           (int)sizeof(struct newfs_extent))
+#define NEWFS_EXT_IDX_PER_BLK()           ((NEWFS_BLK_SZ() - (int)sizeof(struct newfs_ext_hdr_d)) / \
+                                           (int)sizeof(struct newfs_ext_idx_d))
+#define NEWFS_PACK_MAX_SZ()               (NEWFS_BLK_SZ() - NEWFS_BLK_SZ() / 8)   /* 放进共享块的文件的最大字节数 */
+#define NEWFS_PACK_TBL_CAP()              ((NEWFS_BLK_SZ() - (int)sizeof(struct newfs_pack_tbl_hdr_d)) / \
+                                           (int)sizeof(struct newfs_pack_ent_d))
+#define NEWFS_DENTRY_D_LEN(name_len)      NEWFS_ROUND_UP(sizeof(struct newfs_dentry_d) + (name_len), 4)
 
 // 向上取整数 向下取整
 #define NEWFS_ROUND_DOWN(value, round)    ((value) % (round) == 0 ? (value) : ((value) / (round)) * (round))
 #define NEWFS_ROUND_UP(value, round)      ((value) % (round) == 0 ? (value) : ((value) / (round) + 1) * (round))
+#define NEWFS_MAX(a, b)                   ((a) > (b) ? (a) : (b))
 
 // 设置文件名称
 #define NEWFS_ASSIGN_FNAME(pnewfs_dentry, _fname) memcpy(pnewfs_dentry->fname, _fname, strlen(_fname))
@@ -68,23 +114,94 @@ typedef enum newfs_file_type {
 #define NEWFS_INO_OFS(ino)                (newfs_super.ino_offset + NEWFS_INODES_SZ(ino))
 #define NEWFS_DATA_OFS(dno)               (newfs_super.data_offset + NEWFS_BLKS_SZ(dno))
 
+// 报告给内核的 st_ino，与低层接口的节点号一致，根目录为1
+#define NEWFS_ST_INO(ino)                 ((ino) + 1)
+
+// 目录第 blk 个目录块有改动，inode挂到脏链表上
+#define NEWFS_DIR_MARK_DIRTY(pinode, blk) ((pinode)->dir_dirty |= (0x1 << (blk)), \
+                                           newfs_mark_inode_dirty(pinode))
+// 文件第 blk 块的缓冲区是否被改过（data_dirty 为按块的位图）
+#define NEWFS_DATA_MARK_DIRTY(pinode, blk) ((pinode)->data_dirty[(blk) / UINT8_BITS] |= (0x1 << ((blk) % UINT8_BITS)))
+#define NEWFS_DATA_IS_DIRTY(pinode, blk)  (((pinode)->data_dirty[(blk) / UINT8_BITS] & (0x1 << ((blk) % UINT8_BITS))) != 0)
+// 文件第 blk 块进入内存前是否为预分配未写的块（data_prealloc 为按块的位图）
+#define NEWFS_DATA_MARK_PREALLOC(pinode, blk) ((pinode)->data_prealloc[(blk) / UINT8_BITS] |= (0x1 << ((blk) % UINT8_BITS)))
+#define NEWFS_DATA_IS_PREALLOC(pinode, blk)  (((pinode)->data_prealloc[(blk) / UINT8_BITS] & (0x1 << ((blk) % UINT8_BITS))) != 0)
+// 目录第 i 个子项的名称（位于字符串区，'\0'结尾）
+#define NEWFS_DIRENT_NAME(pinode, i)      ((pinode)->names + (pinode)->dirents[i].name_ofs)
+
 // 判断 inode 类型
-#define NEWFS_IS_DIR(pinode)              (pinode->dentry->ftype == NEWFS_DIR)
-#define NEWFS_IS_REG(pinode)              (pinode->dentry->ftype == NEWFS_REG_FILE)
+#define NEWFS_IS_DIR(pinode)              (pinode->ftype == NEWFS_DIR)
+#define NEWFS_IS_REG(pinode)              (pinode->ftype == NEWFS_REG_FILE)
+
+// 预分配但还没写过的块：块号表项中置 NEWFS_BLK_UNWRITTEN 位，区段的 len 中置 NEWFS_EXT_UNWRITTEN 位，读出全0
+#define NEWFS_BLK_UNWRITTEN               0x40000000
+#define NEWFS_PTR_DNO(ptr)                ((ptr) == -1 ? -1 : (ptr) & ~NEWFS_BLK_UNWRITTEN)
+#define NEWFS_PTR_UNWRITTEN(ptr)          ((ptr) != -1 && ((ptr) & NEWFS_BLK_UNWRITTEN))
+#define NEWFS_EXT_UNWRITTEN               0x80000000u
+#define NEWFS_EXT_LEN(pext)               ((int)((pext)->len & ~NEWFS_EXT_UNWRITTEN))
+#define NEWFS_EXT_IS_UNWRITTEN(pext)      (((pext)->len & NEWFS_EXT_UNWRITTEN) != 0)
+
+// inode 标志
+#define NEWFS_INODE_EXTENTS               0x1     /* 文件块按区段映射，否则按直接/间接块映射 */
+#define NEWFS_INODE_INLINE_DATA           0x2     /* 文件数据内嵌在inode中，没有数据块 */
+#define NEWFS_INODE_PACKED                0x4     /* 文件数据放在与其他小文件共享的块中 */
+#define NEWFS_USE_EXTENTS(pinode)         ((pinode)->flags & NEWFS_INODE_EXTENTS)
+#define NEWFS_IS_INLINE(pinode)           ((pinode)->flags & NEWFS_INODE_INLINE_DATA)
+#define NEWFS_IS_PACKED(pinode)           ((pinode)->flags & NEWFS_INODE_PACKED)
+
+// newfs_touch_inode 要更新的时间
+#define NEWFS_T_ATIME                     0x1
+#define NEWFS_T_MTIME                     0x2
+#define NEWFS_T_CTIME                     0x4
+
+// 并发控制：每个inode一把读写锁，保护inode本身以及目录的子项数组；全局状态各有一把互斥锁。
+// 加锁顺序（只能从左往右加）：
+//   rename_lock -> inode锁（父目录先于子项，rename 的两个父目录之间用 trylock 回退）
+//   -> pack_lock -> cache_lock -> dirty_lock -> driver_lock
+// inode位图和数据块位图不加锁，按位原子地占用和清除。
+// rcu_lock 和线程池内部的锁是叶子锁，持有它们时不再加别的锁；任务执行时不持有线程池的锁。
+#define NEWFS_LOCK_RD                     0x1     /* newfs_lookup：目标加读锁 */
+#define NEWFS_LOCK_WR                     0x2     /* newfs_lookup：目标加写锁 */
+#define NEWFS_LOCK_PARENT                 0x4     /* newfs_lookup：最后一级的父目录加写锁 */
+#define NEWFS_LOOKUP_ERR(is_find)         ((is_find) ? -NEWFS_ERROR_IO : -NEWFS_ERROR_NOTFOUND) /* 查找返回NULL时的错误号 */
+#define NEWFS_RDLOCK(pinode)              pthread_rwlock_rdlock(&(pinode)->lock)
+#define NEWFS_WRLOCK(pinode)              pthread_rwlock_wrlock(&(pinode)->lock)
+#define NEWFS_UNLOCK(pinode)              pthread_rwlock_unlock(&(pinode)->lock)
 
 /******************************************************************************
 * SECTION: FS Specific Structure - In memory structure
 *******************************************************************************/
 struct newfs_dentry;
+struct newfs_dirent;
+struct newfs_ptr_blk;
+struct newfs_pack;
+struct newfs_rcu_reader;
+struct newfs_rcu_retired;
+struct newfs_wb_req;
+struct newfs_wb_batch;
+struct newfs_task;
+struct newfs_deque;
+struct newfs_pool_worker;
+struct newfs_pool;
 struct newfs_inode;
 struct newfs_super;
 struct custom_options {
 	const char*        device;
+	int                extents;          /* 新建的文件使用区段映射 */
+	unsigned           max_write;        /* 单个写请求的最大字节数 */
+	unsigned           max_readahead;    /* 内核预读的最大字节数 */
+	int                big_writes;       /* 允许大于一页的写请求 */
+	int                async_read;       /* 允许内核并发发出读请求 */
+	double             attr_timeout;     /* 内核缓存属性的秒数 */
+	double             entry_timeout;    /* 内核缓存名称查找结果的秒数 */
+	int                splice;           /* 设备是镜像文件时，读请求直接 splice 磁盘上的数据 */
+	int                pool_workers;     /* 线程池的线程数，为0时提交的任务就地执行 */
 };
 
 struct newfs_super {
     uint32_t magic_num;
     int      fd;
+    int      img_fd;      // 只读打开的镜像文件，读请求交给 libfuse splice；-1 表示不可用
     /* TODO: Define yourself */
     int sz_disk;          // 磁盘大小
     int sz_usage;
@@ -118,6 +235,29 @@ struct newfs_super {
     /* 根目录索引 */
     int root_ino;           // 根目录对应的inode
 
+    /* 小文件共享块 */
+    int                pack_tbl;         // 共享块表所在的数据块号，-1 表示没有
+    struct newfs_pack* packs;            // 所有共享块，容量为 NEWFS_PACK_TBL_CAP()
+    int                pack_cnt;         // 共享块个数
+    boolean            pack_dirty;       // 共享块表有改动
+
+    /* 有改动、需要写回的inode */
+    struct newfs_inode* dirty_inodes;     // 脏inode链表头
+
+    /* 全局状态的锁，加锁顺序见 NEWFS_LOCK_RD 上方的说明 */
+    pthread_mutex_t    rename_lock;      // rename 整体串行，两个父目录的关系在期间不会变
+    pthread_mutex_t    pack_lock;        // 共享块和共享块表
+    pthread_mutex_t    cache_lock;       // 只持有读锁时的延迟填充：dentry、子项inode、间接块缓存
+    pthread_mutex_t    dirty_lock;       // 脏inode链表
+    pthread_mutex_t    driver_lock;      // ddriver 的 seek 和 read/write 要成对执行
+
+    /* 无锁路径查找：目录项、inode和子项数组被摘下后延迟到没有读者时才释放 */
+    uint64_t           rcu_epoch;        // 全局纪元，每延迟释放一项加一
+    struct newfs_rcu_retired* rcu_retired; // 等待释放的内存
+    int                rcu_retired_cnt;  // 等待释放的项数
+    pthread_mutex_t    rcu_lock;         // 保护 rcu_retired
+    boolean            rcu_reclaiming;   // 已向线程池提交了回收任务，rcu_lock 保护
+
     /* 其他信息 */
     boolean            is_mounted;
     struct newfs_dentry* root_dentry;     // 根目录
@@ -130,15 +270,184 @@ struct newfs_inode {
     int                  size;               // 文件已占用空间
     int                  link;               // 链接数，默认为1
     NEWFS_FILE_TYPE      ftype;            // 文件类型（目录类型、普通文件类型）
+    int                  flags;              // NEWFS_INODE_* 标志
+    uint32_t             atime;              // 最近访问时间（秒）
+    uint32_t             mtime;              // 最近修改内容的时间
+    uint32_t             ctime;              // 最近修改内容或属性的时间
+    uint8_t              inline_data[NEWFS_INLINE_DATA_MAX];   // 内嵌的文件数据，超出部分保持为0
+    int                  pack_dno;           // 共享块块号（NEWFS_INODE_PACKED）
+    int                  pack_slot;          // 在共享块中的槽号
 
     /* 数据块的索引 */
     int                  block_pointer[NEWFS_DATA_PER_FILE];   // 数据块块号（可固定分配）
-    uint8_t*             data[NEWFS_DATA_PER_FILE];            // 指向数据块的指针
+    int                  ind_pointer;        // 一级间接块块号，-1 表示没有
+    int                  dind_pointer;       // 二级间接块块号，-1 表示没有
+    struct newfs_ptr_blk* ind;               // 一级间接块的缓存，NULL 表示尚未读入
+    struct newfs_ptr_blk* dind;              // 二级间接块的缓存，NULL 表示尚未读入
+    struct newfs_extent* exts;               // 区段映射：按文件块号排序的区段
+    int                  ext_cnt;            // 区段个数
+    int                  ext_cap;            // exts 数组容量
+    int*                 ext_blks;           // 区段树占用的块号，[0] 为根，区段内嵌时为空
+    int                  ext_blk_cnt;        // 区段树占用的块数
+    boolean              ext_dirty;          // 区段有改动，需要重写
+    uint8_t**            data;               // 按文件块号索引的数据块缓冲区，NULL 表示不在内存中
+    int                  data_cap;           // data 数组容量
+    uint8_t*             data_dirty;         // 按块的脏位图，只有改过的块才写回
+    uint8_t*             data_prealloc;      // 按块的位图，标出预分配的块，写回全0时重新标为未写
+    uint8_t*             stage;              // 写合并缓冲区，暂存首尾相接的小块写入，NULL 表示没有
+    int                  stage_off;          // 暂存数据在文件中的起始偏移
+    int                  stage_len;          // 暂存数据的长度
 
     /* 其他字段 */
     int                  dir_cnt;            // 如果是目录类型文件，下面有几个目录项
     struct newfs_dentry* dentry;             // 指向该inode的dentry
-    struct newfs_dentry* dentrys;            // 所有目录项
+    int                  dir_hole[NEWFS_DATA_PER_FILE];        // 目录块块首空闲记录的长度
+    int                  dir_dirty;          // 内容有改动、需要写回的目录块位图（第 i 位对应第 i 块）
+    struct newfs_inode*  dirty_next;         // 脏inode链表中的下一个
+    struct newfs_inode** dirty_pprev;        // 指向链表中指向自己的指针，NULL 表示不在链表中
+    int                  open_cnt;           // 存放在 fi->fh 中的打开句柄数，原子地增减
+    boolean              unlinked;           // 已从目录树删除，最后一个句柄关闭时才真正释放
+
+    /* 目录的子项：紧凑数组 + 独立的名称字符串区，扫描时线性访问内存 */
+    struct newfs_dirent* dirents;            // 子项数组，前 dir_cnt 个有效
+    int                  dirents_cap;        // 子项数组容量
+    char*                names;              // 名称字符串区
+    int                  names_len;          // 字符串区已用字节
+    int                  names_cap;          // 字符串区容量
+    int                  names_garbage;      // 删除子项后留下的空洞字节
+    uint32_t             seq;                // 子项的修改序号，奇数表示正在修改，无锁查找据此校验
+    int                  seq_nest;           // 嵌套的修改层数，只有最外层改动 seq
+
+    pthread_rwlock_t     lock;               // 保护以上所有字段，目录的锁同时保护其子项
+};
+
+/**
+ * 间接块在内存中的缓存：ptrs 为块内的数据块号表（-1 表示未映射），
+ * 二级间接块的 sub 缓存其下方的一级间接块，读入一次后查找不再访问磁盘
+ */
+struct newfs_ptr_blk {
+    boolean                dirty;            // 块号表有改动，需要写回
+    struct newfs_ptr_blk** sub;              // 二级间接块的下一级缓存，一级间接块为NULL
+    int                    ptrs[];           // NEWFS_PTRS_PER_BLK() 个块号
+};
+
+/**
+ * 小文件共享块：块内容缓存到卸载为止，扫描同一批小文件时只读这几个块
+ */
+struct newfs_pack {
+    int                  dno;                // 数据块号
+    int                  free;               // 可用字节数，包括删除文件后留下的碎片
+    uint8_t*             buf;                // 块内容，NULL 表示尚未读入
+    boolean              dirty;              // 块内容有改动
+};
+
+/**
+ * 无锁查找的读者记录，每个线程一个，线程退出后留给新线程复用，一直保留到进程结束
+ */
+struct newfs_rcu_reader {
+    uint64_t                 epoch;          // 进入读区时的全局纪元
+    int                      active;         // 是否在读区内
+    boolean                  in_use;         // 是否已被某个线程占用
+    struct newfs_rcu_reader* next;
+};
+
+/**
+ * 延迟释放的内存：纪元不晚于 epoch 的读者都离开读区后才调用 free_fn
+ */
+struct newfs_rcu_retired {
+    void*                     ptr;
+    void                    (*free_fn)(void*);
+    uint64_t                  epoch;
+    struct newfs_rcu_retired* next;
+};
+
+/**
+ * 一次待下发的写：并行写回时各线程只编码、收集，最后按偏移排序合并后统一下发
+ */
+struct newfs_wb_req {
+    int                  offset;             // 磁盘偏移
+    int                  size;
+    uint8_t*             buf;
+    boolean              owned;              // buf 下发后由批次释放，否则指向inode的数据块缓存
+    uint64_t             seq;                // 收集顺序，偏移相同时后收集的覆盖先收集的
+};
+
+/**
+ * 写回批次：一个写回线程收集的所有写
+ */
+struct newfs_wb_batch {
+    struct newfs_wb_req* reqs;
+    int                  cnt;
+    int                  cap;
+};
+
+/**
+ * 线程池中的一个任务
+ */
+struct newfs_task {
+    void               (*fn)(void*);
+    void*                arg;
+    int*                 pending;            // 完成时减一，提交者用 newfs_pool_wait 等它归零；可以为NULL
+};
+
+/**
+ * 任务双端队列（环形数组）：所属线程从尾部存取，其他线程从头部偷
+ */
+struct newfs_deque {
+    struct newfs_task*   tasks;
+    int                  head;               // 第一个任务的下标
+    int                  cnt;
+    int                  cap;
+};
+
+/**
+ * 线程池的一个工作线程，每种优先级各有一个队列
+ */
+struct newfs_pool_worker {
+    pthread_t            tid;
+    pthread_mutex_t      lock;               // 保护两个队列
+    struct newfs_deque   q[NEWFS_TASK_PRIOS];
+};
+
+/**
+ * 线程池：任务先进提交线程自己的队列，空闲的线程从别的队列偷任务；
+ * 前台任务总是先于后台任务执行
+ */
+struct newfs_pool {
+    struct newfs_pool_worker* workers;
+    int                  nr_workers;         // 为0表示没有启动，任务就地执行
+    int                  next;               // 池外线程提交时轮流放进各线程的队列
+    int                  queued;             // 所有队列中的任务数
+    int                  outstanding;        // 已提交未完成的任务数
+    boolean              stopping;
+    pthread_mutex_t      lock;               // 配合 cond、done 睡眠唤醒
+    pthread_cond_t       cond;               // 有新任务或要退出
+    pthread_cond_t       done;               // 有任务完成
+};
+
+/**
+ * 区段：文件块 [blk, blk + len) 连续地映射到数据块 [dno, dno + len)，内存和磁盘共用
+ */
+struct newfs_extent {
+    uint32_t blk;                            // 起始文件块号
+    uint32_t dno;                            // 起始数据块号
+    uint32_t len;                            // 块数，最高位为 NEWFS_EXT_UNWRITTEN
+};
+
+/**
+ * 目录子项的"热"记录，扫描（lookup、readdir）只访问这部分
+ * 删除时用数组末尾的记录填补空位
+ */
+struct newfs_dirent {
+    uint32_t             hash;               // 名称哈希，先比哈希和长度再比名称
+    uint16_t             name_len;           // 名称长度
+    uint8_t              ftype;              // 文件类型
+    uint8_t              blk;                // 记录所在目录块（block_pointer下标）
+    uint32_t             ino;                // inode编号
+    uint32_t             name_ofs;           // 名称在字符串区中的偏移
+    uint16_t             rec_ofs;            // 记录在目录块内的偏移
+    uint16_t             rec_len;            // 记录长度（含尾部空闲空间）
+    struct newfs_dentry* dentry;             // 对应的dentry，需要时才创建
 };
 
 struct newfs_dentry {
@@ -153,7 +462,7 @@ struct newfs_dentry {
     NEWFS_FILE_TYPE      ftype;              // 文件类型（目录类型、普通文件类型）
 
     struct newfs_dentry* parent;
-    struct newfs_dentry* brother;
+    int                  slot;               // 在父目录 dirents 数组中的下标
     struct newfs_inode* inode;
 };
 
@@ -165,8 +474,46 @@ static inline struct newfs_dentry* new_dentry(char * fname, NEWFS_FILE_TYPE ftyp
     dentry->ino     = -1;
     dentry->inode   = NULL;
     dentry->parent  = NULL;
-    dentry->brother = NULL;   
-    return dentry;                                         
+    dentry->slot    = -1;
+    return dentry;
+}
+
+/**
+ * 路径分量迭代器：直接在原始路径上扫描，不拷贝、不分配内存，可重入
+ *
+ * path: //a/bc//d/  依次得到 (a,1) (bc,2) (d,1)，随后返回 0
+ */
+struct newfs_path_iter {
+    const char* cursor;                      // 下一次扫描的起点
+};
+
+static inline void newfs_path_iter_init(struct newfs_path_iter* iter, const char* path) {
+    iter->cursor = path;
+}
+
+static inline int newfs_path_next(struct newfs_path_iter* iter, const char** name) {
+    const char* cur = iter->cursor;
+    const char* start;
+    while (*cur == '/') {                    // 跳过连续的'/'
+        cur++;
+    }
+    start = cur;
+    while (*cur != '\0' && *cur != '/') {
+        cur++;
+    }
+    iter->cursor = cur;
+    *name = start;
+    return (int)(cur - start);               // 0 表示路径已结束
+}
+
+/* 目录项名称哈希（FNV-1a） */
+static inline uint32_t newfs_name_hash(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
 /******************************************************************************
@@ -199,32 +546,105 @@ struct newfs_super_d {
 
     /* 根目录索引 */
     int root_ino;                  // 根目录对应的inode
+
+    int pack_tbl;                  // 共享块表所在的数据块号，-1 表示没有
 };
 
 struct newfs_inode_d {
     uint32_t ino;
     /* 文件的属性 */
     int                  size;               // 文件已占用空间
-    int                  link;               // 链接数，默认为1
-    NEWFS_FILE_TYPE      ftype;            // 文件类型（目录类型、普通文件类型）
-
-    /* 数据块的索引 */
-    int                  block_pointer[NEWFS_DATA_PER_FILE];   // 数据块块号（可固定分配）
+    uint16_t             link;               // 链接数，默认为1
+    uint8_t              ftype;              // 文件类型（目录类型、普通文件类型）
+    uint8_t              flags;              // NEWFS_INODE_* 标志
+
+    /* 数据块的索引或内嵌数据，按 flags 选择其中一种 */
+    union {
+        struct {
+            int          block_pointer[NEWFS_DATA_PER_FILE];   // 数据块块号（可固定分配）
+            int          ind_pointer;        // 一级间接块块号
+            int          dind_pointer;       // 二级间接块块号
+        };
+        struct {
+            uint16_t     ext_cnt;            // 区段个数
+            uint16_t     ext_rsv;
+            int          ext_pointer;        // 区段树根块号，区段全部内嵌时为-1
+            struct newfs_extent ext[NEWFS_INLINE_EXTS];        // 内嵌的区段
+        };
+        uint8_t          inline_data[NEWFS_INLINE_DATA_MAX];   // 内嵌的文件数据
+        struct {
+            int          pack_dno;           // 共享块块号
+            uint16_t     pack_slot;          // 在共享块中的槽号
+            uint16_t     pack_rsv;
+        };
+    };
 
     /* 其他字段 */
     int                  dir_cnt;            // 如果是目录类型文件，下面有几个目录项
+    uint32_t             atime;              // 最近访问时间（秒）
+    uint32_t             mtime;              // 最近修改内容的时间
+    uint32_t             ctime;              // 最近修改内容或属性的时间
 };
 
-struct newfs_dentry_d {
-    /* 文件名称 */
-    char     fname[MAX_NAME_LEN];
+/**
+ * 区段树块（仿EXT4）：块首为 newfs_ext_hdr_d，depth 为 0 时后面是区段，
+ * 为 1 时后面是指向下一层区段块的索引项
+ */
+struct newfs_ext_hdr_d {
+    uint16_t magic;                          // NEWFS_EXT_MAGIC
+    uint16_t cnt;                            // 块内的有效项数
+    uint16_t depth;                          // 0 为叶子块
+    uint16_t rsv;
+};
 
-    /* inode编号 */
-    uint32_t ino;
+struct newfs_ext_idx_d {
+    uint32_t blk;                            // 该区段块中第一个区段的起始文件块号
+    uint32_t dno;                            // 区段块块号
+};
 
-    /* TODO: Define yourself */
-    /* 文件类型 */
-    NEWFS_FILE_TYPE      ftype;              // 文件类型（目录类型、普通文件类型）
+/**
+ * 小文件共享块（仿数据库的槽页）：块首为 newfs_pack_hdr_d 和槽表，文件数据从块尾向前存放，
+ * inode 记录（块号, 槽号），槽表给出数据在块内的（偏移, 长度）；
+ * 整理碎片时只移动块内的数据、改写槽表，槽号不变，不需要改动inode
+ */
+struct newfs_pack_hdr_d {
+    uint16_t magic;                          // NEWFS_PACK_MAGIC
+    uint16_t slot_cnt;                       // 槽表项数（含空闲槽）
+    uint16_t data_ofs;                       // 数据区的起始偏移
+    uint16_t rsv;
+};
+
+struct newfs_pack_slot_d {
+    uint16_t ofs;                            // 数据在块内的偏移
+    uint16_t len;                            // 数据长度，0 表示空闲槽
+};
+
+/**
+ * 共享块表：记录所有共享块及其可用字节数，挂载时读这一个块就能知道往哪里放
+ */
+struct newfs_pack_tbl_hdr_d {
+    uint16_t magic;                          // NEWFS_PACK_TBL_MAGIC
+    uint16_t cnt;                            // 共享块个数
+};
+
+struct newfs_pack_ent_d {
+    uint16_t dno;                            // 共享块块号
+    uint16_t free;                           // 可用字节数
+};
+
+/**
+ * 变长目录记录（仿EXT2），一个目录块被若干条记录首尾相接地铺满：
+ * | ino | rec_len | name_len | ftype | fname ... | (空闲) | 下一条记录 ...
+ * 
+ * rec_len 为到下一条记录的距离，删除记录时并入前一条记录；
+ * 块首记录被删除时留下 name_len 为 0 的空闲记录
+ */
+struct newfs_dentry_d {
+    uint32_t ino;                            // inode编号
+    uint16_t rec_len;                        // 记录长度，4字节对齐
+    uint8_t  name_len;                       // 名称长度，0 表示空闲记录
+    uint8_t  ftype;                          // 文件类型（目录类型、普通文件类型）
+    char     fname[];                        // 文件名称，不以'\0'结尾
 };
 
 
@@ -6,12 +6,22 @@
  * SECTION: 宏定义
  *******************************************************************************/
 #define OPTION(t, p) {t, offsetof(struct custom_options, p), 1}
+#define NOPTION(t, p) {t, offsetof(struct custom_options, p), 0}
 
 /******************************************************************************
  * SECTION: 全局变量
  *******************************************************************************/
 static const struct fuse_opt option_spec[] = {/* 用于FUSE文件系统解析参数 */
                                               OPTION("--device=%s", device),
+                                              OPTION("--extents", extents),
+                                              OPTION("--max_write=%u", max_write),
+                                              OPTION("--max_readahead=%u", max_readahead),
+                                              NOPTION("--no_big_writes", big_writes),
+                                              NOPTION("--sync_read", async_read),
+                                              OPTION("--attr_timeout=%lf", attr_timeout),
+                                              OPTION("--entry_timeout=%lf", entry_timeout),
+                                              NOPTION("--no_splice", splice),
+                                              OPTION("--pool_workers=%d", pool_workers),
                                               FUSE_OPT_END};
 
 struct custom_options newfs_options; /* 全局选项 */
@@ -28,22 +38,93 @@ static struct fuse_operations operations = {
     .mknod = newfs_mknod,     /* 创建文件，touch相关 */
     .write = newfs_write,            /* 写入文件 */
     .read = newfs_read,             /* 读文件 */
-    .utimens = newfs_utimens, /* 修改时间，忽略，避免touch报错 */
+    .write_buf = newfs_write_buf,   /* 写入文件，数据以 bufvec 给出 */
+    .read_buf = newfs_read_buf,     /* 读文件，磁盘上的整块交给 libfuse splice */
+    .utimens = newfs_utimens, /* 修改访问和修改时间 */
     .truncate = newfs_truncate,         /* 改变文件大小 */
+    .fallocate = newfs_fallocate,       /* 预分配数据块 */
     .unlink = newfs_unlink,           /* 删除文件 */
     .rmdir = newfs_rmdir,            /* 删除目录， rm -r */
     .rename = newfs_rename,           /* 重命名，mv */
 
     .open = newfs_open,
     .opendir = newfs_opendir,
+    .release = newfs_release,         /* 关闭文件，释放 fi->fh 中的句柄 */
+    .releasedir = newfs_releasedir,   /* 关闭目录 */
+    .fsync = newfs_fsync,             /* 把文件写回磁盘 */
     .access = newfs_access};
 /******************************************************************************
  * SECTION: 必做函数实现
  *******************************************************************************/
+/**
+ * @brief 取得操作对象的inode并加锁：打开时已把inode存放在 fi->fh 中，直接使用，
+ *        重命名和删除后仍然有效；没有句柄时按路径查找
+ *
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息，可以为NULL
+ * @param lock NEWFS_LOCK_RD 或 NEWFS_LOCK_WR，用完后 NEWFS_UNLOCK
+ * @param err 输出，返回NULL时的错误号
+ * @return struct newfs_inode* 找不到或读盘失败返回NULL
+ */
+static struct newfs_inode *newfs_fi_inode(const char *path, struct fuse_file_info *fi, int lock, int *err)
+{
+    boolean is_find, is_root;
+    struct newfs_dentry *dentry;
+    struct newfs_inode *inode;
+
+    if (fi != NULL && fi->fh != 0)
+    {
+        inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+        if (lock & NEWFS_LOCK_WR)
+        {
+            NEWFS_WRLOCK(inode);
+        }
+        else
+        {
+            NEWFS_RDLOCK(inode);
+        }
+        return inode;
+    }
+    dentry = newfs_lookup(path, &is_find, &is_root, lock);
+    if (dentry == NULL)
+    {
+        *err = NEWFS_LOOKUP_ERR(is_find);
+        return NULL;
+    }
+    if (!is_find)
+    {
+        newfs_lookup_unlock(dentry, is_find, lock);
+        *err = -NEWFS_ERROR_NOTFOUND;
+        return NULL;
+    }
+    return dentry->inode;
+}
+
+/**
+ * @brief 取得要读的文件的inode：一般只加读锁，多个读者可以并行；
+ *        写合并缓冲区中有暂存数据时读可能要先把它写进文件，这时改加写锁
+ *
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @param err 输出，返回NULL时的错误号
+ * @return struct newfs_inode* 找不到或读盘失败返回NULL
+ */
+static struct newfs_inode *newfs_fi_inode_for_read(const char *path, struct fuse_file_info *fi, int *err)
+{
+    struct newfs_inode *inode = newfs_fi_inode(path, fi, NEWFS_LOCK_RD, err);
+
+    if (inode != NULL && inode->stage_len > 0)
+    {
+        NEWFS_UNLOCK(inode);
+        inode = newfs_fi_inode(path, fi, NEWFS_LOCK_WR, err);
+    }
+    return inode;
+}
+
 /**
  * @brief 挂载（mount）文件系统
  *
- * @param conn_info 可忽略，一些建立连接相关的信息
+ * @param conn_info 建立连接相关的信息，在这里协商传输参数
  * @return void*
  */
 void *newfs_init(struct fuse_conn_info *conn_info)
@@ -55,6 +136,8 @@ void *newfs_init(struct fuse_conn_info *conn_info)
         fuse_exit(fuse_get_context()->fuse);
         return NULL;
     }
+    newfs_negotiate_conn(conn_info, newfs_options);
+    newfs_pool_start(newfs_options.pool_workers);    /* 在 fuse_daemonize 之后才开线程 */
     return NULL;
 
     /* 下面是一个控制设备的示例 */
@@ -70,7 +153,9 @@ void *newfs_init(struct fuse_conn_info *conn_info)
 void newfs_destroy(void *p)
 {
     /* TODO: 在这里进行卸载 */
-    if (newfs_umount() != NEWFS_ERROR_NONE)
+    int ret = newfs_umount();                        /* 卸载时的写回还要用线程池 */
+    newfs_pool_stop();
+    if (ret != NEWFS_ERROR_NONE)
     {
         NEWFS_DBG("[%s] unmount error\n", __func__);
         fuse_exit(fuse_get_context()->fuse);
@@ -91,28 +176,24 @@ int newfs_mkdir(const char *path, mode_t mode)
     /* TODO: 解析路径，创建目录 */
     (void)mode;
     boolean is_find, is_root;
-    char *fname;
-    struct newfs_dentry *last_dentry = newfs_lookup(path, &is_find, &is_root);
-    struct newfs_dentry *dentry;
-    struct newfs_inode *inode;
+    int ret;
+    struct newfs_dentry *last_dentry = newfs_lookup(path, &is_find, &is_root, 
+                                                    NEWFS_LOCK_RD | NEWFS_LOCK_PARENT);
 
-    if (is_find)
+    if (last_dentry == NULL)
     {
-        return -NEWFS_ERROR_EXISTS;
+        return NEWFS_LOOKUP_ERR(is_find);
     }
 
-    if (NEWFS_IS_REG(last_dentry->inode))
+    if (is_find)
     {
-        return -NEWFS_ERROR_UNSUPPORTED;
+        newfs_lookup_unlock(last_dentry, is_find, NEWFS_LOCK_RD | NEWFS_LOCK_PARENT);
+        return -NEWFS_ERROR_EXISTS;
     }
 
-    fname = newfs_get_fname(path);
-    dentry = new_dentry(fname, NEWFS_DIR);
-    dentry->parent = last_dentry;
-    inode = newfs_alloc_inode(dentry);              // son 的 inode
-    newfs_alloc_dentry(last_dentry->inode, dentry); // parent 的 inode
-
-    return NEWFS_ERROR_NONE;
+    ret = newfs_create(last_dentry, newfs_get_fname(path), NEWFS_DIR, NULL);
+    newfs_lookup_unlock(last_dentry, is_find, NEWFS_LOCK_RD | NEWFS_LOCK_PARENT);
+    return ret;
 }
 
 /**
@@ -125,37 +206,15 @@ int newfs_mkdir(const char *path, mode_t mode)
 int newfs_getattr(const char *path, struct stat *newfs_stat)
 {
     /* TODO: 解析路径，获取Inode，填充newfs_stat*/
-    boolean is_find, is_root;
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
-    if (is_find == FALSE)
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, NULL, NEWFS_LOCK_RD, &err);
+    if (inode == NULL)
     {
-        return -NEWFS_ERROR_NOTFOUND;
+        return err;
     }
 
-    if (NEWFS_IS_DIR(dentry->inode))
-    {
-        newfs_stat->st_mode = S_IFDIR | NEWFS_DEFAULT_PERM;
-        newfs_stat->st_size = dentry->inode->dir_cnt * sizeof(struct newfs_dentry_d); // 文件大小
-    }
-    else if (NEWFS_IS_REG(dentry->inode))
-    {
-        newfs_stat->st_mode = S_IFREG | NEWFS_DEFAULT_PERM;
-        newfs_stat->st_size = dentry->inode->size;
-    }
-
-    newfs_stat->st_nlink = 1;
-    newfs_stat->st_uid = getuid();
-    newfs_stat->st_gid = getgid();
-    newfs_stat->st_atime = time(NULL);
-    newfs_stat->st_mtime = time(NULL);
-    newfs_stat->st_blksize = NEWFS_BLK_SZ(); // 逻辑块大小
-
-    if (is_root)
-    {
-        newfs_stat->st_size = newfs_super.sz_usage;
-        newfs_stat->st_blocks = NEWFS_DISK_SZ() / NEWFS_BLK_SZ(); // 文件块数
-        newfs_stat->st_nlink = 2;                                 /* !特殊，根目录link数为2 */
-    }
+    newfs_fill_stat(inode, newfs_stat);
+    NEWFS_UNLOCK(inode);
     return NEWFS_ERROR_NONE;
 }
 
@@ -181,23 +240,28 @@ int newfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
                   struct fuse_file_info *fi)
 {
     /* TODO: 解析路径，获取目录的Inode，并读取目录项，利用filler填充到buf */
-    boolean is_find, is_root;
     int cur_dir = offset;
+    struct stat st;
 
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
-    struct newfs_dentry *sub_dentry;
-    struct newfs_inode *inode;
-    if (is_find)
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, fi, NEWFS_LOCK_RD, &err);
+    if (inode != NULL)
     {
-        inode = dentry->inode;
-        sub_dentry = newfs_get_dentry(inode, cur_dir);
-        if (sub_dentry)
+        /* 直接线性扫描子项数组，直到buf填满；子项记录中已有 inode 号和类型 */
+        memset(&st, 0, sizeof(struct stat));
+        for (; cur_dir < inode->dir_cnt; cur_dir++)
         {
-            filler(buf, sub_dentry->fname, NULL, ++offset);
+            st.st_ino  = NEWFS_ST_INO(inode->dirents[cur_dir].ino);
+            st.st_mode = inode->dirents[cur_dir].ftype == NEWFS_DIR ? S_IFDIR : S_IFREG;
+            if (filler(buf, NEWFS_DIRENT_NAME(inode, cur_dir), &st, cur_dir + 1))
+            {
+                break;
+            }
         }
+        NEWFS_UNLOCK(inode);
         return NEWFS_ERROR_NONE;
     }
-    return -NEWFS_ERROR_NOTFOUND;
+    return err;
 }
 
 /**
@@ -212,49 +276,46 @@ int newfs_mknod(const char *path, mode_t mode, dev_t dev)
 {
     /* TODO: 解析路径，并创建相应的文件 */
     boolean is_find, is_root;
+    int ret;
+    struct newfs_dentry *last_dentry = newfs_lookup(path, &is_find, &is_root, 
+                                                    NEWFS_LOCK_RD | NEWFS_LOCK_PARENT);
 
-    struct newfs_dentry *last_dentry = newfs_lookup(path, &is_find, &is_root);
-    struct newfs_dentry *dentry;
-    struct newfs_inode *inode;
-    char *fname;
-
-    if (is_find == TRUE)
+    if (last_dentry == NULL)
     {
-        return -NEWFS_ERROR_EXISTS;
+        return NEWFS_LOOKUP_ERR(is_find);
     }
 
-    fname = newfs_get_fname(path);
-
-    if (S_ISREG(mode))
-    {
-        dentry = new_dentry(fname, NEWFS_REG_FILE);
-    }
-    else if (S_ISDIR(mode))
-    {
-        dentry = new_dentry(fname, NEWFS_DIR);
-    }
-    else
+    if (is_find == TRUE)
     {
-        dentry = new_dentry(fname, NEWFS_REG_FILE);
+        newfs_lookup_unlock(last_dentry, is_find, NEWFS_LOCK_RD | NEWFS_LOCK_PARENT);
+        return -NEWFS_ERROR_EXISTS;
     }
-    dentry->parent = last_dentry;
-    inode = newfs_alloc_inode(dentry);
-    newfs_alloc_dentry(last_dentry->inode, dentry);
 
-    return NEWFS_ERROR_NONE;
+    ret = newfs_create(last_dentry, newfs_get_fname(path), 
+                       S_ISDIR(mode) ? NEWFS_DIR : NEWFS_REG_FILE, NULL);
+    newfs_lookup_unlock(last_dentry, is_find, NEWFS_LOCK_RD | NEWFS_LOCK_PARENT);
+    return ret;
 }
 
 /**
- * @brief 修改时间，为了不让touch报错
+ * @brief 修改访问时间和修改时间
  *
  * @param path 相对于挂载点的路径
- * @param tv 实践
+ * @param tv tv[0] 为访问时间，tv[1] 为修改时间，可以是 UTIME_NOW 或 UTIME_OMIT
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_utimens(const char *path, const struct timespec tv[2])
 {
-    (void)path;
-    return 0;
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, NULL, NEWFS_LOCK_WR, &err);
+
+    if (inode == NULL)
+    {
+        return err;
+    }
+    newfs_set_times(inode, tv);
+    NEWFS_UNLOCK(inode);
+    return NEWFS_ERROR_NONE;
 }
 /******************************************************************************
  * SECTION: 选做函数实现
@@ -266,68 +327,31 @@ int newfs_utimens(const char *path, const struct timespec tv[2])
  * @param buf 写入的内容
  * @param size 写入的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息，fi->fh 中是打开时存放的inode
  * @return int 写入大小
  */
 int newfs_write(const char *path, const char *buf, size_t size, off_t offset,
                 struct fuse_file_info *fi)
 {
-    boolean is_find, is_root;
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
-    struct newfs_inode *inode;
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, fi, NEWFS_LOCK_WR, &err);
+    int ret;
 
-    if (!is_find)
+    if (inode == NULL)
     {
-        return -NEWFS_ERROR_NOTFOUND;
+        return err;
     }
 
-    inode = dentry->inode;
     if (NEWFS_IS_DIR(inode))
     {
+        NEWFS_UNLOCK(inode);
         return -NEWFS_ERROR_ISDIR;
     }
 
-    // 计算需要的数据块
-    int blk_start = offset / NEWFS_BLK_SZ();
-    int blk_end = (offset + size - 1) / NEWFS_BLK_SZ();
-    int write_size = 0;
-
-    // 检查并分配所需的数据块
-    for (int i = blk_start; i <= blk_end && i < NEWFS_DATA_PER_FILE; i++)
-    {
-        if (inode->block_pointer[i] == -1)
-        {
-            // 分配新的数据块
-            int ret = newfs_alloc_data_blk(inode, i);
-            if (ret != NEWFS_ERROR_NONE)
-            {
-                return ret;
-            }
-        }
-
-        int cur_offset = (i == blk_start) ? offset % NEWFS_BLK_SZ() : 0;
-        int cur_size = NEWFS_BLK_SZ() - cur_offset;
-        if (i == blk_end)
-        {
-            cur_size = ((offset + size) % NEWFS_BLK_SZ()) - cur_offset;
-            if (cur_size <= 0)
-                cur_size = NEWFS_BLK_SZ() - cur_offset;
-        }
-        if (write_size + cur_size > size)
-        {
-            cur_size = size - write_size;
-        }
-
-        memcpy(inode->data[i] + cur_offset, buf + write_size, cur_size);
-        write_size += cur_size;
-    }
-
-    if (offset + size > inode->size)
-    {
-        inode->size = offset + size;
-    }
-
-    return write_size;
+    // 首尾相接的小块写入先攒起来，再按整段映射写入
+    ret = newfs_inode_stage_write(inode, (const uint8_t *)buf, size, offset);
+    NEWFS_UNLOCK(inode);
+    return ret;
 }
 
 /**
@@ -337,57 +361,109 @@ int newfs_write(const char *path, const char *buf, size_t size, off_t offset,
  * @param buf 读取的内容
  * @param size 读取的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息，fi->fh 中是打开时存放的inode
  * @return int 读取大小
  */
 int newfs_read(const char *path, char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi)
 {
-    boolean is_find, is_root;
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
-    struct newfs_inode *inode;
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode_for_read(path, fi, &err);
+    int ret;
 
-    if (!is_find)
+    if (inode == NULL)
     {
-        return -NEWFS_ERROR_NOTFOUND;
+        return err;
     }
 
-    inode = dentry->inode;
     if (NEWFS_IS_DIR(inode))
     {
+        NEWFS_UNLOCK(inode);
         return -NEWFS_ERROR_ISDIR;
     }
 
     if (inode->size < offset)
     {
+        NEWFS_UNLOCK(inode);
         return -NEWFS_ERROR_SEEK;
     }
 
-    // 计算要读取的数据块
-    int blk_start = offset / NEWFS_BLK_SZ();
-    int blk_end = (offset + size - 1) / NEWFS_BLK_SZ();
-    int read_size = 0;
+    // 按块映射读出，读到文件末尾为止
+    ret = newfs_inode_read(inode, (uint8_t *)buf, size, offset);
+    NEWFS_UNLOCK(inode);
+    return ret;
+}
 
-    // 读取每个数据块的内容
-    for (int i = blk_start; i <= blk_end && i < NEWFS_DATA_PER_FILE; i++)
+/**
+ * @brief 写入文件，数据以 bufvec 给出，可能是 splice 进来的管道
+ *
+ * @param path 相对于挂载点的路径
+ * @param buf 写入的内容
+ * @param offset 相对文件的偏移
+ * @param fi 文件信息，fi->fh 中是打开时存放的inode
+ * @return int 写入大小
+ */
+int newfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, fi, NEWFS_LOCK_WR, &err);
+    int ret;
+
+    if (inode == NULL)
     {
-        int cur_offset = (i == blk_start) ? offset % NEWFS_BLK_SZ() : 0;
-        int cur_size = NEWFS_BLK_SZ() - cur_offset;
-        if (i == blk_end)
-        {
-            cur_size = ((offset + size) % NEWFS_BLK_SZ()) - cur_offset;
-            if (cur_size <= 0)
-                cur_size = NEWFS_BLK_SZ() - cur_offset;
-        }
-        if (read_size + cur_size > size)
-        {
-            cur_size = size - read_size;
-        }
-        memcpy(buf + read_size, inode->data[i] + cur_offset, cur_size);
-        read_size += cur_size;
+        return err;
+    }
+
+    if (NEWFS_IS_DIR(inode))
+    {
+        NEWFS_UNLOCK(inode);
+        return -NEWFS_ERROR_ISDIR;
+    }
+
+    ret = newfs_inode_write_buf(inode, buf, offset);
+    NEWFS_UNLOCK(inode);
+    return ret;
+}
+
+/**
+ * @brief 读取文件，只在磁盘上的整块以镜像文件的描述符和偏移给出，由 libfuse splice
+ *
+ * @param path 相对于挂载点的路径
+ * @param bufp 输出的 bufvec，由 libfuse 释放
+ * @param size 读取的字节数
+ * @param offset 相对文件的偏移
+ * @param fi 文件信息，fi->fh 中是打开时存放的inode
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode_for_read(path, fi, &err);
+    int ret;
+
+    if (inode == NULL)
+    {
+        return err;
+    }
+
+    if (NEWFS_IS_DIR(inode))
+    {
+        NEWFS_UNLOCK(inode);
+        return -NEWFS_ERROR_ISDIR;
+    }
+
+    if (inode->size < offset)
+    {
+        NEWFS_UNLOCK(inode);
+        return -NEWFS_ERROR_SEEK;
     }
 
-    return read_size;
+    // libfuse 在返回之后才从描述符读数据，那时已不持有inode锁，与并发的截断、删除同时发生时可能读到过时的内容
+    ret = newfs_inode_read_buf(inode, bufp, size, offset);
+    NEWFS_UNLOCK(inode);
+    return ret < 0 ? ret : NEWFS_ERROR_NONE;
 }
 
 /**
@@ -398,26 +474,36 @@ int newfs_read(const char *path, char *buf, size_t size, off_t offset,
  */
 int newfs_unlink(const char *path) {
     boolean is_find, is_root;
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
+    int lock = NEWFS_LOCK_WR | NEWFS_LOCK_PARENT;
+    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root, lock);
     struct newfs_inode *inode;
+    struct newfs_inode *parent;
+    int ret;
     
+    if (dentry == NULL) {
+        return NEWFS_LOOKUP_ERR(is_find);
+    }
+
     if (is_find == FALSE) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_NOTFOUND;
     }
 
     if (is_root) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_INVAL;  // 不能删除根目录
     }
 
     inode = dentry->inode;
     if (NEWFS_IS_DIR(inode)) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_ISDIR;  // 不能用unlink删除目录
     }
 
-    newfs_drop_inode(inode);                         // 删除inode及其对应的数据块
-    newfs_drop_dentry(dentry->parent->inode, dentry);// 从父目录的目录项链表中删除该目录项
-    
-    return NEWFS_ERROR_NONE;
+    parent = dentry->parent->inode;
+    ret = newfs_remove(dentry);                      // 删除inode及其数据块，并从父目录中删除该目录项
+    NEWFS_UNLOCK(parent);
+    return ret;
 }
 
 /**
@@ -434,30 +520,41 @@ int newfs_unlink(const char *path) {
  */
 int newfs_rmdir(const char *path) {
     boolean is_find, is_root;
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
+    int lock = NEWFS_LOCK_WR | NEWFS_LOCK_PARENT;
+    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root, lock);
     struct newfs_inode *inode;
+    struct newfs_inode *parent;
+    int ret;
     
+    if (dentry == NULL) {
+        return NEWFS_LOOKUP_ERR(is_find);
+    }
+
     if (is_find == FALSE) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_NOTFOUND;
     }
 
     if (is_root) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_INVAL;  // 不能删除根目录
     }
 
     inode = dentry->inode;
     if (!NEWFS_IS_DIR(inode)) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_NOTDIR;  // 不是目录
     }
 
     if (inode->dir_cnt != 0) {
+        newfs_lookup_unlock(dentry, is_find, lock);
         return -NEWFS_ERROR_NOTEMPTY;  // 目录不为空
     }
 
-    newfs_drop_inode(inode);                         // 删除inode及其对应的数据块
-    newfs_drop_dentry(dentry->parent->inode, dentry);// 从父目录的目录项链表中删除该目录项
-    
-    return NEWFS_ERROR_NONE;
+    parent = dentry->parent->inode;
+    ret = newfs_remove(dentry);                      // 删除inode及其数据块，并从父目录中删除该目录项
+    NEWFS_UNLOCK(parent);
+    return ret;
 }
 
 /**
@@ -470,40 +567,84 @@ int newfs_rmdir(const char *path) {
 int newfs_rename(const char *from, const char *to)
 {
     /* 选做 */
-    int ret = NEWFS_ERROR_NONE;
 	boolean	is_find, is_root;
-	struct newfs_dentry* from_dentry = newfs_lookup(from, &is_find, &is_root);
+	struct newfs_dentry* from_dentry;
+	struct newfs_dentry* to_parent;
+	struct newfs_inode*  from_dir;
+	struct newfs_inode*  to_dir;
 	struct newfs_inode*  from_inode;
-	struct newfs_dentry* to_dentry;
-	mode_t mode = 0;
-	if (is_find == FALSE) {
-		return -NEWFS_ERROR_NOTFOUND;
-	}
+	int from_len = strlen(from);
+	int ret;
 
 	if (strcmp(from, to) == 0) {
 		return NEWFS_ERROR_NONE;
 	}
+	if (strncmp(from, to, from_len) == 0 && to[from_len] == '/') {
+		return -NEWFS_ERROR_INVAL;                    /* 不能移到自己下面 */
+	}
 
-	from_inode = from_dentry->inode;
-	
-	if (NEWFS_IS_DIR(from_inode)) {
-		mode = S_IFDIR;
+	// rename 之间串行，期间目录之间的父子关系不会改变；先找到两个父目录并用打开计数钉住
+	pthread_mutex_lock(&newfs_super.rename_lock);
+	from_dentry = newfs_lookup(from, &is_find, &is_root, NEWFS_LOCK_RD);
+	if (from_dentry == NULL) {
+		pthread_mutex_unlock(&newfs_super.rename_lock);
+		return NEWFS_LOOKUP_ERR(is_find);
+	}
+	if (!is_find || is_root) {
+		newfs_lookup_unlock(from_dentry, is_find, NEWFS_LOCK_RD);
+		pthread_mutex_unlock(&newfs_super.rename_lock);
+		return is_root ? -NEWFS_ERROR_INVAL : -NEWFS_ERROR_NOTFOUND;
 	}
-	else if (NEWFS_IS_REG(from_inode)) {
-		mode = S_IFREG;
+	from_dir = from_dentry->parent->inode;
+	newfs_inode_get(from_dir);                        /* 它下面还有 from，此时不会被删除 */
+	newfs_lookup_unlock(from_dentry, is_find, NEWFS_LOCK_RD);
+
+	to_parent = newfs_lookup(to, &is_find, &is_root, NEWFS_LOCK_RD);
+	if (to_parent == NULL || is_find) {               /* 保证目的文件不存在 */
+		newfs_lookup_unlock(to_parent, is_find, NEWFS_LOCK_RD);
+		pthread_mutex_unlock(&newfs_super.rename_lock);
+		newfs_inode_put(from_dir);
+		return to_parent == NULL ? NEWFS_LOOKUP_ERR(is_find) : -NEWFS_ERROR_EXISTS;
 	}
-	
-	ret = newfs_mknod(to, mode, NULL);
-	if (ret != NEWFS_ERROR_NONE) {					  /* 保证目的文件不存在 */
-		return ret;
+	to_dir = to_parent->inode;
+	newfs_inode_get(to_dir);
+	newfs_lookup_unlock(to_parent, is_find, NEWFS_LOCK_RD);
+
+	// 两个父目录都加写锁：第二把拿不到时全部放开、换个顺序重来，不会与查找的逐级加锁形成环
+	while (TRUE) {
+		NEWFS_WRLOCK(from_dir);
+		if (to_dir == from_dir || pthread_rwlock_trywrlock(&to_dir->lock) == 0) {
+			break;
+		}
+		NEWFS_UNLOCK(from_dir);
+		NEWFS_WRLOCK(to_dir);
+		if (pthread_rwlock_trywrlock(&from_dir->lock) == 0) {
+			break;
+		}
+		NEWFS_UNLOCK(to_dir);
+		sched_yield();
 	}
-	
-	to_dentry = newfs_lookup(to, &is_find, &is_root);	  
-	newfs_drop_inode(to_dentry->inode);				  /* 保证生成的inode被释放 */	
-	to_dentry->ino = from_inode->ino;				  /* 指向新的inode */
-	to_dentry->inode = from_inode;
-	
-	newfs_drop_dentry(from_dentry->parent->inode, from_dentry);
+
+	// 放开锁的间隙里源文件或父目录可能已被删除，重新确认
+	is_find = FALSE;
+	from_dentry = from_dir->unlinked || to_dir->unlinked ? NULL : 
+				  newfs_lookup_child(from_dir, newfs_get_fname(from), &is_find);
+	if (from_dentry == NULL) {
+		ret = NEWFS_LOOKUP_ERR(is_find);
+	}
+	else {
+		from_inode = from_dentry->inode;
+		NEWFS_WRLOCK(from_inode);
+		ret = newfs_move(from_dentry, to_dir->dentry, newfs_get_fname(to));
+		NEWFS_UNLOCK(from_inode);
+	}
+	if (to_dir != from_dir) {
+		NEWFS_UNLOCK(to_dir);
+	}
+	NEWFS_UNLOCK(from_dir);
+	pthread_mutex_unlock(&newfs_super.rename_lock);
+	newfs_inode_put(to_dir);
+	newfs_inode_put(from_dir);
 	return ret;
 }
 
@@ -517,6 +658,18 @@ int newfs_rename(const char *from, const char *to)
  */
 int newfs_open(const char *path, struct fuse_file_info *fi)
 {
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, NULL, NEWFS_LOCK_RD, &err);
+
+    if (inode == NULL)
+    {
+        return err;
+    }
+
+    // 之后的读写直接使用句柄中的inode，不再按路径查找
+    newfs_inode_get(inode);
+    NEWFS_UNLOCK(inode);
+    fi->fh = (uint64_t)(uintptr_t)inode;
     return NEWFS_ERROR_NONE;
 }
 
@@ -529,9 +682,67 @@ int newfs_open(const char *path, struct fuse_file_info *fi)
  */
 int newfs_opendir(const char *path, struct fuse_file_info *fi)
 {
+    return newfs_open(path, fi);
+}
+
+/**
+ * @brief 关闭文件：释放 fi->fh 中的句柄，文件已被删除且这是最后一个句柄时才真正删除inode
+ *
+ * @param path 相对于挂载点的路径，可能已经失效
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_release(const char *path, struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+
+    if (inode == NULL)
+    {
+        return NEWFS_ERROR_NONE;
+    }
+    fi->fh = 0;
+    newfs_inode_put(inode);
     return NEWFS_ERROR_NONE;
 }
 
+/**
+ * @brief 关闭目录
+ *
+ * @param path 相对于挂载点的路径，可能已经失效
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    return newfs_release(path, fi);
+}
+
+/**
+ * @brief 把文件暂存和改过的数据、inode写回磁盘
+ *
+ * @param path 相对于挂载点的路径
+ * @param datasync 可忽略
+ * @param fi 文件信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, fi, NEWFS_LOCK_WR, &err);
+    int ret = NEWFS_ERROR_NONE;
+
+    if (inode == NULL)
+    {
+        return err;
+    }
+    if (!inode->unlinked && inode->dirty_pprev != NULL)
+    {
+        ret = newfs_sync_inode(inode);
+    }
+    NEWFS_UNLOCK(inode);
+    return ret;
+}
+
 /**
  * @brief 改变文件大小
  *
@@ -540,30 +751,72 @@ int newfs_opendir(const char *path, struct fuse_file_info *fi)
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_truncate(const char *path, off_t offset) {
-    boolean is_find, is_root;
-    
+    int ret;
+
     // 1. 查找文件
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
-    if (!is_find) {
-        return -NEWFS_ERROR_NOTFOUND;
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, NULL, NEWFS_LOCK_WR, &err);
+    if (inode == NULL) {
+        return err;
     }
     
     // 2. 检查是否为目录
-    struct newfs_inode *inode = dentry->inode;
     if (NEWFS_IS_DIR(inode)) {
+        NEWFS_UNLOCK(inode);
         return -NEWFS_ERROR_ISDIR;
     }
     
     // 3. 检查新大小是否需要的数据块数超出限制
     int new_blks = NEWFS_ROUND_UP(offset, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ();
-    if (new_blks > NEWFS_DATA_PER_FILE) {
-        return -NEWFS_ERROR_NOSPACE;
+    if (new_blks > NEWFS_MAX_FILE_BLKS()) {
+        NEWFS_UNLOCK(inode);
+        return -NEWFS_ERROR_FBIG;
     }
     
-    // 4. 更新文件大小
-    inode->size = offset;
-    
-    return NEWFS_ERROR_NONE;
+    // 4. 更新文件大小，扩大的部分为空洞，缩小时归还末尾之后的数据块
+    ret = newfs_inode_truncate(inode, offset);
+    NEWFS_UNLOCK(inode);
+    return ret;
+}
+
+/**
+ * @brief 预分配文件数据块，支持 mode 为0和 FALLOC_FL_KEEP_SIZE
+ *
+ * @param path 相对于挂载点的路径
+ * @param mode 预分配模式
+ * @param offset 起始偏移
+ * @param length 长度
+ * @param fi 可忽略
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fallocate(const char *path, int mode, off_t offset, off_t length, 
+                    struct fuse_file_info *fi) {
+    int ret;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -NEWFS_ERROR_OPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, fi, NEWFS_LOCK_WR, &err);
+    if (inode == NULL) {
+        return err;
+    }
+    if (NEWFS_IS_DIR(inode)) {
+        NEWFS_UNLOCK(inode);
+        return -NEWFS_ERROR_ISDIR;
+    }
+    if (NEWFS_ROUND_UP(offset + length, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ() > NEWFS_MAX_FILE_BLKS()) {
+        NEWFS_UNLOCK(inode);
+        return -NEWFS_ERROR_FBIG;
+    }
+
+    ret = newfs_inode_fallocate(inode, offset, length, (mode & FALLOC_FL_KEEP_SIZE) != 0);
+    NEWFS_UNLOCK(inode);
+    return ret;
 }
 
 /**
@@ -580,9 +833,14 @@ int newfs_truncate(const char *path, off_t offset) {
  */
 int newfs_access(const char *path, int type)
 {
-    boolean is_find, is_root;
-    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
-    return is_find ? NEWFS_ERROR_NONE : -NEWFS_ERROR_NOTFOUND;
+    int err;
+    struct newfs_inode *inode = newfs_fi_inode(path, NULL, NEWFS_LOCK_RD, &err);
+    if (inode == NULL)
+    {
+        return err;
+    }
+    NEWFS_UNLOCK(inode);
+    return NEWFS_ERROR_NONE;
 }
 /******************************************************************************
  * SECTION: FUSE入口
@@ -590,13 +848,28 @@ int newfs_access(const char *path, int type)
 int main(int argc, char **argv)
 {
     int ret;
+    char cache_opts[128];
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     newfs_options.device = strdup("TODO: 这里填写你的ddriver设备路径");
+    newfs_options.max_write     = NEWFS_MAX_WRITE;
+    newfs_options.max_readahead = NEWFS_MAX_READAHEAD;
+    newfs_options.big_writes    = 1;
+    newfs_options.async_read    = 1;
+    newfs_options.attr_timeout  = NEWFS_CACHE_TIMEOUT;
+    newfs_options.entry_timeout = NEWFS_CACHE_TIMEOUT;
+    newfs_options.splice        = 1;
+    newfs_options.pool_workers  = NEWFS_POOL_WORKERS;
 
     if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
         return -1;
 
+    // 报告真实的 inode 号，并让内核按设定的时间缓存属性和名称查找结果
+    snprintf(cache_opts, sizeof(cache_opts), "-ouse_ino,attr_timeout=%g,entry_timeout=%g",
+             newfs_options.attr_timeout, newfs_options.entry_timeout);
+    if (fuse_opt_add_arg(&args, cache_opts) == -1)
+        return -1;
+
     ret = fuse_main(args.argc, args.argv, &operations, NULL);
     fuse_opt_free_args(&args);
     return ret;
@@ -0,0 +1,620 @@
+#define _XOPEN_SOURCE 700
+
+#include "newfs.h"
+#include <fuse_lowlevel.h>
+
+/******************************************************************************
+ * SECTION: 宏定义
+ *******************************************************************************/
+#define OPTION(t, p) {t, offsetof(struct custom_options, p), 1}
+#define NOPTION(t, p) {t, offsetof(struct custom_options, p), 0}
+
+// FUSE 的根目录固定为 FUSE_ROOT_ID，newfs 的 inode 号整体加上这个偏移
+#define NEWFS_LL_INO(ino)        ((fuse_ino_t)(ino) + FUSE_ROOT_ID - NEWFS_ROOT_INO)
+#define NEWFS_LL_NEWFS_INO(ino)  ((int)((ino) - FUSE_ROOT_ID + NEWFS_ROOT_INO))
+
+/******************************************************************************
+ * SECTION: 全局变量
+ *******************************************************************************/
+static const struct fuse_opt option_spec[] = {/* 用于FUSE文件系统解析参数 */
+                                              OPTION("--device=%s", device),
+                                              OPTION("--extents", extents),
+                                              OPTION("--max_write=%u", max_write),
+                                              OPTION("--max_readahead=%u", max_readahead),
+                                              NOPTION("--no_big_writes", big_writes),
+                                              NOPTION("--sync_read", async_read),
+                                              OPTION("--attr_timeout=%lf", attr_timeout),
+                                              OPTION("--entry_timeout=%lf", entry_timeout),
+                                              NOPTION("--no_splice", splice),
+                                              OPTION("--pool_workers=%d", pool_workers),
+                                              FUSE_OPT_END};
+
+struct custom_options newfs_options; /* 全局选项 */
+struct newfs_super newfs_super;
+
+/**
+ * 内核持有的inode：lookup 每返回一次 nlookup 加一，forget 时减去；
+ * nlookup 不为0时inode计入 open_cnt，被删除后也要等内核 forget 才真正释放
+ */
+struct newfs_ll_node {
+    struct newfs_inode* inode;
+    uint64_t            nlookup;
+};
+
+static struct newfs_ll_node* newfs_ll_nodes;    /* 按 newfs 的 inode 号索引 */
+
+/******************************************************************************
+ * SECTION: inode号与inode的对应
+ *******************************************************************************/
+/**
+ * @brief 由 FUSE 的 inode 号取得内核持有的inode
+ *
+ * @param ino FUSE 的 inode 号
+ * @return struct newfs_inode* 内核没有持有或没能挂载时返回NULL
+ */
+static struct newfs_inode *newfs_ll_inode(fuse_ino_t ino)
+{
+    int nino = NEWFS_LL_NEWFS_INO(ino);
+    if (newfs_ll_nodes == NULL || nino < 0 || nino >= newfs_super.max_ino)
+    {
+        return NULL;
+    }
+    return newfs_ll_nodes[nino].inode;
+}
+
+/**
+ * @brief 把dentry对应的inode交给内核：记一次 lookup 并填好回复的 entry
+ *
+ * @param dentry 子项，inode 已读入
+ * @param e 返回的 entry
+ */
+static void newfs_ll_ref(struct newfs_dentry *dentry, struct fuse_entry_param *e)
+{
+    struct newfs_inode   *inode = dentry->inode;
+    struct newfs_ll_node *node  = &newfs_ll_nodes[inode->ino];
+
+    if (node->nlookup++ == 0)
+    {
+        node->inode = inode;
+        newfs_inode_get(inode);
+    }
+
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino           = NEWFS_LL_INO(inode->ino);
+    e->attr_timeout  = newfs_options.attr_timeout;
+    e->entry_timeout = newfs_options.entry_timeout;
+    newfs_fill_stat(inode, &e->attr);
+}
+
+/**
+ * @brief 打开的句柄关闭或内核 forget 后释放一次引用，已删除的inode在最后一次时真正删除
+ *
+ * @param inode
+ */
+static void newfs_ll_unref(struct newfs_inode *inode)
+{
+    newfs_inode_put(inode);
+}
+
+/******************************************************************************
+ * SECTION: 低层接口实现
+ *******************************************************************************/
+/**
+ * @brief 挂载（mount）文件系统，根目录由内核一直持有。挂载失败时结束会话，
+ *        节点表保持为NULL，结束前到达的请求都按找不到处理
+ *
+ * @param userdata 指向 main 中的 fuse_session 指针
+ * @param conn_info 建立连接相关的信息，在这里协商传输参数
+ */
+static void newfs_ll_init(void *userdata, struct fuse_conn_info *conn_info)
+{
+    if (newfs_mount(newfs_options) != NEWFS_ERROR_NONE)
+    {
+        NEWFS_DBG("[%s] mount error\n", __func__);
+        fuse_session_exit(*(struct fuse_session **)userdata);
+        return;
+    }
+    newfs_negotiate_conn(conn_info, newfs_options);
+    newfs_pool_start(newfs_options.pool_workers);    /* 在 fuse_daemonize 之后才开线程 */
+    newfs_ll_nodes = (struct newfs_ll_node *)calloc(newfs_super.max_ino, sizeof(struct newfs_ll_node));
+    newfs_ll_nodes[NEWFS_ROOT_INO].inode   = newfs_super.root_dentry->inode;
+    newfs_ll_nodes[NEWFS_ROOT_INO].nlookup = 1;
+}
+
+/**
+ * @brief 卸载（umount）文件系统
+ *
+ * @param userdata 可忽略
+ */
+static void newfs_ll_destroy(void *userdata)
+{
+    if (newfs_ll_nodes == NULL)                      /* 没能挂载 */
+    {
+        return;
+    }
+    if (newfs_umount() != NEWFS_ERROR_NONE)
+    {
+        NEWFS_DBG("[%s] unmount error\n", __func__);
+    }
+    newfs_pool_stop();                               /* 卸载时的写回还要用线程池 */
+    free(newfs_ll_nodes);
+    newfs_ll_nodes = NULL;
+}
+
+/**
+ * @brief 在目录 parent 下按名称查找子项
+ */
+static void newfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct newfs_inode     *dir = newfs_ll_inode(parent);
+    struct newfs_dentry    *dentry;
+    struct fuse_entry_param e;
+    boolean                 is_find;
+
+    if (dir == NULL || !NEWFS_IS_DIR(dir))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTDIR);
+        return;
+    }
+    dentry = newfs_lookup_child(dir, name, &is_find);
+    if (dentry == NULL)
+    {
+        fuse_reply_err(req, -NEWFS_LOOKUP_ERR(is_find));
+        return;
+    }
+    newfs_ll_ref(dentry, &e);
+    fuse_reply_entry(req, &e);
+}
+
+/**
+ * @brief 内核放弃 nlookup 次 lookup 得到的引用
+ */
+static void newfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    struct newfs_ll_node *node;
+    int nino = NEWFS_LL_NEWFS_INO(ino);
+
+    if (newfs_ll_nodes != NULL && nino > NEWFS_ROOT_INO && nino < newfs_super.max_ino && 
+        newfs_ll_nodes[nino].inode != NULL)
+    {
+        node = &newfs_ll_nodes[nino];
+        node->nlookup = node->nlookup > nlookup ? node->nlookup - nlookup : 0;
+        if (node->nlookup == 0)
+        {
+            newfs_ll_unref(node->inode);
+            node->inode = NULL;
+        }
+    }
+    fuse_reply_none(req);
+}
+
+/**
+ * @brief 获取文件或目录的属性
+ */
+static void newfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = newfs_ll_inode(ino);
+    struct stat st;
+
+    if (inode == NULL)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTFOUND);
+        return;
+    }
+    memset(&st, 0, sizeof(struct stat));
+    newfs_fill_stat(inode, &st);
+    fuse_reply_attr(req, &st, newfs_options.attr_timeout);
+}
+
+/**
+ * @brief 修改属性，支持改变文件大小、访问时间和修改时间，其余属性忽略
+ */
+static void newfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                             struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = newfs_ll_inode(ino);
+    struct timespec tv[2];
+    int ret = NEWFS_ERROR_NONE;
+
+    if (inode == NULL)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTFOUND);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+        if (NEWFS_IS_DIR(inode))
+        {
+            ret = -NEWFS_ERROR_ISDIR;
+        }
+        else if (NEWFS_ROUND_UP(attr->st_size, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ() > NEWFS_MAX_FILE_BLKS())
+        {
+            ret = -NEWFS_ERROR_FBIG;
+        }
+        else
+        {
+            ret = newfs_inode_truncate(inode, attr->st_size);
+        }
+    }
+    if (ret != NEWFS_ERROR_NONE)
+    {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+    {
+        tv[0].tv_sec  = attr->st_atime;
+        tv[0].tv_nsec = !(to_set & FUSE_SET_ATTR_ATIME) ? UTIME_OMIT :
+                        (to_set & FUSE_SET_ATTR_ATIME_NOW) ? UTIME_NOW : 0;
+        tv[1].tv_sec  = attr->st_mtime;
+        tv[1].tv_nsec = !(to_set & FUSE_SET_ATTR_MTIME) ? UTIME_OMIT :
+                        (to_set & FUSE_SET_ATTR_MTIME_NOW) ? UTIME_NOW : 0;
+        newfs_set_times(inode, tv);
+    }
+    newfs_ll_getattr(req, ino, fi);
+}
+
+/**
+ * @brief 在目录 parent 下新建文件或目录，成功时和 lookup 一样记一次引用
+ */
+static void newfs_ll_make(fuse_req_t req, fuse_ino_t parent, const char *name, NEWFS_FILE_TYPE ftype)
+{
+    struct newfs_inode     *dir = newfs_ll_inode(parent);
+    struct newfs_dentry    *dentry;
+    struct fuse_entry_param e;
+    int ret;
+
+    if (dir == NULL)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTFOUND);
+        return;
+    }
+    ret = newfs_create(dir->dentry, name, ftype, &dentry);
+    if (ret != NEWFS_ERROR_NONE)
+    {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    newfs_ll_ref(dentry, &e);
+    fuse_reply_entry(req, &e);
+}
+
+/**
+ * @brief 创建文件
+ */
+static void newfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    newfs_ll_make(req, parent, name, S_ISDIR(mode) ? NEWFS_DIR : NEWFS_REG_FILE);
+}
+
+/**
+ * @brief 创建目录
+ */
+static void newfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    newfs_ll_make(req, parent, name, NEWFS_DIR);
+}
+
+/**
+ * @brief 删除文件或目录；内核仍持有的inode推迟到 forget 时才释放
+ */
+static void newfs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, boolean is_dir)
+{
+    struct newfs_inode  *dir = newfs_ll_inode(parent);
+    struct newfs_dentry *dentry;
+    boolean              is_find;
+
+    if (dir == NULL || !NEWFS_IS_DIR(dir))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTDIR);
+        return;
+    }
+    dentry = newfs_lookup_child(dir, name, &is_find);
+    if (dentry == NULL)
+    {
+        fuse_reply_err(req, -NEWFS_LOOKUP_ERR(is_find));
+        return;
+    }
+    if (is_dir && !NEWFS_IS_DIR(dentry->inode))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTDIR);
+        return;
+    }
+    if (!is_dir && NEWFS_IS_DIR(dentry->inode))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_ISDIR);
+        return;
+    }
+    if (is_dir && dentry->inode->dir_cnt != 0)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTEMPTY);
+        return;
+    }
+    NEWFS_WRLOCK(dentry->inode);                       /* newfs_remove 要交出子项的写锁 */
+    fuse_reply_err(req, -newfs_remove(dentry));
+}
+
+/**
+ * @brief 删除文件
+ */
+static void newfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    newfs_ll_remove(req, parent, name, FALSE);
+}
+
+/**
+ * @brief 删除目录
+ */
+static void newfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    newfs_ll_remove(req, parent, name, TRUE);
+}
+
+/**
+ * @brief 重命名，inode 号不变
+ */
+static void newfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            fuse_ino_t newparent, const char *newname)
+{
+    struct newfs_inode  *dir    = newfs_ll_inode(parent);
+    struct newfs_inode  *newdir = newfs_ll_inode(newparent);
+    struct newfs_dentry *dentry;
+    boolean              is_find;
+
+    if (dir == NULL || newdir == NULL || !NEWFS_IS_DIR(dir))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTFOUND);
+        return;
+    }
+    dentry = newfs_lookup_child(dir, name, &is_find);
+    if (dentry == NULL)
+    {
+        fuse_reply_err(req, -NEWFS_LOOKUP_ERR(is_find));
+        return;
+    }
+    if (dir == newdir && strcmp(name, newname) == 0)
+    {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    fuse_reply_err(req, -newfs_move(dentry, newdir->dentry, newname));
+}
+
+/**
+ * @brief 打开文件或目录，inode 存放在 fi->fh 中
+ */
+static void newfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = newfs_ll_inode(ino);
+
+    if (inode == NULL)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOTFOUND);
+        return;
+    }
+    newfs_inode_get(inode);
+    fi->fh = (uint64_t)(uintptr_t)inode;
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * @brief 关闭文件或目录
+ */
+static void newfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+
+    if (inode != NULL)
+    {
+        newfs_ll_unref(inode);
+    }
+    fuse_reply_err(req, 0);
+}
+
+/**
+ * @brief 读文件，磁盘上的整块以镜像文件的描述符给出，由 fuse_reply_data splice 给内核
+ */
+static void newfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                          struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+    struct fuse_bufvec *bufv;
+    int ret;
+
+    if (NEWFS_IS_DIR(inode))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_ISDIR);
+        return;
+    }
+    if (off >= inode->size)
+    {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    ret = newfs_inode_read_buf(inode, &bufv, size, off);
+    if (ret < 0)
+    {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    newfs_free_bufvec(bufv);
+}
+
+/**
+ * @brief 写文件，数据以 bufvec 给出，可能是 splice 进来的管道
+ */
+static void newfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                               off_t off, struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+    int ret;
+
+    if (NEWFS_IS_DIR(inode))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_ISDIR);
+        return;
+    }
+    ret = newfs_inode_write_buf(inode, bufv, off);
+    if (ret < 0)
+    {
+        fuse_reply_err(req, -ret);
+    }
+    else
+    {
+        fuse_reply_write(req, ret);
+    }
+}
+
+/**
+ * @brief 把文件暂存和改过的数据、inode写回磁盘
+ */
+static void newfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+
+    if (inode->unlinked || inode->dirty_pprev == NULL)
+    {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    fuse_reply_err(req, -newfs_sync_inode(inode));
+}
+
+/**
+ * @brief 读目录：off 为下一个要返回的子项下标
+ */
+static void newfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                             struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+    struct stat st;
+    char  *buf;
+    size_t pos = 0, len;
+
+    buf = (char *)malloc(size);
+    if (buf == NULL)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_NOMEM);
+        return;
+    }
+    memset(&st, 0, sizeof(struct stat));
+    for (int dir = off; dir < inode->dir_cnt; dir++)
+    {
+        st.st_ino  = NEWFS_LL_INO(inode->dirents[dir].ino);
+        st.st_mode = inode->dirents[dir].ftype == NEWFS_DIR ? S_IFDIR : S_IFREG;
+        len = fuse_add_direntry(req, buf + pos, size - pos, NEWFS_DIRENT_NAME(inode, dir), &st, dir + 1);
+        if (len > size - pos)                   /* buf 已满 */
+        {
+            break;
+        }
+        pos += len;
+    }
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+/**
+ * @brief 预分配文件数据块，支持 mode 为0和 FALLOC_FL_KEEP_SIZE
+ */
+static void newfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                               struct fuse_file_info *fi)
+{
+    struct newfs_inode *inode = (struct newfs_inode *)(uintptr_t)fi->fh;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_OPNOTSUPP);
+        return;
+    }
+    if (offset < 0 || length <= 0)
+    {
+        fuse_reply_err(req, NEWFS_ERROR_INVAL);
+        return;
+    }
+    if (NEWFS_IS_DIR(inode))
+    {
+        fuse_reply_err(req, NEWFS_ERROR_ISDIR);
+        return;
+    }
+    if (NEWFS_ROUND_UP(offset + length, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ() > NEWFS_MAX_FILE_BLKS())
+    {
+        fuse_reply_err(req, NEWFS_ERROR_FBIG);
+        return;
+    }
+    fuse_reply_err(req, -newfs_inode_fallocate(inode, offset, length, (mode & FALLOC_FL_KEEP_SIZE) != 0));
+}
+
+/******************************************************************************
+ * SECTION: FUSE低层操作定义
+ *******************************************************************************/
+static struct fuse_lowlevel_ops ll_operations = {
+    .init = newfs_ll_init,             /* mount文件系统 */
+    .destroy = newfs_ll_destroy,       /* umount文件系统 */
+    .lookup = newfs_ll_lookup,         /* 按名称查找子项，nlookup 加一 */
+    .forget = newfs_ll_forget,         /* 内核放弃引用 */
+    .getattr = newfs_ll_getattr,       /* 获取文件属性 */
+    .setattr = newfs_ll_setattr,       /* 改变文件大小 */
+    .mknod = newfs_ll_mknod,           /* 创建文件 */
+    .mkdir = newfs_ll_mkdir,           /* 建目录 */
+    .unlink = newfs_ll_unlink,         /* 删除文件 */
+    .rmdir = newfs_ll_rmdir,           /* 删除目录 */
+    .rename = newfs_ll_rename,         /* 重命名 */
+    .open = newfs_ll_open,
+    .read = newfs_ll_read,             /* 读文件 */
+    .write_buf = newfs_ll_write_buf,   /* 写入文件 */
+    .release = newfs_ll_release,
+    .fsync = newfs_ll_fsync,           /* 把文件写回磁盘 */
+    .opendir = newfs_ll_open,
+    .readdir = newfs_ll_readdir,       /* 填充dentrys */
+    .releasedir = newfs_ll_release,
+    .fallocate = newfs_ll_fallocate};  /* 预分配数据块 */
+
+/******************************************************************************
+ * SECTION: FUSE入口
+ *******************************************************************************/
+int main(int argc, char **argv)
+{
+    struct fuse_args     args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan    *ch;
+    struct fuse_session *se;
+    char *mountpoint;
+    int   foreground;
+    int   ret = -1;
+
+    newfs_options.device = strdup("TODO: 这里填写你的ddriver设备路径");
+    newfs_options.max_write     = NEWFS_MAX_WRITE;
+    newfs_options.max_readahead = NEWFS_MAX_READAHEAD;
+    newfs_options.big_writes    = 1;
+    newfs_options.async_read    = 1;
+    newfs_options.attr_timeout  = NEWFS_CACHE_TIMEOUT;
+    newfs_options.entry_timeout = NEWFS_CACHE_TIMEOUT;
+    newfs_options.splice        = 1;
+    newfs_options.pool_workers  = NEWFS_POOL_WORKERS;
+
+    if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
+        return -1;
+
+    // 节点表 newfs_ll_nodes 没有加锁，低层接口仍然单线程处理请求
+    if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, &args)) != NULL)
+    {
+        se = fuse_lowlevel_new(&args, &ll_operations, sizeof(ll_operations), &se);
+        if (se != NULL)
+        {
+            if (fuse_set_signal_handlers(se) != -1)
+            {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                ret = fuse_session_loop(se);
+                ret = ret == 0 && newfs_ll_nodes == NULL ? -1 : ret;   /* 挂载失败而结束 */
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+#include "../include/newfs.h"
+
+static struct newfs_pool                  newfs_pool;
+static __thread struct newfs_pool_worker* newfs_pool_self = NULL;    /* 当前线程是池中的哪个线程 */
+
+/**
+ * @brief 把任务放到队列尾部，满了就扩容
+ *
+ * @param q
+ * @param task
+ */
+static void newfs_deque_push(struct newfs_deque* q, const struct newfs_task* task) {
+    struct newfs_task* tasks;
+    if (q->cnt == q->cap) {
+        tasks = (struct newfs_task*)malloc(q->cap * 2 * sizeof(struct newfs_task));
+        for (int i = 0; i < q->cnt; i++) {
+            tasks[i] = q->tasks[(q->head + i) % q->cap];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->head  = 0;
+        q->cap  *= 2;
+    }
+    q->tasks[(q->head + q->cnt) % q->cap] = *task;
+    q->cnt++;
+}
+
+/**
+ * @brief 从队列中取一个任务：所属线程从尾部取（后进先出，数据还在缓存里），
+ *        其他线程从头部偷（先进先出，偷走最早的任务）
+ *
+ * @param q
+ * @param from_tail
+ * @param task 输出
+ * @return boolean 队列为空返回FALSE
+ */
+static boolean newfs_deque_pop(struct newfs_deque* q, boolean from_tail, struct newfs_task* task) {
+    if (q->cnt == 0) {
+        return FALSE;
+    }
+    if (from_tail) {
+        *task = q->tasks[(q->head + q->cnt - 1) % q->cap];
+    }
+    else {
+        *task   = q->tasks[q->head];
+        q->head = (q->head + 1) % q->cap;
+    }
+    q->cnt--;
+    return TRUE;
+}
+
+/**
+ * @brief 取一个要执行的任务：前台任务先于后台任务，同一优先级先看自己的队列再去偷别人的
+ *
+ * @param self 当前线程，不是池中的线程时为NULL
+ * @param task 输出
+ * @return boolean 所有队列都为空返回FALSE
+ */
+static boolean newfs_pool_take(struct newfs_pool_worker* self, struct newfs_task* task) {
+    struct newfs_pool_worker* victim;
+    int start = self != NULL ? (int)(self - newfs_pool.workers) : 0;
+    boolean found;
+
+    if (__atomic_load_n(&newfs_pool.queued, __ATOMIC_ACQUIRE) == 0) {
+        return FALSE;
+    }
+    for (int prio = 0; prio < NEWFS_TASK_PRIOS; prio++) {
+        for (int i = 0; i < newfs_pool.nr_workers; i++) {
+            victim = &newfs_pool.workers[(start + i) % newfs_pool.nr_workers];
+            pthread_mutex_lock(&victim->lock);
+            found = newfs_deque_pop(&victim->q[prio], victim == self, task);
+            pthread_mutex_unlock(&victim->lock);
+            if (found) {
+                __atomic_sub_fetch(&newfs_pool.queued, 1, __ATOMIC_ACQ_REL);
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @brief 执行一个任务，完成后唤醒等待者
+ *
+ * @param task
+ */
+static void newfs_pool_run(struct newfs_task* task) {
+    task->fn(task->arg);
+    if (task->pending != NULL) {
+        __atomic_sub_fetch(task->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    __atomic_sub_fetch(&newfs_pool.outstanding, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&newfs_pool.lock);
+    pthread_cond_broadcast(&newfs_pool.done);
+    pthread_mutex_unlock(&newfs_pool.lock);
+}
+
+/**
+ * @brief 工作线程：有任务就执行，所有队列都空时睡眠，线程池停止且没有任务时退出
+ *
+ * @param arg 本线程的 newfs_pool_worker
+ * @return void*
+ */
+static void* newfs_pool_worker_main(void* arg) {
+    struct newfs_task task;
+
+    newfs_pool_self = (struct newfs_pool_worker*)arg;
+    while (TRUE) {
+        if (newfs_pool_take(newfs_pool_self, &task)) {
+            newfs_pool_run(&task);
+            continue;
+        }
+        pthread_mutex_lock(&newfs_pool.lock);
+        while (__atomic_load_n(&newfs_pool.queued, __ATOMIC_ACQUIRE) == 0 && !newfs_pool.stopping) {
+            pthread_cond_wait(&newfs_pool.cond, &newfs_pool.lock);
+        }
+        if (__atomic_load_n(&newfs_pool.queued, __ATOMIC_ACQUIRE) == 0 && newfs_pool.stopping) {
+            pthread_mutex_unlock(&newfs_pool.lock);
+            break;
+        }
+        pthread_mutex_unlock(&newfs_pool.lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 启动线程池
+ *
+ * @param nr_workers 线程数，为0时不启动，之后提交的任务就地执行
+ * @return int
+ */
+int newfs_pool_start(int nr_workers) {
+    struct newfs_pool_worker* worker;
+
+    memset(&newfs_pool, 0, sizeof(struct newfs_pool));
+    pthread_mutex_init(&newfs_pool.lock, NULL);
+    pthread_cond_init(&newfs_pool.cond, NULL);
+    pthread_cond_init(&newfs_pool.done, NULL);
+    if (nr_workers <= 0) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    newfs_pool.workers = (struct newfs_pool_worker*)calloc(nr_workers, sizeof(struct newfs_pool_worker));
+    for (int i = 0; i < nr_workers; i++) {
+        worker = &newfs_pool.workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        for (int prio = 0; prio < NEWFS_TASK_PRIOS; prio++) {
+            worker->q[prio].cap   = NEWFS_POOL_DEQUE_CAP;
+            worker->q[prio].tasks = (struct newfs_task*)malloc(NEWFS_POOL_DEQUE_CAP * sizeof(struct newfs_task));
+        }
+    }
+    /* 队列都准备好之后再开线程，线程一开始就可能去偷别人的队列 */
+    newfs_pool.nr_workers = nr_workers;
+    for (int i = 0; i < nr_workers; i++) {
+        if (pthread_create(&newfs_pool.workers[i].tid, NULL, newfs_pool_worker_main,
+                           &newfs_pool.workers[i]) == 0) {
+            continue;
+        }
+        /* 开不出线程时只用已经开出来的，一个都没有就退回就地执行 */
+        NEWFS_DBG("[%s] only %d of %d workers started\n", __func__, i, nr_workers);
+        pthread_mutex_lock(&newfs_pool.lock);
+        newfs_pool.nr_workers = i;
+        pthread_mutex_unlock(&newfs_pool.lock);
+        for (int j = i; j < nr_workers; j++) {
+            pthread_mutex_destroy(&newfs_pool.workers[j].lock);
+            for (int prio = 0; prio < NEWFS_TASK_PRIOS; prio++) {
+                free(newfs_pool.workers[j].q[prio].tasks);
+            }
+        }
+        break;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 提交一个任务。池中的线程提交到自己的队列，池外的线程轮流提交到各线程的队列；
+ *        线程池没有启动时就地执行
+ *
+ * @param fn
+ * @param arg
+ * @param prio NEWFS_TASK_FG 或 NEWFS_TASK_BG
+ * @param pending 完成时减一，可以为NULL；调用者提交前先把它加上要等的任务数
+ */
+void newfs_pool_submit(void (*fn)(void*), void* arg, NEWFS_TASK_PRIO prio, int* pending) {
+    struct newfs_task         task = { fn, arg, pending };
+    struct newfs_pool_worker* worker;
+
+    __atomic_add_fetch(&newfs_pool.outstanding, 1, __ATOMIC_ACQ_REL);
+    if (newfs_pool.nr_workers == 0) {
+        newfs_pool_run(&task);
+        return;
+    }
+
+    worker = newfs_pool_self;
+    if (worker == NULL) {
+        worker = &newfs_pool.workers[__atomic_fetch_add(&newfs_pool.next, 1, __ATOMIC_RELAXED) %
+                                     newfs_pool.nr_workers];
+    }
+    pthread_mutex_lock(&worker->lock);
+    newfs_deque_push(&worker->q[prio], &task);
+    pthread_mutex_unlock(&worker->lock);
+    __atomic_add_fetch(&newfs_pool.queued, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&newfs_pool.lock);
+    pthread_cond_signal(&newfs_pool.cond);
+    pthread_mutex_unlock(&newfs_pool.lock);
+}
+
+/**
+ * @brief 等待 *pending 归零。等待期间当前线程也取任务来执行，
+ *        池中的线程等待自己提交的任务时不会把线程池堵死
+ *
+ * @param pending
+ */
+void newfs_pool_wait(int* pending) {
+    struct newfs_task task;
+
+    while (__atomic_load_n(pending, __ATOMIC_ACQUIRE) > 0) {
+        if (newfs_pool_take(newfs_pool_self, &task)) {
+            newfs_pool_run(&task);
+            continue;
+        }
+        pthread_mutex_lock(&newfs_pool.lock);
+        while (__atomic_load_n(pending, __ATOMIC_ACQUIRE) > 0 &&
+               __atomic_load_n(&newfs_pool.queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&newfs_pool.done, &newfs_pool.lock);
+        }
+        pthread_mutex_unlock(&newfs_pool.lock);
+    }
+}
+
+/**
+ * @brief 等待所有已提交的任务完成，包括后台任务
+ */
+void newfs_pool_drain() {
+    newfs_pool_wait(&newfs_pool.outstanding);
+}
+
+/**
+ * @brief 停止线程池：先执行完所有已提交的任务，再让线程退出
+ */
+void newfs_pool_stop() {
+    newfs_pool_drain();
+
+    pthread_mutex_lock(&newfs_pool.lock);
+    newfs_pool.stopping = TRUE;
+    pthread_cond_broadcast(&newfs_pool.cond);
+    pthread_mutex_unlock(&newfs_pool.lock);
+
+    for (int i = 0; i < newfs_pool.nr_workers; i++) {
+        pthread_join(newfs_pool.workers[i].tid, NULL);
+    }
+    if (newfs_pool.workers != NULL) {
+        for (int i = 0; i < newfs_pool.nr_workers; i++) {
+            pthread_mutex_destroy(&newfs_pool.workers[i].lock);
+            for (int prio = 0; prio < NEWFS_TASK_PRIOS; prio++) {
+                free(newfs_pool.workers[i].q[prio].tasks);
+            }
+        }
+        free(newfs_pool.workers);
+    }
+    newfs_pool.workers    = NULL;
+    newfs_pool.nr_workers = 0;
+    pthread_cond_destroy(&newfs_pool.done);
+    pthread_cond_destroy(&newfs_pool.cond);
+    pthread_mutex_destroy(&newfs_pool.lock);
+}
@@ -3,6 +3,20 @@
 extern struct newfs_super newfs_super;
 extern struct custom_options newfs_options;	
 
+/* 无锁查找的读者记录，跨挂载保留，线程退出后留给新线程复用 */
+static struct newfs_rcu_reader*          newfs_rcu_readers      = NULL;
+static pthread_mutex_t                   newfs_rcu_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t                     newfs_rcu_key;
+static pthread_once_t                    newfs_rcu_once         = PTHREAD_ONCE_INIT;
+static __thread struct newfs_rcu_reader* newfs_rcu_self         = NULL;
+
+/* 写回批次的收集顺序 */
+static uint64_t                          newfs_wb_seq           = 0;
+
+/* 分配组：每个线程第一次分配时按 newfs_ag_next 轮流分到一个首选组 */
+static int                               newfs_ag_next          = 0;
+static __thread int                      newfs_ag_hint          = -1;
+
 /**
  * @brief 获取指定路径下面对应的文件名
  * 
@@ -16,41 +30,32 @@ char* newfs_get_fname(const char* path) {
 }
 
 /**
- * @brief 计算路径的层级
- * @param path 
- * @return int 
- */
-int newfs_calc_lvl(const char * path) {
-    char* str = path;
-    int   lvl = 0;
-    if (strcmp(path, "/") == 0) {
-        return lvl;
-    }
-    while (*str != NULL) {
-        if (*str == '/') {
-            lvl++;
-        }
-        str++;
-    }
-    return lvl;
-}
-
-/**
- * @brief 从磁盘中读取对应偏移地址的内容到输出内容中
+ * @brief 从磁盘中读取对应偏移地址的内容到输出内容中，调用者持有 driver_lock
  * 
  * @param offset 
  * @param out_content 
  * @param size 
  * @return int 
  */
-int newfs_driver_read(int offset, uint8_t *out_content, int size) {
+static int newfs_driver_read_locked(int offset, uint8_t *out_content, int size) {
     /* 读取逻辑块 */
     int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_BLK_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
+    uint8_t* temp_content;
+    uint8_t* cur;
+
+    /* 按块对齐的读直接读入输出缓冲区 */
+    if (bias == 0 && size_aligned == size) {
+        ddriver_seek(NEWFS_DRIVER(), offset, SEEK_SET);
+        for (cur = out_content; cur < out_content + size; cur += NEWFS_IO_SZ()) {
+            ddriver_read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
+        }
+        return NEWFS_ERROR_NONE;
+    }
 
+    temp_content = (uint8_t*)malloc(size_aligned);
+    cur          = temp_content;
     ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
 
     while (size_aligned != 0)
@@ -64,6 +69,22 @@ int newfs_driver_read(int offset, uint8_t *out_content, int size) {
     return NEWFS_ERROR_NONE;
 }
 
+/**
+ * @brief 从磁盘中读取对应偏移地址的内容到输出内容中
+ * 
+ * @param offset 
+ * @param out_content 
+ * @param size 
+ * @return int 
+ */
+int newfs_driver_read(int offset, uint8_t *out_content, int size) {
+    int ret;
+    pthread_mutex_lock(&newfs_super.driver_lock);
+    ret = newfs_driver_read_locked(offset, out_content, size);
+    pthread_mutex_unlock(&newfs_super.driver_lock);
+    return ret;
+}
+
 /**
  * @brief 将指定内容的数据写入到磁盘对应偏移地址中
  * 
@@ -77,9 +98,24 @@ int newfs_driver_write(int offset, uint8_t *in_content, int size) {
     int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_BLK_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    newfs_driver_read(offset_aligned, temp_content, size_aligned);
+    uint8_t* temp_content;
+    uint8_t* cur;
+
+    /* 整块覆盖写不需要先读出旧内容 */
+    pthread_mutex_lock(&newfs_super.driver_lock);
+    if (bias == 0 && size_aligned == size) {
+        ddriver_seek(NEWFS_DRIVER(), offset, SEEK_SET);
+        for (cur = in_content; cur < in_content + size; cur += NEWFS_IO_SZ()) {
+            ddriver_write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
+        }
+        pthread_mutex_unlock(&newfs_super.driver_lock);
+        return NEWFS_ERROR_NONE;
+    }
+
+    /* 读出旧内容和写回之间不能插入别的写 */
+    temp_content = (uint8_t*)malloc(size_aligned);
+    cur          = temp_content;
+    newfs_driver_read_locked(offset_aligned, temp_content, size_aligned);
     memcpy(temp_content + bias, in_content, size);
     
     ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
@@ -89,393 +125,2705 @@ int newfs_driver_write(int offset, uint8_t *in_content, int size) {
         cur          += NEWFS_IO_SZ();
         size_aligned -= NEWFS_IO_SZ();   
     }
+    pthread_mutex_unlock(&newfs_super.driver_lock);
 
     free(temp_content);
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 将dentry插入inode中，采用头插法
- * 
- * @param inode 
- * @param dentry 
- * @return int 
+ * @brief 线程退出时交还它的读者记录
  */
-int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
-    if (inode->dentrys == NULL) {
-        inode->dentrys = dentry;
-    }
-    else {
-        dentry->brother = inode->dentrys;
-        inode->dentrys = dentry;
-    }
-    inode->dir_cnt++;
-
-    // 分配数据块
-    int cur_blk = inode->dir_cnt / MAX_DENTRY_PER_BLK();
-    if (inode->dir_cnt % MAX_DENTRY_PER_BLK() == 1) {
-        /* 当前数据块已满，需要寻找新的数据块*/
-        int byte_cursor = 0; 
-        int bit_cursor  = 0; 
-        int dno_cursor  = 0;
-        boolean is_find_free_data_blk = FALSE;
-        /* 检查位图是否有空位 */
-        for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_data_blks); 
-            byte_cursor++)
-        {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-                if((newfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                        /* 当前dno_cursor位置空闲 */
-                    newfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                    //在指定位置的数据块指针中插入当前数据块
-                    inode->block_pointer[cur_blk] = dno_cursor;
-                    is_find_free_data_blk = TRUE;           
-                    break;
-                }
-                dno_cursor++;
-            }
-            if (is_find_free_data_blk) {
-                break;
-            }
-        }
-
-        if (!is_find_free_data_blk || dno_cursor == newfs_super.max_data)
-            return -NEWFS_ERROR_NOSPACE;
-    }
+static void newfs_rcu_thread_exit(void* arg) {
+    struct newfs_rcu_reader* reader = (struct newfs_rcu_reader*)arg;
+    pthread_mutex_lock(&newfs_rcu_readers_lock);
+    reader->in_use = FALSE;
+    pthread_mutex_unlock(&newfs_rcu_readers_lock);
+}
 
-    return inode->dir_cnt;
+static void newfs_rcu_key_init() {
+    pthread_key_create(&newfs_rcu_key, newfs_rcu_thread_exit);
 }
 
 /**
- * @brief 分配inode索引节点
+ * @brief 为当前线程取得一个读者记录，优先复用已退出线程留下的
  * 
- * @param dentry 
- * @return int 
+ * @return struct newfs_rcu_reader* 
  */
-struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
-    struct newfs_inode* inode;
-    int byte_cursor = 0; 
-    int bit_cursor  = 0; 
-    int ino_cursor  = 0;
-    boolean is_find_free_entry = FALSE;
+static struct newfs_rcu_reader* newfs_rcu_register() {
+    struct newfs_rcu_reader* reader;
 
-    
-    /* 检查位图是否有空位 */
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_inode_blks); 
-         byte_cursor++)
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((newfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                      /* 当前ino_cursor位置空闲 */
-                newfs_super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_entry = TRUE;           
-                break;
-            }
-            ino_cursor++;
-        }
-        if (is_find_free_entry) {
+    pthread_once(&newfs_rcu_once, newfs_rcu_key_init);
+    pthread_mutex_lock(&newfs_rcu_readers_lock);
+    for (reader = newfs_rcu_readers; reader != NULL; reader = reader->next) {
+        if (!reader->in_use) {
             break;
         }
     }
+    if (reader == NULL) {
+        reader = (struct newfs_rcu_reader*)calloc(1, sizeof(struct newfs_rcu_reader));
+        reader->next = newfs_rcu_readers;
+        __atomic_store_n(&newfs_rcu_readers, reader, __ATOMIC_RELEASE);
+    }
+    reader->in_use = TRUE;
+    pthread_mutex_unlock(&newfs_rcu_readers_lock);
 
-    if (!is_find_free_entry || ino_cursor == newfs_super.max_ino)
-        return -NEWFS_ERROR_NOSPACE;
+    pthread_setspecific(newfs_rcu_key, reader);
+    newfs_rcu_self = reader;
+    return reader;
+}
 
-    inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
-    inode->ino  = ino_cursor; 
-    inode->size = 0;
-    // dentry 指向 inode
-    dentry->inode = inode;
-    dentry->ino   = inode->ino;
-    // inode 指向 dentry                                                                                                
-    inode->dentry = dentry;
-    
-    inode->dir_cnt = 0;
-    inode->dentrys = NULL;
-    
-    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++){
-        inode->block_pointer[i] = -1;
-    }
-    // inode指向文件类型，则分配数据指针
-    if (NEWFS_IS_REG(inode)) {
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            inode->data[i] = (uint8_t *)malloc(NEWFS_BLK_SZ());
-        }
-    }
-    return inode;
+/**
+ * @brief 进入读区：此后读到的目录项、inode和子项数组在离开读区前不会被释放
+ */
+static void newfs_rcu_read_lock() {
+    struct newfs_rcu_reader* self = newfs_rcu_self ? newfs_rcu_self : newfs_rcu_register();
+    __atomic_store_n(&self->epoch, __atomic_load_n(&newfs_super.rcu_epoch, __ATOMIC_SEQ_CST), 
+                     __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->active, 1, __ATOMIC_SEQ_CST);
+    /* 读者的标记先于之后的任何读取，回收者要么看到它，要么它读不到已摘下的内存 */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 离开读区
+ */
+static void newfs_rcu_read_unlock() {
+    __atomic_store_n(&newfs_rcu_self->active, 0, __ATOMIC_RELEASE);
 }
 
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 释放所有已经没有读者能看到的延迟释放项，调用者持有 rcu_lock
  * 
- * @param inode 
- * @return int 
+ * @param all 为TRUE时不看读者全部释放，只在卸载时使用
  */
-int newfs_sync_inode(struct newfs_inode * inode) {
-    struct newfs_inode_d  inode_d;
-    struct newfs_dentry*  dentry_cursor;
-    struct newfs_dentry*  cur_dentry_cursor;
-    struct newfs_dentry_d dentry_d;
-    int ino             = inode->ino;
-    int offset;
+static void newfs_rcu_reclaim(boolean all) {
+    struct newfs_rcu_retired** link = &newfs_super.rcu_retired;
+    struct newfs_rcu_retired*  item;
+    struct newfs_rcu_reader*   reader;
+    uint64_t min_epoch = UINT64_MAX;
+    uint64_t epoch;
 
-    // 将内存中的 inode 刷回 磁盘的 inode_d
-    inode_d.ino         = ino;
-    inode_d.size        = inode->size;
-    inode_d.ftype       = inode->dentry->ftype;
-    inode_d.dir_cnt     = inode->dir_cnt;
-    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-        inode_d.block_pointer[i] = inode->block_pointer[i];
+    if (!all) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        reader = __atomic_load_n(&newfs_rcu_readers, __ATOMIC_ACQUIRE);
+        for (; reader != NULL; reader = reader->next) {
+            if (!__atomic_load_n(&reader->active, __ATOMIC_SEQ_CST)) {
+                continue;
+            }
+            epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+            if (epoch < min_epoch) {
+                min_epoch = epoch;
+            }
+        }
     }
 
-    /* 先写inode本身 */
-    if (newfs_driver_write(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-        NEWFS_INODE_SZ()) != NEWFS_ERROR_NONE) {
-        NEWFS_DBG("[%s] io error\n", __func__);
-        return -NEWFS_ERROR_IO;
+    /* 纪元为 e 的项在全局纪元加一之前摘下，纪元大于 e 的读者不可能看到它 */
+    while ((item = *link) != NULL) {
+        if (item->epoch < min_epoch) {
+            *link = item->next;
+            item->free_fn(item->ptr);
+            free(item);
+            newfs_super.rcu_retired_cnt--;
+        }
+        else {
+            link = &item->next;
+        }
     }
+}
 
-    /* 再写inode下方的数据 */
-    if (NEWFS_IS_DIR(inode)) { /* 如果当前inode是目录，那么数据是目录项，且目录项的inode也要写回 */                          
-        dentry_cursor = inode->dentrys;
+/**
+ * @brief 线程池中的后台回收任务
+ */
+static void newfs_rcu_reclaim_task(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&newfs_super.rcu_lock);
+    newfs_rcu_reclaim(FALSE);
+    newfs_super.rcu_reclaiming = FALSE;
+    pthread_mutex_unlock(&newfs_super.rcu_lock);
+}
 
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            offset = NEWFS_DATA_OFS(inode->block_pointer[i]);
-            while ((dentry_cursor != NULL) && (offset < NEWFS_DATA_OFS(inode->block_pointer[i] + 1))) {
-                memcpy(dentry_d.fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
-                dentry_d.ftype = dentry_cursor->ftype;
-                dentry_d.ino = dentry_cursor->ino;
-                if (newfs_driver_write(offset, (uint8_t *)&dentry_d, 
-                    sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE) {
-                    NEWFS_DBG("[%s] io error\n", __func__);
-                    return -NEWFS_ERROR_IO;                     
-                }
-                
-                // 递归调用 将目录项的inode写回
-                if (dentry_cursor->inode != NULL) {
-                    newfs_sync_inode(dentry_cursor->inode);
-                }
+/**
+ * @brief 延迟释放一块已从目录树上摘下的内存，等到可能看到它的读者都离开读区后再释放；
+ *        调用者持有的锁保证它已经摘下
+ * 
+ * @param ptr 要释放的内存，可以为NULL
+ * @param free_fn 释放函数
+ */
+static void newfs_rcu_retire(void* ptr, void (*free_fn)(void*)) {
+    struct newfs_rcu_retired* item;
+    boolean reclaim;
 
-                // 下一个目录项
-                cur_dentry_cursor = dentry_cursor;
-                dentry_cursor = dentry_cursor->brother;
-                offset += sizeof(struct newfs_dentry_d);
+    if (ptr == NULL) {
+        return;
+    }
+    item = (struct newfs_rcu_retired*)malloc(sizeof(struct newfs_rcu_retired));
+    item->ptr     = ptr;
+    item->free_fn = free_fn;
 
-                free(cur_dentry_cursor);
-            }
-        }
+    pthread_mutex_lock(&newfs_super.rcu_lock);
+    item->epoch = newfs_super.rcu_epoch;
+    __atomic_store_n(&newfs_super.rcu_epoch, item->epoch + 1, __ATOMIC_SEQ_CST);
+    item->next = newfs_super.rcu_retired;
+    newfs_super.rcu_retired = item;
+    reclaim = ++newfs_super.rcu_retired_cnt >= NEWFS_RCU_BATCH && !newfs_super.rcu_reclaiming;
+    if (reclaim) {
+        newfs_super.rcu_reclaiming = TRUE;
     }
-    else if (NEWFS_IS_REG(inode)) { /* 如果当前inode是文件，那么数据是文件内容，直接写即可 */
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            if(inode->block_pointer[i] == -1) continue;
-            if (newfs_driver_write(NEWFS_DATA_OFS(inode->block_pointer[i]), inode->data[i], 
-                NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
-                NEWFS_DBG("[%s] io error\n", __func__);
-                return -NEWFS_ERROR_IO;
-            }
-            free(inode->data[i]);
-        }
+    pthread_mutex_unlock(&newfs_super.rcu_lock);
+
+    /* 回收交给线程池在后台做，不占用请求线程 */
+    if (reclaim) {
+        newfs_pool_submit(newfs_rcu_reclaim_task, NULL, NEWFS_TASK_BG, NULL);
     }
+}
+
+/**
+ * @brief 延迟释放的inode：锁要等最后一个读者离开后才能销毁
+ */
+static void newfs_rcu_free_inode(void* ptr) {
+    struct newfs_inode* inode = (struct newfs_inode*)ptr;
+    pthread_rwlock_destroy(&inode->lock);
     free(inode);
-    return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 读取指定编号的索引节点信息
- * 
- * @param dentry dentry指向ino，读取该inode
- * @param ino inode唯一编号
- * @return struct newfs_inode* 
+ * @brief 开始修改目录的子项，seq 变为奇数；可以嵌套，只有最外层改动 seq。
+ *        调用者持有目录的写锁
  */
-struct newfs_inode* newfs_read_inode(struct newfs_dentry * dentry, int ino) {
-    struct newfs_inode* inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
-    struct newfs_inode_d inode_d;
-    struct newfs_dentry* sub_dentry;
-    struct newfs_dentry_d dentry_d;
-    int dir_cnt = 0;
-    int offset;
-    
-    if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                        NEWFS_INODE_SZ()) != NEWFS_ERROR_NONE) {
-        NEWFS_DBG("[%s] io error\n", __func__);
-        return NULL;                    
+static void newfs_dir_seq_begin(struct newfs_inode* inode) {
+    if (inode->seq_nest++ == 0) {
+        __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
     }
-    inode->dir_cnt = 0;
-    inode->ino = inode_d.ino;
-    inode->size = inode_d.size;
-    inode->dentry = dentry;
-    inode->dentrys = NULL;
+}
 
-    for(int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-        inode->block_pointer[i] = inode_d.block_pointer[i];
+/**
+ * @brief 结束修改目录的子项，seq 变回偶数
+ */
+static void newfs_dir_seq_end(struct newfs_inode* inode) {
+    if (--inode->seq_nest == 0) {
+        __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
     }
+}
 
-    /* 内存中的inode的数据或子目录项部分也需要读出 */
-    if (NEWFS_IS_DIR(inode)) {
-        dir_cnt = inode_d.dir_cnt;
-        // 节点指向的数据块
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            offset = NEWFS_DATA_OFS(inode->block_pointer[i]);
-            // 磁盘无指针，按照 dentry 大小遍历
-            while ((dir_cnt > 0) && (offset + sizeof(struct newfs_dentry_d) < NEWFS_DATA_OFS(inode->block_pointer[i] + 1))) {
-                if (newfs_driver_read(offset, (uint8_t *)&dentry_d, 
-                    sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE) {
-                    NEWFS_DBG("[%s] io error\n", __func__);
-                    return NULL;
-                }
-                sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
-                sub_dentry->parent = inode->dentry;
-                sub_dentry->ino    = dentry_d.ino; 
-                newfs_alloc_dentry(inode, sub_dentry);
+/**
+ * @brief 在目录子项数组末尾追加一条记录，名称拷贝进字符串区
+ * 
+ * @param inode 目录inode
+ * @param name 名称（不要求'\0'结尾）
+ * @param name_len 名称长度
+ * @param ino 子项的inode编号
+ * @param ftype 子项的文件类型
+ * @return int 新记录的下标
+ */
+static int newfs_append_dirent(struct newfs_inode* inode, const char* name, int name_len,
+                               uint32_t ino, NEWFS_FILE_TYPE ftype) {
+    struct newfs_dirent* dirent;
+    struct newfs_dirent* dirents;
+    char* names;
+    void* old;
+    int   cap;
 
-                offset += sizeof(struct newfs_dentry_d);
-                dir_cnt --;
-            }
-        }
+    /* 扩容不用 realloc：无锁查找可能还在读旧数组，旧数组延迟释放；先换指针再改容量 */
+    if (inode->dir_cnt == inode->dirents_cap) {
+        cap     = inode->dirents_cap ? inode->dirents_cap * 2 : NEWFS_DIRENTS_INIT_CAP;
+        dirents = (struct newfs_dirent*)malloc(cap * sizeof(struct newfs_dirent));
+        memcpy(dirents, inode->dirents, inode->dir_cnt * sizeof(struct newfs_dirent));
+        old     = inode->dirents;
+        __atomic_store_n(&inode->dirents, dirents, __ATOMIC_RELEASE);
+        __atomic_store_n(&inode->dirents_cap, cap, __ATOMIC_RELEASE);
+        newfs_rcu_retire(old, free);
     }
-    else if (NEWFS_IS_REG(inode)) {
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            inode->data[i] = (uint8_t *)malloc(NEWFS_BLK_SZ());
-            if(inode->block_pointer[i] == -1) continue;
-            if (newfs_driver_read(NEWFS_DATA_OFS(inode->block_pointer[i]), (uint8_t *)inode->data[i], 
-                NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
-                NEWFS_DBG("[%s] io error\n", __func__);
-                return NULL;                    
-            }
+    if (inode->names_len + name_len + 1 > inode->names_cap) {
+        cap = inode->names_cap ? inode->names_cap : NEWFS_NAMES_INIT_CAP;
+        while (inode->names_len + name_len + 1 > cap) {
+            cap *= 2;
         }
+        names = (char*)malloc(cap);
+        memcpy(names, inode->names, inode->names_len);
+        old     = inode->names;
+        __atomic_store_n(&inode->names, names, __ATOMIC_RELEASE);
+        __atomic_store_n(&inode->names_cap, cap, __ATOMIC_RELEASE);
+        newfs_rcu_retire(old, free);
     }
-    return inode;
+
+    dirent = &inode->dirents[inode->dir_cnt];
+    dirent->hash     = newfs_name_hash(name, name_len);
+    dirent->name_len = name_len;
+    dirent->ftype    = ftype;
+    dirent->ino      = ino;
+    dirent->name_ofs = inode->names_len;
+    dirent->dentry   = NULL;
+    memcpy(inode->names + inode->names_len, name, name_len);
+    inode->names[inode->names_len + name_len] = '\0';
+    inode->names_len += name_len + 1;
+
+    /* 记录填好之后才计入，无锁查找不会读到未初始化的记录 */
+    __atomic_store_n(&inode->dir_cnt, inode->dir_cnt + 1, __ATOMIC_RELEASE);
+    return inode->dir_cnt - 1;
 }
 
 /**
- * @brief 获得第 dir 个 dentry
+ * @brief 整理名称字符串区，去掉删除子项后留下的空洞
  * 
- * @param inode 
- * @param dir [0...]
- * @return struct newfs_dentry* 
+ * @param inode 目录inode
  */
-struct newfs_dentry* newfs_get_dentry(struct newfs_inode * inode, int dir) {
-    struct newfs_dentry* dentry_cursor = inode->dentrys;
-    int    cnt = 0;
-    while (dentry_cursor)
-    {
-        if (dir == cnt) {
-            return dentry_cursor;
-        }
-        cnt++;
-        dentry_cursor = dentry_cursor->brother;
+static void newfs_compact_names(struct newfs_inode* inode) {
+    char* names = (char*)malloc(inode->names_cap);      /* 容量不变，无锁查找按旧容量检查也不会越界 */
+    void* old;
+    int   len   = 0;
+    for (int i = 0; i < inode->dir_cnt; i++) {
+        memcpy(names + len, NEWFS_DIRENT_NAME(inode, i), inode->dirents[i].name_len + 1);
+        inode->dirents[i].name_ofs = len;
+        len += inode->dirents[i].name_len + 1;
     }
-    return NULL;
+    old = inode->names;
+    __atomic_store_n(&inode->names, names, __ATOMIC_RELEASE);
+    newfs_rcu_retire(old, free);
+    inode->names_len     = len;
+    inode->names_garbage = 0;
 }
 
 /**
- * @brief 查找文件或目录
- * path: /qwe/ad  total_lvl = 2,
- *      1) find /'s inode       lvl = 1
- *      2) find qwe's dentry 
- *      3) find qwe's inode     lvl = 2
- *      4) find ad's dentry
- *
- * path: /qwe     total_lvl = 1,
- *      1) find /'s inode       lvl = 1
- *      2) find qwe's dentry
- *  
- * 
- * 如果能查找到，返回该目录项
- * 如果查找不到，返回的是上一个有效的路径
+ * @brief 在目录中按名称查找子项
  * 
- * path: /a/b/c
- *      1) find /'s inode     lvl = 1
- *      2) find a's dentry 
- *      3) find a's inode     lvl = 2
- *      4) find b's dentry    如果此时找不到了，is_find=FALSE且返回的是a的inode对应的dentry
+ * @param inode 目录inode
+ * @param name 名称（不要求'\0'结尾）
+ * @param name_len 名称长度
+ * @return int 子项下标，找不到返回-1
+ */
+int newfs_find_dirent(struct newfs_inode* inode, const char* name, int name_len) {
+    uint32_t             hash   = newfs_name_hash(name, name_len);
+    struct newfs_dirent* dirent = inode->dirents;
+    for (int i = 0; i < inode->dir_cnt; i++, dirent++) {
+        if (dirent->hash == hash && dirent->name_len == name_len &&
+            memcmp(inode->names + dirent->name_ofs, name, name_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 不加锁地在目录中按名称查找子项。读到的可能是修改到一半的内容，
+ *        调用者事后用目录的 seq 校验；这里只保证不越界：容量先于指针读取，
+ *        扩容时先换指针再改容量，读到的容量不会超过读到的数组
  * 
- * @param path 
- * @return struct newfs_dentry* 
+ * @param inode 目录inode，调用者在读区内
+ * @param name 名称（不要求'\0'结尾）
+ * @param name_len 名称长度
+ * @return struct newfs_dirent* 子项记录，找不到返回NULL
  */
-struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean* is_root) {
-    struct newfs_dentry* dentry_cursor = newfs_super.root_dentry;
-    struct newfs_dentry* dentry_ret = NULL;
-    struct newfs_inode*  inode; 
-    int   total_lvl = newfs_calc_lvl(path);
-    int   lvl = 0;
-    boolean is_hit;
-    char* fname = NULL;
-    char* path_cpy = (char*)malloc(sizeof(path));
-    *is_root = FALSE;
-    strcpy(path_cpy, path);
+static struct newfs_dirent* newfs_find_dirent_rcu(struct newfs_inode* inode, const char* name, 
+                                                  int name_len) {
+    uint32_t             hash     = newfs_name_hash(name, name_len);
+    int                  cnt      = __atomic_load_n(&inode->dir_cnt, __ATOMIC_ACQUIRE);
+    int                  cap      = __atomic_load_n(&inode->dirents_cap, __ATOMIC_ACQUIRE);
+    struct newfs_dirent* dirent   = __atomic_load_n(&inode->dirents, __ATOMIC_ACQUIRE);
+    int                  ncap     = __atomic_load_n(&inode->names_cap, __ATOMIC_ACQUIRE);
+    const char*          names    = __atomic_load_n(&inode->names, __ATOMIC_ACQUIRE);
 
-    if (total_lvl == 0) {                           /* 根目录 */
-        *is_find = TRUE;
-        *is_root = TRUE;
-        dentry_ret = newfs_super.root_dentry;
+    if (cnt > cap) {
+        cnt = cap;
     }
-
-    // 最外层文件夹名称
-    fname = strtok(path_cpy, "/");       
-    while (fname)
-    {   
-        lvl++;
-        if (dentry_cursor->inode == NULL) {           /* Cache机制 */
-            newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+    for (int i = 0; i < cnt; i++, dirent++) {
+        if (dirent->hash == hash && dirent->name_len == name_len &&
+            dirent->name_ofs + (uint32_t)name_len < (uint32_t)ncap &&
+            memcmp(names + dirent->name_ofs, name, name_len) == 0) {
+            return dirent;
         }
+    }
+    return NULL;
+}
 
-        // 当前 dentry 对应的 inode
-        inode = dentry_cursor->inode;
+/**
+ * @brief 当前线程的首选分配组，线程第一次分配时轮流指定，
+ *        不同线程的新文件和新inode落在位图的不同区域，互不争抢同一段位图
+ * 
+ * @param max 位图的总位数
+ * @return int 首选分配组的第一个位号
+ */
+static int newfs_ag_start(int max) {
+    int groups = (max + NEWFS_AG_BITS - 1) / NEWFS_AG_BITS;
+    if (newfs_ag_hint < 0) {
+        newfs_ag_hint = __atomic_fetch_add(&newfs_ag_next, 1, __ATOMIC_RELAXED);
+    }
+    return groups > 0 ? (newfs_ag_hint % groups) * NEWFS_AG_BITS : 0;
+}
 
-        // 若出现文件类型但层数未到
-        if (NEWFS_IS_REG(inode) && lvl < total_lvl) {
-            NEWFS_DBG("[%s] not a dir\n", __func__);
-            dentry_ret = inode->dentry;
-            break;
-        }
+/**
+ * @brief 位图中的第 bit 位是否已被占用
+ */
+static boolean newfs_bitmap_test(uint8_t* map, int bit) {
+    return (__atomic_load_n(&map[bit / UINT8_BITS], __ATOMIC_RELAXED) & (0x1 << (bit % UINT8_BITS))) != 0;
+}
 
-        // 若为文件夹类型
-        if (NEWFS_IS_DIR(inode)) {
-            dentry_cursor = inode->dentrys;
-            is_hit        = FALSE;
+/**
+ * @brief 原子地占用位图中的第 bit 位
+ * 
+ * @return boolean 之前空闲、由这次占到返回TRUE，已被占用返回FALSE
+ */
+static boolean newfs_bitmap_try_claim(uint8_t* map, int bit) {
+    uint8_t mask = 0x1 << (bit % UINT8_BITS);
+    return (__atomic_fetch_or(&map[bit / UINT8_BITS], mask, __ATOMIC_ACQ_REL) & mask) == 0;
+}
 
-            while (dentry_cursor)   /* 遍历子目录项 */
-            {
-                if (memcmp(dentry_cursor->fname, fname, strlen(fname)) == 0) {
-                    is_hit = TRUE;
-                    break;
-                }
-                dentry_cursor = dentry_cursor->brother;
-            }
-            
-            // 未找到该文件 or 文件夹 
-            // mkdir mknod
-            if (!is_hit) {
-                *is_find = FALSE;
-                NEWFS_DBG("[%s] not found %s\n", __func__, fname);
-                dentry_ret = inode->dentry;
-                break;
-            }
+/**
+ * @brief 原子地清除位图中的第 bit 位
+ */
+static void newfs_bitmap_release(uint8_t* map, int bit) {
+    __atomic_fetch_and(&map[bit / UINT8_BITS], (uint8_t)(~(0x1 << (bit % UINT8_BITS))), 
+                       __ATOMIC_ACQ_REL);
+}
 
-            // 找到正确的文件
-            if (is_hit && lvl == total_lvl) {
-                *is_find = TRUE;
-                dentry_ret = dentry_cursor;
-                break;
-            }
+/**
+ * @brief 在位图 [0, max) 中从 start 开始找一个空闲位并占用，到末尾后回绕，
+ *        首选分配组满了就自然溢出到后面的组。不加锁，几个线程抢同一位时
+ *        只有一个能占到，其余的接着往后找
+ * 
+ * @param map 位图
+ * @param max 总位数
+ * @param start 起始位号
+ * @return int 占到的位号，没有空闲位返回-1
+ */
+static int newfs_bitmap_claim(uint8_t* map, int max, int start) {
+    int bit = start;
+    for (int n = 0; n < max; n++, bit++) {
+        if (bit == max) {
+            bit = 0;
+        }
+        if (!newfs_bitmap_test(map, bit) && newfs_bitmap_try_claim(map, bit)) {
+            return bit;
         }
-        fname = strtok(NULL, "/"); 
     }
+    return -1;
+}
 
-    // 从磁盘中读出 inode
-    if (dentry_ret->inode == NULL) {
-        dentry_ret->inode = newfs_read_inode(dentry_ret, dentry_ret->ino);
+/**
+ * @brief 从数据块位图中申请一个空闲数据块，从 goal 开始向后找，到末尾后回绕，
+ *        这样顺序写入的文件块尽量落在连续的数据块上
+ * 
+ * @param goal 期望的数据块号，不在范围内时从当前线程的首选分配组开始找
+ * @return int 数据块号，失败返回 -NEWFS_ERROR_NOSPACE
+ */
+static int newfs_claim_data_blk(int goal) {
+    int dno;
+    if (goal < 0 || goal >= newfs_super.max_data) {
+        goal = newfs_ag_start(newfs_super.max_data);
     }
-    
-    return dentry_ret;
+    dno = newfs_bitmap_claim(newfs_super.map_data, newfs_super.max_data, goal);
+    return dno < 0 ? -NEWFS_ERROR_NOSPACE : dno;
 }
 
 /**
- * @brief 初始化超级块
- */ 
-static void init_newfs_super_d(struct newfs_super_d* newfs_super_d) {
-    newfs_super_d->sz_usage = 0;
+ * @brief 申请一段连续的空闲数据块：从 goal 开始找第一段不短于 want 的空闲块，
+ *        找不到时退而取最长的一段。找到后逐块原子地占用，中途被别的线程抢走一块
+ *        就只取已占到的前一段，一块也没占到时重新找
+ * 
+ * @param goal 期望的起始数据块号
+ * @param want 需要的块数
+ * @param got 输出实际得到的块数
+ * @return int 起始数据块号，失败返回 -NEWFS_ERROR_NOSPACE
+ */
+static int newfs_claim_data_run(int goal, int want, int* got) {
+    int best, best_len;
+    int start = -1, len;
+    int dno;
+
+    if (goal < 0 || goal >= newfs_super.max_data) {
+        goal = newfs_ag_start(newfs_super.max_data);
+    }
+    while (TRUE) {
+        best     = -1;
+        best_len = 0;
+        len      = 0;
+        for (int n = 0; n < newfs_super.max_data && best_len < want; n++) {
+            dno = (goal + n) % newfs_super.max_data;
+            if (dno == 0) {                     /* 回绕时断开，空闲段不跨过末尾 */
+                len = 0;
+            }
+            if (newfs_bitmap_test(newfs_super.map_data, dno)) {
+                len = 0;
+                continue;
+            }
+            start = len == 0 ? dno : start;
+            len++;
+            if (len > best_len) {
+                best     = start;
+                best_len = len;
+            }
+        }
+        if (best_len == 0) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        best_len = best_len < want ? best_len : want;
+        for (len = 0; len < best_len; len++) {
+            if (!newfs_bitmap_try_claim(newfs_super.map_data, best + len)) {
+                break;
+            }
+        }
+        if (len > 0) {
+            *got = len;
+            return best;
+        }
+    }
+}
+
+/**
+ * @brief 将数据块归还给数据块位图
+ * 
+ * @param dno 数据块号
+ */
+static void newfs_release_data_blk(int dno) {
+    newfs_bitmap_release(newfs_super.map_data, NEWFS_PTR_DNO(dno));
+}
+
+/**
+ * @brief 新建一个间接块缓存，块号表全部置为-1
+ * 
+ * @param is_dind 是否是二级间接块，是则额外准备下一级缓存数组
+ * @return struct newfs_ptr_blk* 
+ */
+static struct newfs_ptr_blk* newfs_new_ptr_blk(boolean is_dind) {
+    struct newfs_ptr_blk* pblk = (struct newfs_ptr_blk*)malloc(sizeof(struct newfs_ptr_blk) + 
+                                                                NEWFS_BLK_SZ());
+    memset(pblk->ptrs, 0xFF, NEWFS_BLK_SZ());
+    pblk->dirty = FALSE;
+    pblk->sub   = NULL;
+    if (is_dind) {
+        pblk->sub = (struct newfs_ptr_blk**)calloc(NEWFS_PTRS_PER_BLK(), 
+                                                   sizeof(struct newfs_ptr_blk*));
+    }
+    return pblk;
+}
+
+/**
+ * @brief 取得块号为 *dno 的间接块的缓存，第一次访问时从磁盘读入；
+ *        间接块不存在且 alloc 为TRUE时分配一个新的间接块。
+ *        只持有inode读锁的查找也会填充缓存，填充在 cache_lock 下进行
+ * 
+ * @param cache 缓存指针所在位置
+ * @param dno 间接块块号所在位置（inode或上一级间接块中）
+ * @param is_dind 是否是二级间接块
+ * @param alloc 不存在时是否分配
+ * @param parent 上一级间接块，*dno 位于inode中时为NULL
+ * @return struct newfs_ptr_blk* 不存在或分配失败时返回NULL
+ */
+static struct newfs_ptr_blk* newfs_get_ptr_blk(struct newfs_ptr_blk** cache, int* dno, 
+                                               boolean is_dind, boolean alloc,
+                                               struct newfs_ptr_blk* parent) {
+    struct newfs_ptr_blk* pblk;
+    int new_dno;
+
+    if ((pblk = __atomic_load_n(cache, __ATOMIC_ACQUIRE)) != NULL) {
+        return pblk;
+    }
+    pthread_mutex_lock(&newfs_super.cache_lock);
+    if ((pblk = *cache) != NULL) {              /* 别的读者已经读入 */
+        pthread_mutex_unlock(&newfs_super.cache_lock);
+        return pblk;
+    }
+    if (*dno == -1) {
+        if (!alloc) {
+            pthread_mutex_unlock(&newfs_super.cache_lock);
+            return NULL;
+        }
+        new_dno = newfs_claim_data_blk(-1);
+        if (new_dno < 0) {
+            pthread_mutex_unlock(&newfs_super.cache_lock);
+            return NULL;
+        }
+        pblk        = newfs_new_ptr_blk(is_dind);
+        pblk->dirty = TRUE;
+        *dno        = new_dno;
+        if (parent != NULL) {
+            parent->dirty = TRUE;
+        }
+        __atomic_store_n(cache, pblk, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&newfs_super.cache_lock);
+        return pblk;
+    }
+
+    pblk = newfs_new_ptr_blk(is_dind);
+    if (newfs_driver_read(NEWFS_DATA_OFS(*dno), (uint8_t *)pblk->ptrs, 
+                          NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] io error\n", __func__);
+        pthread_mutex_unlock(&newfs_super.cache_lock);
+        free(pblk->sub);
+        free(pblk);
+        return NULL;
+    }
+    __atomic_store_n(cache, pblk, __ATOMIC_RELEASE);  /* 内容完整后才让无锁的快路径看到 */
+    pthread_mutex_unlock(&newfs_super.cache_lock);
+    return pblk;
+}
+
+/**
+ * @brief 写回（write 为TRUE时）并释放一个间接块缓存，二级间接块连同其下一级缓存一起处理
+ * 
+ * @param pblk 间接块缓存，可以为NULL
+ * @param dno 间接块块号
+ * @param write 是否写回有改动的块号表
+ * @return int 
+ */
+static int newfs_put_ptr_blk(struct newfs_ptr_blk* pblk, int dno, boolean write) {
+    int ret = NEWFS_ERROR_NONE;
+    if (pblk == NULL) {
+        return ret;
+    }
+    if (pblk->sub != NULL) {
+        for (int i = 0; i < NEWFS_PTRS_PER_BLK(); i++) {
+            if (pblk->sub[i] != NULL && 
+                newfs_put_ptr_blk(pblk->sub[i], pblk->ptrs[i], write) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+            }
+        }
+        free(pblk->sub);
+    }
+    if (write && pblk->dirty && 
+        newfs_driver_write(NEWFS_DATA_OFS(dno), (uint8_t *)pblk->ptrs, 
+                           NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] io error\n", __func__);
+        ret = -NEWFS_ERROR_IO;
+    }
+    free(pblk);
+    return ret;
+}
+
+/**
+ * @brief 写回一个间接块缓存中有改动的块号表（二级间接块连同其下一级），缓存保留
+ * 
+ * @param pblk 间接块缓存，可以为NULL
+ * @param dno 间接块块号
+ * @return int 
+ */
+static int newfs_flush_ptr_blk(struct newfs_ptr_blk* pblk, int dno) {
+    int ret = NEWFS_ERROR_NONE;
+    if (pblk == NULL) {
+        return ret;
+    }
+    if (pblk->sub != NULL) {
+        for (int i = 0; i < NEWFS_PTRS_PER_BLK(); i++) {
+            if (pblk->sub[i] != NULL && 
+                newfs_flush_ptr_blk(pblk->sub[i], pblk->ptrs[i]) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+            }
+        }
+    }
+    if (pblk->dirty) {
+        if (newfs_driver_write(NEWFS_DATA_OFS(dno), (uint8_t *)pblk->ptrs, 
+                               NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] io error\n", __func__);
+            return -NEWFS_ERROR_IO;
+        }
+        pblk->dirty = FALSE;
+    }
+    return ret;
+}
+
+/**
+ * @brief 归还一个间接块及其下方映射的全部数据块，并清空对应的块号
+ * 
+ * @param cache 缓存指针所在位置
+ * @param dno 间接块块号所在位置
+ * @param is_dind 是否是二级间接块
+ */
+static void newfs_release_ptr_blk(struct newfs_ptr_blk** cache, int* dno, boolean is_dind) {
+    struct newfs_ptr_blk* pblk = newfs_get_ptr_blk(cache, dno, is_dind, FALSE, NULL);
+    if (pblk == NULL) {
+        return;
+    }
+    for (int i = 0; i < NEWFS_PTRS_PER_BLK(); i++) {
+        if (pblk->ptrs[i] == -1) {
+            continue;
+        }
+        if (is_dind) {
+            newfs_release_ptr_blk(&pblk->sub[i], &pblk->ptrs[i], FALSE);
+        }
+        else {
+            newfs_release_data_blk(pblk->ptrs[i]);
+        }
+    }
+    newfs_release_data_blk(*dno);
+    free(pblk->sub);
+    free(pblk);
+    *cache = NULL;
+    *dno   = -1;
+}
+
+/**
+ * @brief 找到文件第 blk 块的块号所在的表项：直接指针、一级间接块或二级间接块中，
+ *        途经的间接块读入后缓存在inode中，同一文件之后的查找不再访问磁盘
+ * 
+ * @param inode 
+ * @param blk 文件块号
+ * @param alloc 途经的间接块不存在时是否分配
+ * @param holder 输出表项所在的间接块，表项位于inode中时为NULL
+ * @return int* 表项地址；超出文件最大块数、间接块不存在（不分配时）或分配失败返回NULL
+ */
+static int* newfs_map_slot(struct newfs_inode* inode, int blk, boolean alloc, 
+                           struct newfs_ptr_blk** holder) {
+    struct newfs_ptr_blk* top;
+    struct newfs_ptr_blk* pblk;
+    int ppb = NEWFS_PTRS_PER_BLK();
+
+    *holder = NULL;
+    if (blk < 0) {
+        return NULL;
+    }
+    if (blk < NEWFS_DATA_PER_FILE) {
+        return &inode->block_pointer[blk];
+    }
+
+    blk -= NEWFS_DATA_PER_FILE;
+    if (blk < ppb) {
+        pblk = newfs_get_ptr_blk(&inode->ind, &inode->ind_pointer, FALSE, alloc, NULL);
+        if (pblk == NULL) {
+            return NULL;
+        }
+        *holder = pblk;
+        return &pblk->ptrs[blk];
+    }
+
+    blk -= ppb;
+    if (blk < ppb * ppb) {
+        top = newfs_get_ptr_blk(&inode->dind, &inode->dind_pointer, TRUE, alloc, NULL);
+        if (top == NULL) {
+            return NULL;
+        }
+        pblk = newfs_get_ptr_blk(&top->sub[blk / ppb], &top->ptrs[blk / ppb], FALSE, alloc, top);
+        if (pblk == NULL) {
+            return NULL;
+        }
+        *holder = pblk;
+        return &pblk->ptrs[blk % ppb];
+    }
+    return NULL;
+}
+
+/**
+ * @brief 二分查找起始块号不大于 blk 的最后一个区段
+ * 
+ * @param inode 
+ * @param blk 文件块号
+ * @return int 区段下标，blk 位于第一个区段之前时返回-1
+ */
+static int newfs_find_extent(struct newfs_inode* inode, int blk) {
+    int lo = 0, hi = inode->ext_cnt - 1, mid, ret = -1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if ((int)inode->exts[mid].blk <= blk) {
+            ret = mid;
+            lo  = mid + 1;
+        }
+        else {
+            hi  = mid - 1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief 保证区段数组至少能放下 cap 个区段
+ * 
+ * @param inode 
+ * @param cap 
+ * @return int 
+ */
+static int newfs_reserve_extents(struct newfs_inode* inode, int cap) {
+    struct newfs_extent* exts;
+    if (cap <= inode->ext_cap) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (cap < inode->ext_cap * 2) {
+        cap = inode->ext_cap * 2;
+    }
+    exts = (struct newfs_extent*)realloc(inode->exts, cap * sizeof(struct newfs_extent));
+    if (exts == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    inode->exts    = exts;
+    inode->ext_cap = cap;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 两个相邻的区段能否合并：文件块和数据块都首尾相接，且同为已写或同为未写
+ */
+static boolean newfs_ext_mergeable(struct newfs_extent* a, struct newfs_extent* b) {
+    return a->blk + NEWFS_EXT_LEN(a) == b->blk && a->dno + NEWFS_EXT_LEN(a) == b->dno &&
+           NEWFS_EXT_IS_UNWRITTEN(a) == NEWFS_EXT_IS_UNWRITTEN(b);
+}
+
+/**
+ * @brief 第 idx 个区段与前后能合并的区段合并
+ * 
+ * @param inode 
+ * @param idx 
+ */
+static void newfs_merge_extents(struct newfs_inode* inode, int idx) {
+    struct newfs_extent* exts = inode->exts;
+    if (idx + 1 < inode->ext_cnt && newfs_ext_mergeable(&exts[idx], &exts[idx + 1])) {
+        exts[idx].len += NEWFS_EXT_LEN(&exts[idx + 1]);
+        memmove(&exts[idx + 1], &exts[idx + 2], (inode->ext_cnt - idx - 2) * sizeof(struct newfs_extent));
+        inode->ext_cnt--;
+    }
+    if (idx > 0 && newfs_ext_mergeable(&exts[idx - 1], &exts[idx])) {
+        exts[idx - 1].len += NEWFS_EXT_LEN(&exts[idx]);
+        memmove(&exts[idx], &exts[idx + 1], (inode->ext_cnt - idx - 1) * sizeof(struct newfs_extent));
+        inode->ext_cnt--;
+    }
+}
+
+/**
+ * @brief 把文件块 [blk, blk + n) 映射到数据块 [dno, dno + n)，能并入相邻区段时直接合并
+ * 
+ * @param inode 
+ * @param blk 起始文件块号，调用者保证这些块尚未映射
+ * @param dno 起始数据块号
+ * @param len 块数，可带 NEWFS_EXT_UNWRITTEN 位
+ * @return int 
+ */
+static int newfs_insert_extent(struct newfs_inode* inode, int blk, int dno, uint32_t len) {
+    int i = newfs_find_extent(inode, blk);
+
+    if (newfs_reserve_extents(inode, inode->ext_cnt + 1) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    memmove(&inode->exts[i + 2], &inode->exts[i + 1], 
+            (inode->ext_cnt - i - 1) * sizeof(struct newfs_extent));
+    inode->exts[i + 1].blk = blk;
+    inode->exts[i + 1].dno = dno;
+    inode->exts[i + 1].len = len;
+    inode->ext_cnt++;
+    inode->ext_dirty = TRUE;
+    newfs_merge_extents(inode, i + 1);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 改变文件第 blk 块一块的映射：去掉或重新加上预分配的未写标记，
+ *        或者归还该数据块、让它成为空洞。区段映射时把所在区段拆成
+ *        （前段、该块、后段），前后段保持原来的状态，该块再与前后合并
+ * 
+ * @param inode 
+ * @param blk 文件块号，调用者保证其已映射
+ * @param mode 新的映射状态
+ * @return int 
+ */
+static int newfs_remap_blk(struct newfs_inode* inode, int blk, NEWFS_REMAP mode) {
+    struct newfs_ptr_blk* holder;
+    struct newfs_extent   ext, parts[3];
+    int* slot;
+    int  i, off, n = 0, mid;
+
+    if (!NEWFS_USE_EXTENTS(inode)) {
+        slot = newfs_map_slot(inode, blk, FALSE, &holder);
+        if (slot != NULL && *slot != -1) {
+            if (mode == NEWFS_REMAP_PUNCH) {
+                newfs_release_data_blk(NEWFS_PTR_DNO(*slot));
+                *slot = -1;
+            }
+            else {
+                *slot = NEWFS_PTR_DNO(*slot) | (mode == NEWFS_REMAP_UNWRITTEN ? NEWFS_BLK_UNWRITTEN : 0);
+            }
+            if (holder != NULL) {
+                holder->dirty = TRUE;
+            }
+        }
+        return NEWFS_ERROR_NONE;
+    }
+
+    i   = newfs_find_extent(inode, blk);
+    ext = inode->exts[i];
+    off = blk - ext.blk;
+    if (off > 0) {
+        parts[n].blk = ext.blk;
+        parts[n].dno = ext.dno;
+        parts[n].len = off | (ext.len & NEWFS_EXT_UNWRITTEN);
+        n++;
+    }
+    mid = i + n;
+    if (mode != NEWFS_REMAP_PUNCH) {
+        parts[n].blk = blk;
+        parts[n].dno = ext.dno + off;
+        parts[n].len = 1 | (mode == NEWFS_REMAP_UNWRITTEN ? NEWFS_EXT_UNWRITTEN : 0);
+        n++;
+    }
+    if (NEWFS_EXT_LEN(&ext) - off - 1 > 0) {
+        parts[n].blk = blk + 1;
+        parts[n].dno = ext.dno + off + 1;
+        parts[n].len = (NEWFS_EXT_LEN(&ext) - off - 1) | (ext.len & NEWFS_EXT_UNWRITTEN);
+        n++;
+    }
+
+    if (newfs_reserve_extents(inode, inode->ext_cnt + n - 1) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (mode == NEWFS_REMAP_PUNCH) {
+        newfs_release_data_blk(ext.dno + off);
+    }
+    memmove(&inode->exts[i + n], &inode->exts[i + 1], 
+            (inode->ext_cnt - i - 1) * sizeof(struct newfs_extent));
+    memcpy(&inode->exts[i], parts, n * sizeof(struct newfs_extent));
+    inode->ext_cnt  += n - 1;
+    inode->ext_dirty = TRUE;
+    if (mode != NEWFS_REMAP_PUNCH) {
+        newfs_merge_extents(inode, mid);
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 读入一个区段树块并校验块头
+ * 
+ * @param dno 区段树块块号
+ * @param buf 块缓冲区
+ * @param depth 期望的层数，-1 表示不限
+ * @return int 块内的有效项数，失败返回错误码
+ */
+static int newfs_read_ext_blk(int dno, uint8_t* buf, int depth) {
+    struct newfs_ext_hdr_d* hdr = (struct newfs_ext_hdr_d*)buf;
+    if (newfs_driver_read(NEWFS_DATA_OFS(dno), buf, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    if (hdr->magic != NEWFS_EXT_MAGIC || hdr->depth > 1 || (depth >= 0 && hdr->depth != depth) ||
+        hdr->cnt > (hdr->depth == 0 ? NEWFS_EXTS_PER_BLK() : NEWFS_EXT_IDX_PER_BLK())) {
+        NEWFS_DBG("[%s] bad extent block %d\n", __func__, dno);
+        return -NEWFS_ERROR_IO;
+    }
+    return hdr->cnt;
+}
+
+/**
+ * @brief 读入文件的全部区段：少量区段内嵌在inode中，
+ *        多了则在区段树中（根为叶子块，或根为索引块、下面一层叶子块）
+ * 
+ * @param inode 
+ * @param inode_d 
+ * @return int 
+ */
+static int newfs_load_extents(struct newfs_inode* inode, struct newfs_inode_d* inode_d) {
+    struct newfs_ext_hdr_d* hdr;
+    struct newfs_ext_idx_d* idx;
+    uint8_t* root;
+    uint8_t* leaf;
+    int cnt;
+    int ret = NEWFS_ERROR_NONE;
+
+    if (inode_d->ext_pointer == -1) {
+        if (inode_d->ext_cnt > NEWFS_INLINE_EXTS || 
+            newfs_reserve_extents(inode, inode_d->ext_cnt) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+        memcpy(inode->exts, inode_d->ext, inode_d->ext_cnt * sizeof(struct newfs_extent));
+        inode->ext_cnt = inode_d->ext_cnt;
+        return NEWFS_ERROR_NONE;
+    }
+
+    root = (uint8_t*)malloc(NEWFS_BLK_SZ() * 2);
+    leaf = root + NEWFS_BLK_SZ();
+    hdr  = (struct newfs_ext_hdr_d*)root;
+    cnt  = newfs_read_ext_blk(inode_d->ext_pointer, root, -1);
+    if (cnt < 0 || newfs_reserve_extents(inode, inode_d->ext_cnt) != NEWFS_ERROR_NONE) {
+        free(root);
+        return -NEWFS_ERROR_IO;
+    }
+    inode->ext_blks    = (int*)malloc((hdr->depth == 0 ? 1 : 1 + cnt) * sizeof(int));
+    inode->ext_blks[0] = inode_d->ext_pointer;
+    inode->ext_blk_cnt = 1;
+
+    if (hdr->depth == 0) {
+        memcpy(inode->exts, root + sizeof(struct newfs_ext_hdr_d), cnt * sizeof(struct newfs_extent));
+        inode->ext_cnt = cnt;
+    }
+    else {
+        idx = (struct newfs_ext_idx_d*)(root + sizeof(struct newfs_ext_hdr_d));
+        for (int l = 0; l < cnt; l++) {
+            ret = newfs_read_ext_blk(idx[l].dno, leaf, 0);
+            if (ret < 0 || newfs_reserve_extents(inode, inode->ext_cnt + ret) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+                break;
+            }
+            memcpy(inode->exts + inode->ext_cnt, leaf + sizeof(struct newfs_ext_hdr_d), 
+                   ret * sizeof(struct newfs_extent));
+            inode->ext_cnt += ret;
+            inode->ext_blks[inode->ext_blk_cnt++] = idx[l].dno;
+            ret = NEWFS_ERROR_NONE;
+        }
+    }
+    free(root);
+    return ret;
+}
+
+/**
+ * @brief 区段有改动时重写区段：不超过 NEWFS_INLINE_EXTS 个时内嵌在inode中，
+ *        一个叶子块放得下时根即叶子，否则根为索引块，下面挂若干叶子块；
+ *        原有的区段树块尽量复用，多余的归还
+ * 
+ * @param inode 
+ * @return int 
+ */
+static int newfs_sync_extents(struct newfs_inode* inode) {
+    struct newfs_ext_hdr_d* hdr;
+    struct newfs_ext_idx_d* idx;
+    uint8_t* buf;
+    int per_leaf = NEWFS_EXTS_PER_BLK();
+    int leaves, need, cnt, dno;
+    int ret = NEWFS_ERROR_NONE;
+
+    if (!inode->ext_dirty) {
+        return NEWFS_ERROR_NONE;
+    }
+    leaves = inode->ext_cnt <= NEWFS_INLINE_EXTS ? 0 : (inode->ext_cnt + per_leaf - 1) / per_leaf;
+    need   = leaves <= 1 ? leaves : leaves + 1;
+    if (leaves > NEWFS_EXT_IDX_PER_BLK()) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+
+    while (inode->ext_blk_cnt > need) {
+        newfs_release_data_blk(inode->ext_blks[--inode->ext_blk_cnt]);
+    }
+    if (need > inode->ext_blk_cnt) {
+        inode->ext_blks = (int*)realloc(inode->ext_blks, need * sizeof(int));
+        while (inode->ext_blk_cnt < need) {
+            dno = newfs_claim_data_blk(-1);
+            if (dno < 0) {
+                return dno;
+            }
+            inode->ext_blks[inode->ext_blk_cnt++] = dno;
+        }
+    }
+    if (need == 0) {
+        inode->ext_dirty = FALSE;
+        return NEWFS_ERROR_NONE;
+    }
+
+    buf = (uint8_t*)malloc(NEWFS_BLK_SZ());
+    hdr = (struct newfs_ext_hdr_d*)buf;
+    for (int l = 0; l < leaves && ret == NEWFS_ERROR_NONE; l++) {
+        cnt = inode->ext_cnt - l * per_leaf < per_leaf ? inode->ext_cnt - l * per_leaf : per_leaf;
+        memset(buf, 0, NEWFS_BLK_SZ());
+        hdr->magic = NEWFS_EXT_MAGIC;
+        hdr->cnt   = cnt;
+        hdr->depth = 0;
+        memcpy(buf + sizeof(struct newfs_ext_hdr_d), inode->exts + l * per_leaf, 
+               cnt * sizeof(struct newfs_extent));
+        ret = newfs_driver_write(NEWFS_DATA_OFS(inode->ext_blks[leaves == 1 ? 0 : l + 1]), 
+                                 buf, NEWFS_BLK_SZ());
+    }
+    if (leaves > 1 && ret == NEWFS_ERROR_NONE) {
+        memset(buf, 0, NEWFS_BLK_SZ());
+        hdr->magic = NEWFS_EXT_MAGIC;
+        hdr->cnt   = leaves;
+        hdr->depth = 1;
+        idx = (struct newfs_ext_idx_d*)(buf + sizeof(struct newfs_ext_hdr_d));
+        for (int l = 0; l < leaves; l++) {
+            idx[l].blk = inode->exts[l * per_leaf].blk;
+            idx[l].dno = inode->ext_blks[l + 1];
+        }
+        ret = newfs_driver_write(NEWFS_DATA_OFS(inode->ext_blks[0]), buf, NEWFS_BLK_SZ());
+    }
+    free(buf);
+    if (ret != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    inode->ext_dirty = FALSE;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 查询从文件第 blk 块开始、至多 max 块的一段连续映射：
+ *        这些块依次映射到从 *dno 开始的连续数据块，或者都未映射（*dno 为-1）；
+ *        一段中的块同为已写或同为预分配未写（*dno 带 NEWFS_BLK_UNWRITTEN 位）
+ * 
+ * @param inode 
+ * @param blk 文件块号
+ * @param max 最多查询的块数，不小于1
+ * @param dno 输出起始数据块号
+ * @return int 这一段的块数
+ */
+int newfs_bmap_run(struct newfs_inode* inode, int blk, int max, int* dno) {
+    struct newfs_ptr_blk* holder;
+    struct newfs_extent*  ext;
+    int* slot;
+    int  i, n;
+
+    if (NEWFS_USE_EXTENTS(inode)) {
+        i = newfs_find_extent(inode, blk);
+        if (i >= 0 && blk < (int)inode->exts[i].blk + NEWFS_EXT_LEN(&inode->exts[i])) {
+            ext  = &inode->exts[i];
+            *dno = ext->dno + (blk - ext->blk);
+            *dno = NEWFS_EXT_IS_UNWRITTEN(ext) ? *dno | NEWFS_BLK_UNWRITTEN : *dno;
+            n    = ext->blk + NEWFS_EXT_LEN(ext) - blk;
+        }
+        else {
+            *dno = -1;
+            n    = i + 1 < inode->ext_cnt ? (int)inode->exts[i + 1].blk - blk : max;
+        }
+        return n < max ? n : max;
+    }
+
+    slot = newfs_map_slot(inode, blk, FALSE, &holder);
+    *dno = slot == NULL ? -1 : *slot;
+    for (n = 1; n < max; n++) {
+        slot = newfs_map_slot(inode, blk + n, FALSE, &holder);
+        if ((slot == NULL ? -1 : *slot) != (*dno == -1 ? -1 : *dno + n)) {
+            break;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief 查询文件第 blk 块映射到的数据块号
+ * 
+ * @param inode 
+ * @param blk 文件块号
+ * @return int 数据块号，未映射返回-1
+ */
+int newfs_bmap(struct newfs_inode* inode, int blk) {
+    int dno;
+    newfs_bmap_run(inode, blk, 1, &dno);
+    return dno;
+}
+
+/**
+ * @brief 归还文件第 from 块及之后映射的全部数据块，变空的间接块、区段一并归还，
+ *        这些块在内存中的缓冲区也一起丢弃
+ * 
+ * @param inode 文件inode
+ * @param from 文件块号
+ */
+static void newfs_unmap_data_blks(struct newfs_inode* inode, int from) {
+    struct newfs_ptr_blk* pblk;
+    struct newfs_extent*  ext;
+    int ppb  = NEWFS_PTRS_PER_BLK();
+    int base = NEWFS_DATA_PER_FILE + ppb;
+    int rel;
+
+    for (int i = from; i < inode->data_cap; i++) {
+        free(inode->data[i]);
+        inode->data[i] = NULL;
+        inode->data_dirty[i / UINT8_BITS] &= ~(0x1 << (i % UINT8_BITS));
+        inode->data_prealloc[i / UINT8_BITS] &= ~(0x1 << (i % UINT8_BITS));
+    }
+
+    if (NEWFS_USE_EXTENTS(inode)) {
+        while (inode->ext_cnt > 0) {
+            ext = &inode->exts[inode->ext_cnt - 1];
+            if ((int)ext->blk + NEWFS_EXT_LEN(ext) <= from) {
+                break;
+            }
+            rel = (int)ext->blk < from ? from - ext->blk : 0;   /* 区段中保留的块数 */
+            for (int j = rel; j < NEWFS_EXT_LEN(ext); j++) {
+                newfs_release_data_blk(ext->dno + j);
+            }
+            inode->ext_dirty = TRUE;
+            if (rel > 0) {
+                ext->len = rel | (ext->len & NEWFS_EXT_UNWRITTEN);
+                break;
+            }
+            inode->ext_cnt--;
+        }
+        return;
+    }
+
+    /* 直接块 */
+    for (int i = from; i < NEWFS_DATA_PER_FILE; i++) {
+        if (inode->block_pointer[i] != -1) {
+            newfs_release_data_blk(inode->block_pointer[i]);
+            inode->block_pointer[i] = -1;
+        }
+    }
+
+    /* 一级间接块 */
+    if (from <= NEWFS_DATA_PER_FILE) {
+        newfs_release_ptr_blk(&inode->ind, &inode->ind_pointer, FALSE);
+    }
+    else if (from < base &&
+             (pblk = newfs_get_ptr_blk(&inode->ind, &inode->ind_pointer, FALSE, FALSE, NULL)) != NULL) {
+        for (int i = from - NEWFS_DATA_PER_FILE; i < ppb; i++) {
+            if (pblk->ptrs[i] != -1) {
+                newfs_release_data_blk(pblk->ptrs[i]);
+                pblk->ptrs[i] = -1;
+                pblk->dirty   = TRUE;
+            }
+        }
+    }
+
+    /* 二级间接块：整个下一级块都在截断范围内的直接归还，跨界的那个只归还后半部分 */
+    if (from <= base) {
+        newfs_release_ptr_blk(&inode->dind, &inode->dind_pointer, TRUE);
+    }
+    else if (from < base + ppb * ppb &&
+             (pblk = newfs_get_ptr_blk(&inode->dind, &inode->dind_pointer, TRUE, FALSE, NULL)) != NULL) {
+        rel = from - base;
+        for (int k = (rel + ppb - 1) / ppb; k < ppb; k++) {
+            if (pblk->ptrs[k] != -1) {
+                newfs_release_ptr_blk(&pblk->sub[k], &pblk->ptrs[k], FALSE);
+                pblk->dirty = TRUE;
+            }
+        }
+        if (rel % ppb != 0 && pblk->ptrs[rel / ppb] != -1) {
+            struct newfs_ptr_blk* sub = newfs_get_ptr_blk(&pblk->sub[rel / ppb], &pblk->ptrs[rel / ppb],
+                                                          FALSE, FALSE, pblk);
+            for (int i = rel % ppb; sub != NULL && i < ppb; i++) {
+                if (sub->ptrs[i] != -1) {
+                    newfs_release_data_blk(sub->ptrs[i]);
+                    sub->ptrs[i] = -1;
+                    sub->dirty   = TRUE;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief 为长度为 need 的目录记录找位置（仿EXT2）：
+ *  1) 块首空闲记录够大，直接占用
+ *  2) 某条记录尾部富余的空间够大，将其拆成两条
+ *  3) 都没有时分配一个新的目录块
+ * 
+ * @param inode 目录inode
+ * @param need 新记录需要的字节数
+ * @param rec 输出新记录的 blk、rec_ofs、rec_len
+ * @return int 成功返回NEWFS_ERROR_NONE
+ */
+static int newfs_claim_dir_rec(struct newfs_inode* inode, int need, struct newfs_dirent* rec) {
+    struct newfs_dirent* dirent;
+    int used;
+    int dno;
+
+    for (int blk = 0; blk < NEWFS_DATA_PER_FILE; blk++) {
+        if (inode->block_pointer[blk] != -1 && inode->dir_hole[blk] >= need) {
+            rec->blk     = blk;
+            rec->rec_ofs = 0;
+            rec->rec_len = inode->dir_hole[blk];
+            inode->dir_hole[blk] = 0;
+            NEWFS_DIR_MARK_DIRTY(inode, blk);
+            return NEWFS_ERROR_NONE;
+        }
+    }
+
+    for (int i = 0; i < inode->dir_cnt; i++) {
+        dirent = &inode->dirents[i];
+        used   = NEWFS_DENTRY_D_LEN(dirent->name_len);
+        if (dirent->rec_len - used >= need) {
+            rec->blk        = dirent->blk;
+            rec->rec_ofs    = dirent->rec_ofs + used;
+            rec->rec_len    = dirent->rec_len - used;
+            dirent->rec_len = used;
+            NEWFS_DIR_MARK_DIRTY(inode, rec->blk);
+            return NEWFS_ERROR_NONE;
+        }
+    }
+
+    for (int blk = 0; blk < NEWFS_DATA_PER_FILE; blk++) {
+        if (inode->block_pointer[blk] == -1) {
+            dno = newfs_claim_data_blk(-1);
+            if (dno < 0) {
+                return dno;
+            }
+            inode->block_pointer[blk] = dno;
+            inode->dir_hole[blk]      = 0;
+            inode->size              += NEWFS_BLK_SZ();
+            rec->blk     = blk;
+            rec->rec_ofs = 0;
+            rec->rec_len = NEWFS_BLK_SZ();
+            NEWFS_DIR_MARK_DIRTY(inode, blk);
+            return NEWFS_ERROR_NONE;
+        }
+    }
+    return -NEWFS_ERROR_NOSPACE;
+}
+
+/**
+ * @brief 归还一条目录记录占用的空间：并入同一块中的前一条记录，
+ *        没有前一条记录时并入块首空闲记录，整块空闲时释放该目录块
+ * 
+ * @param inode 目录inode
+ * @param rec 要归还的记录
+ */
+static void newfs_release_dir_rec(struct newfs_inode* inode, struct newfs_dirent* rec) {
+    struct newfs_dirent* dirent;
+    int blk = rec->blk;
+
+    for (int i = 0; i < inode->dir_cnt; i++) {
+        dirent = &inode->dirents[i];
+        if (dirent != rec && dirent->blk == blk && 
+            dirent->rec_ofs + dirent->rec_len == rec->rec_ofs) {
+            dirent->rec_len += rec->rec_len;
+            NEWFS_DIR_MARK_DIRTY(inode, blk);
+            return;
+        }
+    }
+
+    inode->dir_hole[blk] += rec->rec_len;
+    NEWFS_DIR_MARK_DIRTY(inode, blk);
+    if (inode->dir_hole[blk] == NEWFS_BLK_SZ()) {
+        newfs_release_data_blk(inode->block_pointer[blk]);
+        inode->block_pointer[blk] = -1;
+        inode->dir_hole[blk]      = 0;
+        inode->size              -= NEWFS_BLK_SZ();
+        inode->dir_dirty         &= ~(0x1 << blk);
+    }
+}
+
+/**
+ * @brief 将dentry加入目录inode的子项数组，并在目录块中为其分配记录
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 成功返回目录项个数，失败返回错误码
+ */
+int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
+    struct newfs_dirent  rec;
+    struct newfs_dirent* dirent;
+    int name_len = strlen(dentry->fname);
+    int ret      = newfs_claim_dir_rec(inode, NEWFS_DENTRY_D_LEN(name_len), &rec);
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+
+    dentry->slot    = newfs_append_dirent(inode, dentry->fname, name_len,
+                                          dentry->ino, dentry->ftype);
+    dirent          = &inode->dirents[dentry->slot];
+    __atomic_store_n(&dirent->dentry, dentry, __ATOMIC_RELEASE);
+    dirent->blk     = rec.blk;
+    dirent->rec_ofs = rec.rec_ofs;
+    dirent->rec_len = rec.rec_len;
+
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 将一条目录记录编码到 buf 中
+ * 
+ * @param inode 目录inode
+ * @param dir 子项下标
+ * @param buf 输出，至少 NEWFS_DENTRY_D_LEN(name_len) 字节
+ * @return int 编码的有效字节数（记录头 + 名称）
+ */
+static int newfs_encode_dentry(struct newfs_inode* inode, int dir, uint8_t* buf) {
+    struct newfs_dirent*   dirent   = &inode->dirents[dir];
+    struct newfs_dentry_d* dentry_d = (struct newfs_dentry_d*)buf;
+    dentry_d->ino      = dirent->ino;
+    dentry_d->rec_len  = dirent->rec_len;
+    dentry_d->name_len = dirent->name_len;
+    dentry_d->ftype    = dirent->ftype;
+    memcpy(dentry_d->fname, NEWFS_DIRENT_NAME(inode, dir), dirent->name_len);
+    return sizeof(struct newfs_dentry_d) + dirent->name_len;
+}
+
+/**
+ * @brief 分配inode索引节点
+ * 
+ * @param dentry 
+ * @return struct newfs_inode* inode号用完时返回NULL
+ */
+struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
+    struct newfs_inode* inode;
+    int ino_cursor;
+
+    /* 从当前线程的首选分配组开始找空闲的inode号 */
+    ino_cursor = newfs_bitmap_claim(newfs_super.map_inode, newfs_super.max_ino, 
+                                    newfs_ag_start(newfs_super.max_ino));
+    if (ino_cursor < 0)
+        return NULL;
+
+    inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
+    inode->ino  = ino_cursor; 
+    inode->size = 0;
+    // dentry 指向 inode
+    dentry->inode = inode;
+    dentry->ino   = inode->ino;
+    // inode 指向 dentry                                                                                                
+    inode->dentry = dentry;
+    inode->ftype  = dentry->ftype;
+    inode->atime  = inode->mtime = inode->ctime = (uint32_t)time(NULL);
+    
+    inode->dir_cnt       = 0;
+    inode->dirents       = NULL;
+    inode->dirents_cap   = 0;
+    inode->names         = NULL;
+    inode->names_len     = 0;
+    inode->names_cap     = 0;
+    inode->names_garbage = 0;
+    inode->seq           = 0;
+    inode->seq_nest      = 0;
+    inode->dir_dirty     = 0;
+    
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++){
+        inode->block_pointer[i] = -1;
+        inode->dir_hole[i]      = 0;
+    }
+    // 数据块缓冲区在写入时才分配
+    inode->ind_pointer  = -1;
+    inode->dind_pointer = -1;
+    inode->ind          = NULL;
+    inode->dind         = NULL;
+    inode->exts         = NULL;
+    inode->ext_cnt      = 0;
+    inode->ext_cap      = 0;
+    inode->ext_blks     = NULL;
+    inode->ext_blk_cnt  = 0;
+    inode->ext_dirty    = TRUE;
+    inode->data         = NULL;
+    inode->data_cap     = 0;
+    inode->data_dirty   = NULL;
+    inode->data_prealloc = NULL;
+    inode->dirty_next   = NULL;
+    inode->dirty_pprev  = NULL;
+    inode->open_cnt     = 0;
+    inode->unlinked     = FALSE;
+    inode->stage        = NULL;
+    inode->stage_off    = 0;
+    inode->stage_len    = 0;
+    // 新文件的数据先内嵌在inode中，长大后再按块映射；挂载时指定了 --extents 则按区段映射
+    inode->flags        = 0;
+    memset(inode->inline_data, 0, NEWFS_INLINE_DATA_MAX);
+    inode->pack_dno     = -1;
+    inode->pack_slot    = -1;
+    pthread_rwlock_init(&inode->lock, NULL);
+    if (NEWFS_IS_REG(inode)) {
+        inode->flags   |= NEWFS_INODE_INLINE_DATA;
+        if (newfs_options.extents) {
+            inode->flags |= NEWFS_INODE_EXTENTS;
+        }
+    }
+    newfs_mark_inode_dirty(inode);
+    return inode;
+}
+
+/**
+ * @brief 按块号找到共享块
+ * 
+ * @param dno 
+ * @return struct newfs_pack* 
+ */
+static struct newfs_pack* newfs_find_pack(int dno) {
+    for (int i = 0; i < newfs_super.pack_cnt; i++) {
+        if (newfs_super.packs[i].dno == dno) {
+            return &newfs_super.packs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 取得共享块的内容，第一次访问时读入
+ * 
+ * @param pack 
+ * @return uint8_t* 失败返回NULL
+ */
+static uint8_t* newfs_pack_buf(struct newfs_pack* pack) {
+    struct newfs_pack_hdr_d* hdr;
+    if (pack->buf != NULL) {
+        return pack->buf;
+    }
+    pack->buf = (uint8_t*)malloc(NEWFS_BLK_SZ());
+    hdr       = (struct newfs_pack_hdr_d*)pack->buf;
+    if (newfs_driver_read(NEWFS_DATA_OFS(pack->dno), pack->buf, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE ||
+        hdr->magic != NEWFS_PACK_MAGIC) {
+        NEWFS_DBG("[%s] bad pack block %d\n", __func__, pack->dno);
+        free(pack->buf);
+        pack->buf = NULL;
+    }
+    return pack->buf;
+}
+
+/**
+ * @brief 整理共享块：把有效数据紧凑地挪到块尾，删除文件留下的碎片合并成一整段空闲空间
+ * 
+ * @param pack 
+ */
+static void newfs_pack_compact(struct newfs_pack* pack) {
+    struct newfs_pack_hdr_d*  hdr   = (struct newfs_pack_hdr_d*)pack->buf;
+    struct newfs_pack_slot_d* slots = (struct newfs_pack_slot_d*)(hdr + 1);
+    uint8_t* tmp = (uint8_t*)malloc(NEWFS_BLK_SZ());
+    int ofs = NEWFS_BLK_SZ();
+
+    memcpy(tmp, pack->buf, NEWFS_BLK_SZ());
+    for (int i = 0; i < hdr->slot_cnt; i++) {
+        if (slots[i].len == 0) {
+            continue;
+        }
+        ofs -= slots[i].len;
+        memcpy(pack->buf + ofs, tmp + slots[i].ofs, slots[i].len);
+        slots[i].ofs = ofs;
+    }
+    hdr->data_ofs = ofs;
+    pack->dirty   = TRUE;
+    free(tmp);
+}
+
+/**
+ * @brief 把一个小文件的数据放进共享块：首个放得下的共享块，没有则新开一个；
+ *        空间够但不连续时先整理碎片
+ * 
+ * @param data 文件数据
+ * @param len 字节数，不超过 NEWFS_PACK_MAX_SZ()
+ * @param dno 输出共享块块号
+ * @param slot 输出槽号
+ * @return int 
+ */
+static int newfs_pack_store(const uint8_t* data, int len, int* dno, int* slot) {
+    struct newfs_pack*        pack = NULL;
+    struct newfs_pack_hdr_d*  hdr;
+    struct newfs_pack_slot_d* slots;
+    int need = len + sizeof(struct newfs_pack_slot_d);
+    int new_dno, idx;
+
+    for (int i = 0; i < newfs_super.pack_cnt; i++) {
+        if (newfs_super.packs[i].free >= need && newfs_pack_buf(&newfs_super.packs[i]) != NULL) {
+            pack = &newfs_super.packs[i];
+            break;
+        }
+    }
+    if (pack == NULL) {
+        if (newfs_super.pack_cnt == NEWFS_PACK_TBL_CAP()) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        new_dno = newfs_claim_data_blk(-1);
+        if (new_dno < 0) {
+            return new_dno;
+        }
+        pack        = &newfs_super.packs[newfs_super.pack_cnt++];
+        pack->dno   = new_dno;
+        pack->free  = NEWFS_BLK_SZ() - sizeof(struct newfs_pack_hdr_d);
+        pack->buf   = (uint8_t*)calloc(1, NEWFS_BLK_SZ());
+        hdr         = (struct newfs_pack_hdr_d*)pack->buf;
+        hdr->magic    = NEWFS_PACK_MAGIC;
+        hdr->data_ofs = NEWFS_BLK_SZ();
+    }
+    hdr   = (struct newfs_pack_hdr_d*)pack->buf;
+    slots = (struct newfs_pack_slot_d*)(hdr + 1);
+
+    // 优先复用空闲槽
+    for (idx = 0; idx < hdr->slot_cnt && slots[idx].len != 0; idx++);
+    if (idx < hdr->slot_cnt) {
+        need = len;
+    }
+    if (hdr->data_ofs - (int)sizeof(struct newfs_pack_hdr_d) - 
+        (hdr->slot_cnt + (idx == hdr->slot_cnt)) * (int)sizeof(struct newfs_pack_slot_d) < len) {
+        newfs_pack_compact(pack);
+    }
+    if (idx == hdr->slot_cnt) {
+        hdr->slot_cnt++;
+    }
+    hdr->data_ofs   -= len;
+    slots[idx].ofs   = hdr->data_ofs;
+    slots[idx].len   = len;
+    memcpy(pack->buf + hdr->data_ofs, data, len);
+    pack->free      -= need;
+    pack->dirty      = TRUE;
+    newfs_super.pack_dirty = TRUE;
+
+    *dno  = pack->dno;
+    *slot = idx;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 取得小文件在共享块中的数据
+ * 
+ * @param dno 共享块块号
+ * @param slot 槽号
+ * @param len 输出数据长度
+ * @return uint8_t* 失败返回NULL
+ */
+static uint8_t* newfs_pack_data(int dno, int slot, int* len) {
+    struct newfs_pack*        pack = newfs_find_pack(dno);
+    struct newfs_pack_hdr_d*  hdr;
+    struct newfs_pack_slot_d* slots;
+    if (pack == NULL || newfs_pack_buf(pack) == NULL) {
+        return NULL;
+    }
+    hdr   = (struct newfs_pack_hdr_d*)pack->buf;
+    slots = (struct newfs_pack_slot_d*)(hdr + 1);
+    if (slot >= hdr->slot_cnt) {
+        return NULL;
+    }
+    *len = slots[slot].len;
+    return pack->buf + slots[slot].ofs;
+}
+
+/**
+ * @brief 从共享块中删除一个小文件的数据，末尾的空闲槽一并收回，
+ *        共享块空了就归还给数据块位图
+ * 
+ * @param dno 共享块块号
+ * @param slot 槽号
+ */
+static void newfs_pack_release(int dno, int slot) {
+    struct newfs_pack*        pack = newfs_find_pack(dno);
+    struct newfs_pack_hdr_d*  hdr;
+    struct newfs_pack_slot_d* slots;
+    if (pack == NULL || newfs_pack_buf(pack) == NULL) {
+        return;
+    }
+    hdr   = (struct newfs_pack_hdr_d*)pack->buf;
+    slots = (struct newfs_pack_slot_d*)(hdr + 1);
+    if (slot >= hdr->slot_cnt || slots[slot].len == 0) {
+        return;
+    }
+    pack->free     += slots[slot].len;
+    slots[slot].len = 0;
+    slots[slot].ofs = 0;
+    while (hdr->slot_cnt > 0 && slots[hdr->slot_cnt - 1].len == 0) {
+        hdr->slot_cnt--;
+        pack->free += sizeof(struct newfs_pack_slot_d);
+    }
+    pack->dirty = TRUE;
+    newfs_super.pack_dirty = TRUE;
+
+    if (hdr->slot_cnt == 0) {
+        newfs_release_data_blk(pack->dno);
+        free(pack->buf);
+        *pack = newfs_super.packs[--newfs_super.pack_cnt];
+    }
+}
+
+/**
+ * @brief 写回有改动的共享块和共享块表，并释放共享块缓存
+ * 
+ * @return int 
+ */
+static int newfs_sync_packs() {
+    struct newfs_pack_tbl_hdr_d* hdr;
+    struct newfs_pack_ent_d*     ents;
+    struct newfs_pack*           pack;
+    uint8_t* buf;
+    int ret = NEWFS_ERROR_NONE;
+
+    for (int i = 0; i < newfs_super.pack_cnt; i++) {
+        pack = &newfs_super.packs[i];
+        if (pack->dirty && newfs_driver_write(NEWFS_DATA_OFS(pack->dno), pack->buf, 
+                                              NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+        free(pack->buf);
+        pack->buf   = NULL;
+        pack->dirty = FALSE;
+    }
+
+    if (newfs_super.pack_dirty) {
+        if (newfs_super.pack_cnt == 0 && newfs_super.pack_tbl != -1) {
+            newfs_release_data_blk(newfs_super.pack_tbl);
+            newfs_super.pack_tbl = -1;
+        }
+        else if (newfs_super.pack_cnt > 0) {
+            if (newfs_super.pack_tbl == -1) {
+                newfs_super.pack_tbl = newfs_claim_data_blk(-1);
+            }
+            if (newfs_super.pack_tbl < 0) {
+                newfs_super.pack_tbl = -1;
+                return -NEWFS_ERROR_NOSPACE;
+            }
+            buf  = (uint8_t*)calloc(1, NEWFS_BLK_SZ());
+            hdr  = (struct newfs_pack_tbl_hdr_d*)buf;
+            ents = (struct newfs_pack_ent_d*)(hdr + 1);
+            hdr->magic = NEWFS_PACK_TBL_MAGIC;
+            hdr->cnt   = newfs_super.pack_cnt;
+            for (int i = 0; i < newfs_super.pack_cnt; i++) {
+                ents[i].dno  = newfs_super.packs[i].dno;
+                ents[i].free = newfs_super.packs[i].free;
+            }
+            if (newfs_driver_write(NEWFS_DATA_OFS(newfs_super.pack_tbl), buf, 
+                                   NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+            }
+            free(buf);
+        }
+        newfs_super.pack_dirty = FALSE;
+    }
+    return ret;
+}
+
+/**
+ * @brief 挂载时读入共享块表
+ * 
+ * @return int 
+ */
+static int newfs_load_packs() {
+    struct newfs_pack_tbl_hdr_d* hdr;
+    struct newfs_pack_ent_d*     ents;
+    uint8_t* buf;
+
+    newfs_super.packs      = (struct newfs_pack*)calloc(NEWFS_PACK_TBL_CAP(), sizeof(struct newfs_pack));
+    newfs_super.pack_cnt   = 0;
+    newfs_super.pack_dirty = FALSE;
+    if (newfs_super.pack_tbl == -1) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    buf  = (uint8_t*)malloc(NEWFS_BLK_SZ());
+    hdr  = (struct newfs_pack_tbl_hdr_d*)buf;
+    ents = (struct newfs_pack_ent_d*)(hdr + 1);
+    if (newfs_driver_read(NEWFS_DATA_OFS(newfs_super.pack_tbl), buf, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE ||
+        hdr->magic != NEWFS_PACK_TBL_MAGIC || hdr->cnt > NEWFS_PACK_TBL_CAP()) {
+        free(buf);
+        return -NEWFS_ERROR_IO;
+    }
+    for (int i = 0; i < hdr->cnt; i++) {
+        newfs_super.packs[i].dno  = ents[i].dno;
+        newfs_super.packs[i].free = ents[i].free;
+    }
+    newfs_super.pack_cnt = hdr->cnt;
+    free(buf);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写回时把只占第0块的小文件搬进共享块，归还它自己的数据块
+ * 
+ * @param inode 
+ */
+static void newfs_pack_file(struct newfs_inode* inode) {
+    int dno, slot, ret;
+    if (NEWFS_IS_INLINE(inode) || NEWFS_IS_PACKED(inode) ||
+        inode->size <= NEWFS_INLINE_DATA_MAX || inode->size > NEWFS_PACK_MAX_SZ() ||
+        inode->data_cap == 0 || inode->data[0] == NULL || !NEWFS_DATA_IS_DIRTY(inode, 0) ||
+        newfs_bmap(inode, 1) != -1) {           /* 文件末尾之后还有预分配的块，保留原样 */
+        return;
+    }
+    pthread_mutex_lock(&newfs_super.pack_lock);
+    ret = newfs_pack_store(inode->data[0], inode->size, &dno, &slot);
+    pthread_mutex_unlock(&newfs_super.pack_lock);
+    if (ret != NEWFS_ERROR_NONE) {
+        return;                                 /* 放不下就照常单独占一块 */
+    }
+    newfs_unmap_data_blks(inode, 0);
+    inode->flags    |= NEWFS_INODE_PACKED;
+    inode->pack_dno  = dno;
+    inode->pack_slot = slot;
+}
+
+/**
+ * @brief 判断一块是否全为0：首字节为0且整块与错开一个字节的自身相同，
+ *        比较交给 libc 已经向量化的 memcmp，不依赖编译优化，遇到非0字节就提前结束
+ * 
+ * @param buf 块缓冲区
+ * @return boolean 
+ */
+static boolean newfs_is_zero_blk(const uint8_t* buf) {
+    return buf[0] == 0 && memcmp(buf, buf + 1, NEWFS_BLK_SZ() - 1) == 0;
+}
+
+/**
+ * @brief 写回前处理改过且全为0的块，读出的仍是0，也不必写盘：
+ *        预分配来的块重新标为未写，保留预分配的空间；其余的块解除映射，留作空洞
+ * 
+ * @param inode 文件inode
+ */
+static void newfs_zero_punch(struct newfs_inode* inode) {
+    NEWFS_REMAP mode;
+    for (int i = 0; i < inode->data_cap; i++) {
+        if (inode->data[i] == NULL || !NEWFS_DATA_IS_DIRTY(inode, i) || 
+            !newfs_is_zero_blk(inode->data[i]) || newfs_bmap(inode, i) == -1) {
+            continue;
+        }
+        mode = NEWFS_DATA_IS_PREALLOC(inode, i) ? NEWFS_REMAP_UNWRITTEN : NEWFS_REMAP_PUNCH;
+        if (newfs_remap_blk(inode, i, mode) == NEWFS_ERROR_NONE) {
+            free(inode->data[i]);
+            inode->data[i] = NULL;
+            inode->data_dirty[i / UINT8_BITS] &= ~(0x1 << (i % UINT8_BITS));
+        }
+    }
+}
+
+/**
+ * @brief 把 buf 写到磁盘偏移 offset：batch 为NULL时立即写，否则收集到批次里，
+ *        由 newfs_wb_submit 排序合并后下发
+ * 
+ * @param batch 写回批次，可以为NULL
+ * @param offset 磁盘偏移
+ * @param buf 
+ * @param size 
+ * @param owned 为TRUE时 buf 交给这里释放；为FALSE时调用者保证下发前 buf 一直有效
+ * @return int 
+ */
+static int newfs_wb_write(struct newfs_wb_batch* batch, int offset, uint8_t* buf, int size, 
+                          boolean owned) {
+    struct newfs_wb_req* req;
+    int ret;
+
+    if (batch == NULL) {
+        ret = newfs_driver_write(offset, buf, size);
+        if (owned) {
+            free(buf);
+        }
+        return ret;
+    }
+    if (batch->cnt == batch->cap) {
+        batch->cap  = batch->cap ? batch->cap * 2 : 64;
+        batch->reqs = (struct newfs_wb_req*)realloc(batch->reqs, 
+                                                    batch->cap * sizeof(struct newfs_wb_req));
+    }
+    req         = &batch->reqs[batch->cnt++];
+    req->offset = offset;
+    req->size   = size;
+    req->buf    = buf;
+    req->owned  = owned;
+    req->seq    = __atomic_fetch_add(&newfs_wb_seq, 1, __ATOMIC_RELAXED);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将 cnt 个块缓冲区写到从 dno 开始的连续数据块上，合并成一次传输；
+ *        收集到批次时逐块登记，下发时再合并
+ * 
+ * @param batch 写回批次，可以为NULL
+ * @param dno 起始数据块号
+ * @param bufs 块缓冲区
+ * @param cnt 块数
+ * @return int 
+ */
+static int newfs_write_run(struct newfs_wb_batch* batch, int dno, uint8_t** bufs, int cnt) {
+    uint8_t* run_buf;
+    int ret;
+    if (batch != NULL) {
+        for (int i = 0; i < cnt; i++) {
+            newfs_wb_write(batch, NEWFS_DATA_OFS(dno + i), bufs[i], NEWFS_BLK_SZ(), FALSE);
+        }
+        return NEWFS_ERROR_NONE;
+    }
+    if (cnt == 1) {
+        return newfs_driver_write(NEWFS_DATA_OFS(dno), bufs[0], NEWFS_BLK_SZ());
+    }
+    run_buf = (uint8_t*)malloc(NEWFS_BLKS_SZ(cnt));
+    for (int i = 0; i < cnt; i++) {
+        memcpy(run_buf + NEWFS_BLKS_SZ(i), bufs[i], NEWFS_BLK_SZ());
+    }
+    ret = newfs_driver_write(NEWFS_DATA_OFS(dno), run_buf, NEWFS_BLKS_SZ(cnt));
+    free(run_buf);
+    return ret;
+}
+
+/**
+ * @brief 把inode从脏链表上摘下，不在链表中则什么也不做
+ * 
+ * @param inode 
+ */
+static void newfs_unlist_dirty(struct newfs_inode* inode) {
+    pthread_mutex_lock(&newfs_super.dirty_lock);
+    if (inode->dirty_pprev == NULL) {
+        pthread_mutex_unlock(&newfs_super.dirty_lock);
+        return;
+    }
+    *inode->dirty_pprev = inode->dirty_next;
+    if (inode->dirty_next != NULL) {
+        inode->dirty_next->dirty_pprev = inode->dirty_pprev;
+    }
+    inode->dirty_next  = NULL;
+    inode->dirty_pprev = NULL;
+    pthread_mutex_unlock(&newfs_super.dirty_lock);
+}
+
+/**
+ * @brief 将内存inode及其下方结构全部刷回磁盘。inode、目录块和文件数据块经 batch 写出，
+ *        区段树块和间接块仍然立即写
+ * 
+ * @param inode 
+ * @param batch 写回批次，为NULL时立即写
+ * @param pack 为TRUE时把小文件搬进共享块。共享块和共享块表只在卸载时写回，
+ *             fsync 不能搬，否则返回时数据只在内存中的共享块里
+ * @return int 
+ */
+static int newfs_sync_inode_to(struct newfs_inode * inode, struct newfs_wb_batch* batch, 
+                               boolean pack) {
+    struct newfs_inode_d  inode_d;
+    struct newfs_dirent*   dirent;
+    struct newfs_dentry_d* dentry_d;
+    uint8_t* blk_bufs[NEWFS_DATA_PER_FILE];
+    int ino             = inode->ino;
+    int ret;
+    int stage_ret       = NEWFS_ERROR_NONE;
+    int dno;
+    int run;
+
+    // 先移出脏链表，写回失败也不会反复重试
+    newfs_unlist_dirty(inode);
+
+    // 暂存的写入先落到数据块上，全0的块改成空洞，只占一块的小文件再搬进共享块；
+    // 暂存的数据写不进去时照常写回其余内容，最后报告错误
+    if (NEWFS_IS_REG(inode)) {
+        stage_ret = newfs_inode_flush_stage(inode);
+        if (stage_ret != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] stage flush error\n", __func__);
+        }
+        else {
+            newfs_zero_punch(inode);
+            if (pack) {
+                newfs_pack_file(inode);
+            }
+        }
+    }
+
+    // 区段树块号要写进 inode_d，先把区段写好
+    if (NEWFS_USE_EXTENTS(inode) && newfs_sync_extents(inode) != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] extent sync error\n", __func__);
+        return -NEWFS_ERROR_IO;
+    }
+
+    // 将内存中的 inode 刷回 磁盘的 inode_d
+    memset(&inode_d, 0, sizeof(struct newfs_inode_d));
+    inode_d.ino         = ino;
+    inode_d.size        = inode->size;
+    inode_d.link        = 1;
+    inode_d.ftype       = inode->ftype;
+    inode_d.flags       = inode->flags;
+    inode_d.dir_cnt     = inode->dir_cnt;
+    inode_d.atime       = inode->atime;
+    inode_d.mtime       = inode->mtime;
+    inode_d.ctime       = inode->ctime;
+    if (NEWFS_IS_INLINE(inode)) {
+        memcpy(inode_d.inline_data, inode->inline_data, NEWFS_INLINE_DATA_MAX);
+    }
+    else if (NEWFS_IS_PACKED(inode)) {
+        inode_d.pack_dno    = inode->pack_dno;
+        inode_d.pack_slot   = inode->pack_slot;
+    }
+    else if (NEWFS_USE_EXTENTS(inode)) {
+        inode_d.ext_cnt     = inode->ext_cnt;
+        inode_d.ext_pointer = inode->ext_blk_cnt > 0 ? inode->ext_blks[0] : -1;
+        if (inode->ext_cnt <= NEWFS_INLINE_EXTS) {
+            memcpy(inode_d.ext, inode->exts, inode->ext_cnt * sizeof(struct newfs_extent));
+        }
+    }
+    else {
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            inode_d.block_pointer[i] = inode->block_pointer[i];
+        }
+        inode_d.ind_pointer  = inode->ind_pointer;
+        inode_d.dind_pointer = inode->dind_pointer;
+    }
+
+    /* 先写inode本身，收集到批次时 inode_d 要拷一份 */
+    if (batch != NULL) {
+        ret = newfs_wb_write(batch, NEWFS_INO_OFS(ino), 
+                             (uint8_t*)memcpy(malloc(NEWFS_INODE_SZ()), &inode_d, NEWFS_INODE_SZ()),
+                             NEWFS_INODE_SZ(), TRUE);
+    }
+    else {
+        ret = newfs_driver_write(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, NEWFS_INODE_SZ());
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] io error\n", __func__);
+        return -NEWFS_ERROR_IO;
+    }
+
+    /* 再写inode下方的数据 */
+    if (NEWFS_IS_DIR(inode)) { /* 如果当前inode是目录，那么数据是目录项；子项的inode有改动时各自在脏链表中 */
+        /* 有改动的目录块先在内存中整块拼好，每块只写一次 */
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            blk_bufs[i] = NULL;
+            if (inode->block_pointer[i] == -1 || !(inode->dir_dirty & (0x1 << i))) {
+                continue;
+            }
+            blk_bufs[i] = (uint8_t*)calloc(1, NEWFS_BLK_SZ());
+            if (inode->dir_hole[i] > 0) {       /* 块首的空闲记录 */
+                dentry_d = (struct newfs_dentry_d*)blk_bufs[i];
+                dentry_d->rec_len = inode->dir_hole[i];
+            }
+        }
+        for (int dir = 0; dir < inode->dir_cnt; dir++) {
+            dirent = &inode->dirents[dir];
+            if (blk_bufs[dirent->blk] != NULL) {
+                newfs_encode_dentry(inode, dir, blk_bufs[dirent->blk] + dirent->rec_ofs);
+            }
+        }
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (blk_bufs[i] == NULL) {
+                continue;
+            }
+            ret = newfs_wb_write(batch, NEWFS_DATA_OFS(inode->block_pointer[i]), blk_bufs[i], 
+                                 NEWFS_BLK_SZ(), TRUE);
+            if (ret != NEWFS_ERROR_NONE) {
+                NEWFS_DBG("[%s] io error\n", __func__);
+                return -NEWFS_ERROR_IO;                     
+            }
+        }
+        inode->dir_dirty = 0;
+    }
+    else if (NEWFS_IS_REG(inode)) { /* 如果当前inode是文件，那么数据是文件内容，直接写即可 */
+        /* 只写回改过的块，落在连续数据块上的相邻脏块合并成一次传输 */
+        for (int i = 0; i < inode->data_cap; i += run) {
+            run = 1;
+            if (inode->data[i] == NULL || !NEWFS_DATA_IS_DIRTY(inode, i)) continue;
+            dno = newfs_bmap(inode, i);
+            while (i + run < inode->data_cap && run < NEWFS_IO_RUN_BLKS && 
+                   inode->data[i + run] != NULL && NEWFS_DATA_IS_DIRTY(inode, i + run) && 
+                   dno != -1 && newfs_bmap(inode, i + run) == dno + run) {
+                run++;
+            }
+            if (dno != -1 && newfs_write_run(batch, dno, &inode->data[i], run) != NEWFS_ERROR_NONE) {
+                NEWFS_DBG("[%s] io error\n", __func__);
+                return -NEWFS_ERROR_IO;
+            }
+        }
+        if (inode->data_dirty != NULL) {
+            memset(inode->data_dirty, 0, NEWFS_ROUND_UP(inode->data_cap, UINT8_BITS) / UINT8_BITS);
+        }
+
+        /* 再写回有改动的间接块 */
+        if (newfs_flush_ptr_blk(inode->ind, inode->ind_pointer) != NEWFS_ERROR_NONE ||
+            newfs_flush_ptr_blk(inode->dind, inode->dind_pointer) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    return stage_ret;
+}
+
+/**
+ * @brief 把一个位图写回磁盘：别的线程会同时原子地占用、归还其中的位，
+ *        先逐字节原子地拷出一份快照再写
+ * 
+ * @param map 内存中的位图
+ * @param offset 位图在磁盘上的偏移
+ * @param blks 位图占用的块数
+ * @return int 
+ */
+static int newfs_sync_map(uint8_t* map, int offset, int blks) {
+    uint8_t* snap = (uint8_t*)malloc(NEWFS_BLKS_SZ(blks));
+    int ret;
+
+    if (snap == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    for (int i = 0; i < NEWFS_BLKS_SZ(blks); i++) {
+        snap[i] = __atomic_load_n(&map[i], __ATOMIC_RELAXED);
+    }
+    ret = newfs_driver_write(offset, snap, NEWFS_BLKS_SZ(blks));
+    free(snap);
+    return ret;
+}
+
+/**
+ * @brief 将内存inode及其下方结构全部刷回磁盘（fsync）。小文件留在自己的数据块上，
+ *        卸载时再搬进共享块；暂存的数据没能写进文件时inode重新挂回脏链表，卸载时再试一次。
+ *        inode号和数据块的占用也要落盘，否则崩溃后重新挂载时它们会被当成空闲的再分出去，
+ *        所以最后把两个位图一并写回
+ * 
+ * @param inode 
+ * @return int 
+ */
+int newfs_sync_inode(struct newfs_inode * inode) {
+    int ret = newfs_sync_inode_to(inode, NULL, FALSE);
+    if (inode->stage_len > 0) {
+        newfs_mark_inode_dirty(inode);
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    if (newfs_sync_map(newfs_super.map_inode, newfs_super.map_inode_offset, 
+                       newfs_super.map_inode_blks) != NEWFS_ERROR_NONE ||
+        newfs_sync_map(newfs_super.map_data, newfs_super.map_data_offset, 
+                       newfs_super.map_data_blks) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把inode挂到脏链表上，已在链表中则什么也不做
+ * 
+ * @param inode 
+ */
+void newfs_mark_inode_dirty(struct newfs_inode * inode) {
+    pthread_mutex_lock(&newfs_super.dirty_lock);
+    if (inode->dirty_pprev != NULL || inode->unlinked) {   /* 已删除的inode不再写回 */
+        pthread_mutex_unlock(&newfs_super.dirty_lock);
+        return;
+    }
+    inode->dirty_next = newfs_super.dirty_inodes;
+    if (inode->dirty_next != NULL) {
+        inode->dirty_next->dirty_pprev = &inode->dirty_next;
+    }
+    newfs_super.dirty_inodes = inode;
+    inode->dirty_pprev       = &newfs_super.dirty_inodes;
+    pthread_mutex_unlock(&newfs_super.dirty_lock);
+}
+
+/**
+ * @brief 把inode的指定时间改为当前时间，并挂到脏链表上
+ * 
+ * @param inode 
+ * @param which NEWFS_T_ATIME、NEWFS_T_MTIME、NEWFS_T_CTIME 的组合
+ */
+void newfs_touch_inode(struct newfs_inode * inode, int which) {
+    uint32_t now = (uint32_t)time(NULL);
+    if (which & NEWFS_T_ATIME) {
+        inode->atime = now;
+    }
+    if (which & NEWFS_T_MTIME) {
+        inode->mtime = now;
+    }
+    if (which & NEWFS_T_CTIME) {
+        inode->ctime = now;
+    }
+    newfs_mark_inode_dirty(inode);
+}
+
+/**
+ * @brief 设置访问和修改时间（utimens），支持 UTIME_NOW 和 UTIME_OMIT，ctime 改为当前时间
+ * 
+ * @param inode 
+ * @param tv tv[0] 为 atime，tv[1] 为 mtime；为NULL时两者都取当前时间
+ */
+void newfs_set_times(struct newfs_inode * inode, const struct timespec tv[2]) {
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t* times[2] = { &inode->atime, &inode->mtime };
+    for (int i = 0; i < 2; i++) {
+        if (tv == NULL || tv[i].tv_nsec == UTIME_NOW) {
+            *times[i] = now;
+        }
+        else if (tv[i].tv_nsec != UTIME_OMIT) {
+            *times[i] = (uint32_t)tv[i].tv_sec;
+        }
+    }
+    inode->ctime = now;
+    newfs_mark_inode_dirty(inode);
+}
+
+/**
+ * @brief 从脏链表头摘下一个inode
+ * 
+ * @return struct newfs_inode* 链表为空时返回NULL
+ */
+static struct newfs_inode* newfs_pop_dirty() {
+    struct newfs_inode* inode;
+    pthread_mutex_lock(&newfs_super.dirty_lock);
+    inode = newfs_super.dirty_inodes;
+    if (inode != NULL) {
+        newfs_super.dirty_inodes = inode->dirty_next;
+        if (inode->dirty_next != NULL) {
+            inode->dirty_next->dirty_pprev = &newfs_super.dirty_inodes;
+        }
+        inode->dirty_next  = NULL;
+        inode->dirty_pprev = NULL;
+    }
+    pthread_mutex_unlock(&newfs_super.dirty_lock);
+    return inode;
+}
+
+/**
+ * 并行写回的一个任务：从脏链表上取inode编码写回内容，写先收集在自己的批次里
+ */
+struct newfs_flush_worker {
+    struct newfs_wb_batch batch;
+    int                   ret;
+};
+
+static void newfs_flush_task(void* arg) {
+    struct newfs_flush_worker* worker = (struct newfs_flush_worker*)arg;
+    struct newfs_inode*        inode;
+    int                        err;
+
+    while ((inode = newfs_pop_dirty()) != NULL) {
+        /* 写回过程中inode可能又被挂回脏链表，别的线程取到时在锁上等这次写完 */
+        NEWFS_WRLOCK(inode);
+        if ((err = newfs_sync_inode_to(inode, &worker->batch, TRUE)) != NEWFS_ERROR_NONE) {
+            worker->ret = err;
+        }
+        NEWFS_UNLOCK(inode);
+    }
+}
+
+static int newfs_wb_req_cmp(const void* a, const void* b) {
+    const struct newfs_wb_req* ra = (const struct newfs_wb_req*)a;
+    const struct newfs_wb_req* rb = (const struct newfs_wb_req*)b;
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+/**
+ * @brief 下发各线程收集的写：按磁盘偏移排序，相邻或重叠的合并成一次传输，
+ *        重叠部分以后收集的为准
+ * 
+ * @param batches 
+ * @param n 批次数
+ * @return int 
+ */
+static int newfs_wb_submit(struct newfs_wb_batch* batches, int n) {
+    struct newfs_wb_req* reqs;
+    struct newfs_wb_req* req;
+    uint8_t* run_buf = (uint8_t*)malloc(NEWFS_BLKS_SZ(NEWFS_IO_RUN_BLKS));
+    int total = 0;
+    int start, end;
+    int ret = NEWFS_ERROR_NONE;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        total += batches[i].cnt;
+    }
+    reqs = (struct newfs_wb_req*)malloc((total + 1) * sizeof(struct newfs_wb_req));
+    for (i = 0, total = 0; i < n; i++) {
+        memcpy(reqs + total, batches[i].reqs, batches[i].cnt * sizeof(struct newfs_wb_req));
+        total += batches[i].cnt;
+    }
+    qsort(reqs, total, sizeof(struct newfs_wb_req), newfs_wb_req_cmp);
+
+    for (i = 0; i < total; i = j) {
+        start = reqs[i].offset;
+        end   = start + reqs[i].size;
+        for (j = i + 1; j < total; j++) {
+            req = &reqs[j];
+            if (req->offset > end || 
+                NEWFS_MAX(end, req->offset + req->size) - start > NEWFS_BLKS_SZ(NEWFS_IO_RUN_BLKS)) {
+                break;
+            }
+            end = NEWFS_MAX(end, req->offset + req->size);
+        }
+        if (j == i + 1) {
+            if (newfs_driver_write(start, reqs[i].buf, reqs[i].size) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+            }
+            continue;
+        }
+        for (int k = i; k < j; k++) {
+            memcpy(run_buf + reqs[k].offset - start, reqs[k].buf, reqs[k].size);
+        }
+        if (newfs_driver_write(start, run_buf, end - start) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+
+    for (i = 0; i < total; i++) {
+        if (reqs[i].owned) {
+            free(reqs[i].buf);
+        }
+    }
+    free(reqs);
+    free(run_buf);
+    return ret;
+}
+
+/**
+ * @brief 写回脏链表上的所有inode，没有改动过的inode和目录不会被重新写。
+ *        脏inode较多时拆成 NEWFS_FLUSH_WORKERS 个前台任务交给线程池并行编码，
+ *        写入收集起来按磁盘偏移排序合并后由当前线程统一下发
+ * 
+ * @return int 
+ */
+int newfs_sync_dirty_inodes() {
+    struct newfs_flush_worker workers[NEWFS_FLUSH_WORKERS];
+    struct newfs_wb_batch     batches[NEWFS_FLUSH_WORKERS];
+    struct newfs_inode*       inode;
+    int cnt = 0;
+    int pending;
+    int err;
+    int ret = NEWFS_ERROR_NONE;
+
+    pthread_mutex_lock(&newfs_super.dirty_lock);
+    for (inode = newfs_super.dirty_inodes; inode != NULL && cnt < NEWFS_FLUSH_MIN_INODES; 
+         inode = inode->dirty_next) {
+        cnt++;
+    }
+    pthread_mutex_unlock(&newfs_super.dirty_lock);
+
+    if (cnt < NEWFS_FLUSH_MIN_INODES) {
+        while ((inode = newfs_pop_dirty()) != NULL) {
+            NEWFS_WRLOCK(inode);
+            if ((err = newfs_sync_inode_to(inode, NULL, TRUE)) != NEWFS_ERROR_NONE) {
+                ret = err;
+            }
+            NEWFS_UNLOCK(inode);
+        }
+        return ret;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    pending = NEWFS_FLUSH_WORKERS;
+    for (int i = 0; i < NEWFS_FLUSH_WORKERS; i++) {
+        newfs_pool_submit(newfs_flush_task, &workers[i], NEWFS_TASK_FG, &pending);
+    }
+    newfs_pool_wait(&pending);
+    for (int i = 0; i < NEWFS_FLUSH_WORKERS; i++) {
+        if (workers[i].ret != NEWFS_ERROR_NONE) {
+            ret = workers[i].ret;
+        }
+        batches[i] = workers[i].batch;
+    }
+    if (newfs_wb_submit(batches, NEWFS_FLUSH_WORKERS) != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    for (int i = 0; i < NEWFS_FLUSH_WORKERS; i++) {
+        free(batches[i].reqs);
+    }
+    return ret;
+}
+
+/**
+ * @brief 释放inode及其下方已读入内存的子项、数据块缓存，不写回任何内容
+ * 
+ * @param inode 
+ */
+void newfs_free_inode(struct newfs_inode * inode) {
+    struct newfs_dirent* dirent;
+
+    if (NEWFS_IS_DIR(inode)) {
+        for (int dir = 0; dir < inode->dir_cnt; dir++) {
+            dirent = &inode->dirents[dir];
+            if (dirent->dentry != NULL) {
+                if (dirent->dentry->inode != NULL) {
+                    newfs_free_inode(dirent->dentry->inode);
+                }
+                free(dirent->dentry);
+            }
+        }
+        free(inode->dirents);
+        free(inode->names);
+    }
+    else if (NEWFS_IS_REG(inode)) {
+        for (int i = 0; i < inode->data_cap; i++) {
+            free(inode->data[i]);
+        }
+        free(inode->data);
+        free(inode->data_dirty);
+        free(inode->data_prealloc);
+        free(inode->stage);
+        free(inode->exts);
+        free(inode->ext_blks);
+        newfs_put_ptr_blk(inode->ind, inode->ind_pointer, FALSE);
+        newfs_put_ptr_blk(inode->dind, inode->dind_pointer, FALSE);
+    }
+    pthread_rwlock_destroy(&inode->lock);
+    free(inode);
+}
+
+/**
+ * @brief 读取指定编号的索引节点信息
+ * 
+ * @param dentry dentry指向ino，读取该inode
+ * @param ino inode唯一编号
+ * @return struct newfs_inode* 读盘失败返回NULL
+ */
+struct newfs_inode* newfs_read_inode(struct newfs_dentry * dentry, int ino) {
+    struct newfs_inode* inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
+    struct newfs_inode_d inode_d;
+    struct newfs_dentry_d* dentry_d;
+    struct newfs_dirent* dirent;
+    uint8_t* blk_buf;
+    int offset;
+    int dir;
+    boolean is_ptrs;
+    
+    if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
+                        NEWFS_INODE_SZ()) != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] io error\n", __func__);
+        free(inode);
+        return NULL;                    
+    }
+    inode->dir_cnt = 0;
+    inode->ino = inode_d.ino;
+    inode->size = inode_d.size;
+    inode->dentry = dentry;
+    inode->ftype  = dentry->ftype;
+    inode->atime  = inode_d.atime;
+    inode->mtime  = inode_d.mtime;
+    inode->ctime  = inode_d.ctime;
+    inode->dirents = NULL;
+    inode->dirents_cap = 0;
+    inode->names = NULL;
+    inode->names_len = 0;
+    inode->names_cap = 0;
+    inode->names_garbage = 0;
+    inode->seq = 0;
+    inode->seq_nest = 0;
+    inode->dir_dirty = 0;
+
+    // 区段映射、内嵌数据或共享块的inode中，块号表的位置存放的是区段、数据或共享块地址
+    inode->flags = inode_d.flags;
+    is_ptrs = !NEWFS_USE_EXTENTS(inode) && !NEWFS_IS_INLINE(inode) && !NEWFS_IS_PACKED(inode);
+    inode->pack_dno = NEWFS_IS_PACKED(inode) ? inode_d.pack_dno : -1;
+    inode->pack_slot = NEWFS_IS_PACKED(inode) ? inode_d.pack_slot : -1;
+    for(int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        inode->block_pointer[i] = is_ptrs ? inode_d.block_pointer[i] : -1;
+        inode->dir_hole[i] = 0;
+    }
+    inode->ind_pointer = is_ptrs ? inode_d.ind_pointer : -1;
+    inode->dind_pointer = is_ptrs ? inode_d.dind_pointer : -1;
+    memset(inode->inline_data, 0, NEWFS_INLINE_DATA_MAX);
+    inode->ind = NULL;
+    inode->dind = NULL;
+    inode->exts = NULL;
+    inode->ext_cnt = 0;
+    inode->ext_cap = 0;
+    inode->ext_blks = NULL;
+    inode->ext_blk_cnt = 0;
+    inode->ext_dirty = FALSE;
+    inode->data = NULL;
+    inode->data_cap = 0;
+    inode->data_dirty = NULL;
+    inode->data_prealloc = NULL;
+    inode->dirty_next = NULL;
+    inode->dirty_pprev = NULL;
+    inode->open_cnt = 0;
+    inode->unlinked = FALSE;
+    inode->stage = NULL;
+    inode->stage_off = 0;
+    inode->stage_len = 0;
+    pthread_rwlock_init(&inode->lock, NULL);
+
+    /* 内存中的inode的数据或子目录项部分也需要读出 */
+    if (NEWFS_IS_DIR(inode)) {
+        // 子项数目已知，一次分配好子项数组
+        if (inode_d.dir_cnt > 0) {
+            inode->dirents_cap = inode_d.dir_cnt;
+            inode->dirents     = (struct newfs_dirent*)malloc(inode->dirents_cap * 
+                                                               sizeof(struct newfs_dirent));
+        }
+
+        // 每个目录块整块读入一次，再按 rec_len 逐条解码
+        blk_buf = (uint8_t*)malloc(NEWFS_BLK_SZ());
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (inode->block_pointer[i] == -1) {
+                continue;
+            }
+            if (newfs_driver_read(NEWFS_DATA_OFS(inode->block_pointer[i]), blk_buf, 
+                NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+                NEWFS_DBG("[%s] io error\n", __func__);
+                free(blk_buf);
+                newfs_free_inode(inode);
+                return NULL;
+            }
+            offset = 0;
+            while (offset + (int)sizeof(struct newfs_dentry_d) <= NEWFS_BLK_SZ()) {
+                dentry_d = (struct newfs_dentry_d*)(blk_buf + offset);
+                if (dentry_d->rec_len < sizeof(struct newfs_dentry_d) ||
+                    offset + dentry_d->rec_len > NEWFS_BLK_SZ() ||
+                    sizeof(struct newfs_dentry_d) + dentry_d->name_len > dentry_d->rec_len) {
+                    NEWFS_DBG("[%s] bad dentry record\n", __func__);   /* 记录损坏，放弃本块剩余部分 */
+                    break;
+                }
+                if (dentry_d->name_len == 0) {
+                    inode->dir_hole[i] = dentry_d->rec_len;
+                }
+                else {
+                    // 只登记子项记录，dentry 等到访问时再创建
+                    dir    = newfs_append_dirent(inode, dentry_d->fname, dentry_d->name_len,
+                                                 dentry_d->ino, dentry_d->ftype);
+                    dirent = &inode->dirents[dir];
+                    dirent->blk     = i;
+                    dirent->rec_ofs = offset;
+                    dirent->rec_len = dentry_d->rec_len;
+                }
+                offset += dentry_d->rec_len;
+            }
+        }
+        free(blk_buf);
+    }
+    else if (NEWFS_IS_REG(inode) && NEWFS_IS_INLINE(inode)) {
+        /* 小文件的数据随inode一起读入，不需要再访问数据块 */
+        memcpy(inode->inline_data, inode_d.inline_data, NEWFS_INLINE_DATA_MAX);
+    }
+    else if (NEWFS_IS_REG(inode) && NEWFS_USE_EXTENTS(inode) && !NEWFS_IS_PACKED(inode)) {
+        /* 区段数目很少，一次全部读入；文件内容不预先读入，读写时按块映射访问 */
+        if (newfs_load_extents(inode, &inode_d) != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] extent load error\n", __func__);
+            newfs_free_inode(inode);
+            return NULL;
+        }
+    }
+    return inode;
+}
+
+/**
+ * @brief 获得第 dir 个 dentry，尚未创建时按子项记录创建；
+ *        调用者持有目录的写锁，只持有读锁时用 newfs_child_dentry
+ * 
+ * @param inode 
+ * @param dir [0...]
+ * @return struct newfs_dentry* 
+ */
+struct newfs_dentry* newfs_get_dentry(struct newfs_inode * inode, int dir) {
+    struct newfs_dirent* dirent;
+    struct newfs_dentry* dentry;
+    if (dir < 0 || dir >= inode->dir_cnt) {
+        return NULL;
+    }
+    dirent = &inode->dirents[dir];
+    if (dirent->dentry == NULL) {
+        dentry         = new_dentry(NEWFS_DIRENT_NAME(inode, dir), dirent->ftype);
+        dentry->parent = inode->dentry;
+        dentry->ino    = dirent->ino;
+        dentry->slot   = dir;
+        __atomic_store_n(&dirent->dentry, dentry, __ATOMIC_RELEASE);
+    }
+    return dirent->dentry;
+}
+
+/**
+ * @brief 取得目录第 dir 个子项的dentry并保证其inode已读入。
+ *        同一目录的多个读者可能同时走到这里：dentry 在 cache_lock 下创建，
+ *        inode 在锁外读盘，再用CAS挂上去，读盘时不会挡住其他目录的查找；
+ *        同时读同一个子项的线程中只有一个能挂上，其余的丢掉自己读出的副本
+ * 
+ * @param inode 目录inode，调用者至少持有读锁
+ * @param dir 
+ * @return struct newfs_dentry* 子项的inode读不出来时返回NULL
+ */
+static struct newfs_dentry* newfs_child_dentry(struct newfs_inode* inode, int dir) {
+    struct newfs_dentry* dentry = __atomic_load_n(&inode->dirents[dir].dentry, __ATOMIC_ACQUIRE);
+    struct newfs_inode*  child;
+    struct newfs_inode*  expected = NULL;
+    if (dentry != NULL && __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE) != NULL) {
+        return dentry;
+    }
+    pthread_mutex_lock(&newfs_super.cache_lock);
+    dentry = newfs_get_dentry(inode, dir);
+    pthread_mutex_unlock(&newfs_super.cache_lock);
+    if (__atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE) != NULL) {
+        return dentry;
+    }
+
+    child = newfs_read_inode(dentry, dentry->ino);
+    if (child == NULL) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&dentry->inode, &expected, child, FALSE,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        newfs_free_inode(child);                    /* 别的线程先挂上了，还没有人见过这个副本 */
+    }
+    return dentry;
+}
+
+/**
+ * @brief 按 lock 给 inode 加读锁或写锁，lock 为0时不加锁
+ */
+static void newfs_lock_inode(struct newfs_inode* inode, boolean wr, int lock) {
+    if (lock == 0) {
+        return;
+    }
+    if (wr) {
+        NEWFS_WRLOCK(inode);
+    }
+    else {
+        NEWFS_RDLOCK(inode);
+    }
+}
+
+/**
+ * @brief newfs_lookup 的无锁快速路径：途经的目录既不加锁也不改动任何共享数据，
+ *        读完一级子项后用目录的 seq 校验，期间有修改就放弃。只处理找到目标的情况，
+ *        目标按 lock 加锁后再校验一次父目录，保证加锁时它仍挂在这个位置
+ * 
+ * @param path 
+ * @param target_wr 目标加写锁还是读锁
+ * @return struct newfs_dentry* 失败（找不到、碰上修改、子项还没读入内存）返回NULL，
+ *         由调用者改走加锁的查找
+ */
+static struct newfs_dentry* newfs_lookup_rcu(const char* path, boolean target_wr) {
+    struct newfs_inode*    inode = newfs_super.root_dentry->inode;
+    struct newfs_inode*    child;
+    struct newfs_dentry*   dentry_child;
+    struct newfs_dirent*   dirent;
+    struct newfs_path_iter iter;
+    const char* fname;
+    int      fname_len;
+    uint32_t seq;
+
+    newfs_path_iter_init(&iter, path);
+    fname_len = newfs_path_next(&iter, &fname);
+    newfs_rcu_read_lock();
+    while (fname_len > 0) {
+        seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || !NEWFS_IS_DIR(inode)) {
+            break;
+        }
+        dirent = newfs_find_dirent_rcu(inode, fname, fname_len);
+        if (dirent == NULL) {
+            break;
+        }
+        dentry_child = __atomic_load_n(&dirent->dentry, __ATOMIC_ACQUIRE);
+        if (dentry_child == NULL) {
+            break;
+        }
+        child = __atomic_load_n(&dentry_child->inode, __ATOMIC_ACQUIRE);
+        if (child == NULL) {
+            break;
+        }
+
+        fname_len = newfs_path_next(&iter, &fname);
+        if (fname_len == 0) {
+            newfs_lock_inode(child, target_wr, NEWFS_LOCK_RD);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&inode->seq, __ATOMIC_RELAXED) != seq) {
+            if (fname_len == 0) {
+                NEWFS_UNLOCK(child);
+            }
+            break;
+        }
+        if (fname_len == 0) {
+            newfs_rcu_read_unlock();
+            return dentry_child;
+        }
+        inode = child;
+    }
+    newfs_rcu_read_unlock();
+    return NULL;
+}
+
+/**
+ * @brief 查找文件或目录
+ * path: /qwe/ad  total_lvl = 2,
+ *      1) find /'s inode       lvl = 1
+ *      2) find qwe's dentry 
+ *      3) find qwe's inode     lvl = 2
+ *      4) find ad's dentry
+ *
+ * path: /qwe     total_lvl = 1,
+ *      1) find /'s inode       lvl = 1
+ *      2) find qwe's dentry
+ *  
+ * 
+ * 如果能查找到，返回该目录项
+ * 如果只有最后一级找不到，返回的是它的父目录，is_find=FALSE
+ * 如果中间某一级找不到或不是目录，返回NULL，is_find=FALSE
+ * 如果某一级的inode读盘失败，返回NULL，is_find=TRUE；调用者用 NEWFS_LOOKUP_ERR 区分
+ * 
+ * path: /a/b/c
+ *      1) find /'s inode     lvl = 1
+ *      2) find a's dentry 
+ *      3) find a's inode     lvl = 2
+ *      4) find b's dentry    如果此时找不到了，返回NULL
+ * 
+ * 加锁：逐级先锁子项再放开父目录（hand-over-hand），途经的目录只加读锁。
+ * 找到时目标按 NEWFS_LOCK_RD/NEWFS_LOCK_WR 加锁，带 NEWFS_LOCK_PARENT 时父目录另加写锁；
+ * 只有最后一级找不到时，返回的父目录带 NEWFS_LOCK_PARENT 时加写锁，否则加读锁。
+ * lock 为0时不加任何锁，只在挂载、卸载等单线程的场合使用。用 newfs_lookup_unlock 解锁
+ * 
+ * 不要求锁父目录时先走无锁的 newfs_lookup_rcu，途经的目录不碰锁，多个线程同时查找
+ * 不会在上层目录的锁上互相争抢；它失败时再按上面的方式加锁查找
+ * 
+ * @param path 
+ * @param is_find 
+ * @param is_root 
+ * @param lock NEWFS_LOCK_* 的组合
+ * @return struct newfs_dentry* 
+ */
+struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean* is_root, int lock) {
+    struct newfs_dentry*   dentry_cursor = newfs_super.root_dentry;
+    struct newfs_dentry*   dentry_child;
+    struct newfs_inode*    inode;
+    struct newfs_path_iter iter, peek;
+    const char* fname;
+    const char* next;
+    int   fname_len;
+    int   dir;
+    boolean is_last;
+    boolean parent_wr = (lock & NEWFS_LOCK_PARENT) != 0;
+    boolean target_wr = (lock & NEWFS_LOCK_WR) != 0;
+    *is_find = FALSE;
+    *is_root = FALSE;
+
+    if (lock != 0 && !parent_wr) {
+        dentry_child = newfs_lookup_rcu(path, target_wr);
+        if (dentry_child != NULL) {
+            *is_find = TRUE;
+            return dentry_child;
+        }
+    }
+
+    // 最外层文件夹名称
+    newfs_path_iter_init(&iter, path);
+    fname_len = newfs_path_next(&iter, &fname);
+    if (fname_len == 0) {                           /* 根目录 */
+        *is_find = TRUE;
+        *is_root = TRUE;
+        newfs_lock_inode(dentry_cursor->inode, target_wr, lock);
+        return dentry_cursor;
+    }
+
+    // 先看一眼后面还有没有下一级，最后一级的父目录按需要加写锁
+    peek = iter;
+    is_last = newfs_path_next(&peek, &next) == 0;
+    newfs_lock_inode(dentry_cursor->inode, is_last && parent_wr, lock);
+
+    while (TRUE)
+    {
+        // 当前 dentry 对应的 inode
+        inode = dentry_cursor->inode;
+
+        // 若出现文件类型但路径未结束
+        if (NEWFS_IS_REG(inode)) {
+            NEWFS_DBG("[%s] not a dir\n", __func__);
+            break;
+        }
+
+        // 若为文件夹类型，扫描子项数组
+        dir = newfs_find_dirent(inode, fname, fname_len);
+
+        // 未找到该文件 or 文件夹
+        // mkdir mknod
+        if (dir < 0) {
+            NEWFS_DBG("[%s] not found %.*s\n", __func__, fname_len, fname);
+            if (is_last) {
+                return dentry_cursor;
+            }
+            break;
+        }
+
+        // 找到最后一级，即为目标文件
+        dentry_child = newfs_child_dentry(inode, dir);
+        if (dentry_child == NULL) {                 /* 子项的inode读不出来，放开这一级后返回 */
+            *is_find = TRUE;
+            break;
+        }
+        if (is_last) {
+            newfs_lock_inode(dentry_child->inode, target_wr, lock);
+            if (!parent_wr && lock != 0) {
+                NEWFS_UNLOCK(inode);
+            }
+            *is_find = TRUE;
+            return dentry_child;
+        }
+
+        // 锁住下一级之后再放开这一级
+        fname_len = newfs_path_next(&iter, &fname);
+        peek = iter;
+        is_last = newfs_path_next(&peek, &next) == 0;
+        newfs_lock_inode(dentry_child->inode, is_last && parent_wr, lock);
+        if (lock != 0) {
+            NEWFS_UNLOCK(inode);
+        }
+        dentry_cursor = dentry_child;
+    }
+
+    if (lock != 0) {
+        NEWFS_UNLOCK(dentry_cursor->inode);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 放开 newfs_lookup 加的锁
+ * 
+ * @param dentry newfs_lookup 的返回值，可以为NULL
+ * @param is_find 
+ * @param lock 传给 newfs_lookup 的 lock
+ */
+void newfs_lookup_unlock(struct newfs_dentry* dentry, boolean is_find, int lock) {
+    if (dentry == NULL || lock == 0) {
+        return;
+    }
+    if (is_find && (lock & NEWFS_LOCK_PARENT) && dentry->parent != NULL) {
+        NEWFS_UNLOCK(dentry->parent->inode);
+    }
+    NEWFS_UNLOCK(dentry->inode);
+}
+
+/**
+ * @brief 初始化超级块
+ */ 
+static void init_newfs_super_d(struct newfs_super_d* newfs_super_d) {
+    newfs_super_d->sz_usage = 0;
     newfs_super_d->super_blks = SUPER_BLKS;
     newfs_super_d->super_blk_offset = NEWFS_SUPER_OFS;
     
@@ -502,325 +2850,1368 @@ static void init_newfs_super_d(struct newfs_super_d* newfs_super_d) {
     // 计算最大值
     newfs_super_d->max_ino = MAX_INODE_PER_BLK * newfs_super_d->ino_blks;
     newfs_super_d->max_data = newfs_super_d->data_blks;
+    newfs_super_d->pack_tbl = -1;
+}
+
+/**
+ * @brief 从磁盘超级块同步到内存超级块
+ */
+static void sync_super_to_memory(struct newfs_super_d* newfs_super_d) {
+    newfs_super.sz_usage = newfs_super_d->sz_usage;
+    newfs_super.super_blks = newfs_super_d->super_blks;
+    newfs_super.super_blk_offset = newfs_super_d->super_blk_offset;
+    newfs_super.map_inode_blks = newfs_super_d->map_inode_blks;
+    newfs_super.map_inode_offset = newfs_super_d->map_inode_offset;
+    newfs_super.map_data_blks = newfs_super_d->map_data_blks;
+    newfs_super.map_data_offset = newfs_super_d->map_data_offset;
+    newfs_super.ino_blks = newfs_super_d->ino_blks;
+    newfs_super.ino_offset = newfs_super_d->ino_offset;
+    newfs_super.data_blks = newfs_super_d->data_blks;
+    newfs_super.data_offset = newfs_super_d->data_offset;
+    newfs_super.max_ino = newfs_super_d->max_ino;
+    newfs_super.max_data = newfs_super_d->max_data;
+    newfs_super.pack_tbl = newfs_super_d->pack_tbl;
+}
+
+/**
+ * @brief 从内存超级块同步到磁盘超级块
+ */
+static void sync_super_to_disk(struct newfs_super_d* newfs_super_d) {
+    newfs_super_d->magic_num = NEWFS_MAGIC_NUM;
+    newfs_super_d->sz_usage = newfs_super.sz_usage;
+    newfs_super_d->super_blks = newfs_super.super_blks;
+    newfs_super_d->super_blk_offset = newfs_super.super_blk_offset;
+    newfs_super_d->map_inode_blks = newfs_super.map_inode_blks;
+    newfs_super_d->map_inode_offset = newfs_super.map_inode_offset;
+    newfs_super_d->map_data_blks = newfs_super.map_data_blks;
+    newfs_super_d->map_data_offset = newfs_super.map_data_offset;
+    newfs_super_d->ino_blks = newfs_super.ino_blks;
+    newfs_super_d->ino_offset = newfs_super.ino_offset;
+    newfs_super_d->data_blks = newfs_super.data_blks;
+    newfs_super_d->data_offset = newfs_super.data_offset;
+    newfs_super_d->max_ino = newfs_super.max_ino;
+    newfs_super_d->max_data = newfs_super.max_data;
+    newfs_super_d->pack_tbl = newfs_super.pack_tbl;
+}
+
+/**
+ * @brief 写回位图
+ */
+static int sync_maps_to_disk(struct newfs_super_d* newfs_super_d) {
+    // 写回索引节点位图
+    if (newfs_driver_write(newfs_super_d->map_inode_offset, 
+                          (uint8_t *)(newfs_super.map_inode), 
+                          NEWFS_BLKS_SZ(newfs_super_d->map_inode_blks)) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+
+    // 写回数据块位图
+    if (newfs_driver_write(newfs_super_d->map_data_offset, 
+                          (uint8_t *)(newfs_super.map_data), 
+                          NEWFS_BLKS_SZ(newfs_super_d->map_data_blks)) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载文件系统
+ */
+int newfs_umount() {
+    struct newfs_super_d newfs_super_d; 
+    int err;
+    int ret = NEWFS_ERROR_NONE;
+
+    // 1. 检查文件系统是否已挂载
+    if (!newfs_super.is_mounted) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    // 2. 只写回有改动的inode，再写回小文件共享块，最后释放内存中的目录树；
+    //    写回出错时其余部分照常写完，卸载结束时报告错误
+    if ((err = newfs_sync_dirty_inodes()) != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] inode sync error\n", __func__);
+        ret = err;
+    }
+    if ((err = newfs_sync_packs()) != NEWFS_ERROR_NONE) {
+        NEWFS_DBG("[%s] pack sync error\n", __func__);
+        ret = err;
+    }
+    newfs_free_inode(newfs_super.root_dentry->inode);
+    newfs_pool_drain();                                 /* 等后台的回收任务做完 */
+    pthread_mutex_lock(&newfs_super.rcu_lock);
+    newfs_rcu_reclaim(TRUE);                            /* 此时已经没有读者 */
+    pthread_mutex_unlock(&newfs_super.rcu_lock);
+
+    // 3. 将内存中的超级块信息同步到磁盘超级块结构
+    sync_super_to_disk(&newfs_super_d);
+
+    // 4. 将超级块写回磁盘
+    if (newfs_driver_write(NEWFS_SUPER_OFS, 
+                          (uint8_t *)&newfs_super_d, 
+                          sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+
+    // 5. 将位图写回磁盘
+    if ((err = sync_maps_to_disk(&newfs_super_d)) != NEWFS_ERROR_NONE) {
+        return err;
+    }
+
+    // 6. 清理资源
+    free(newfs_super.map_inode);
+    free(newfs_super.map_data);
+    free(newfs_super.packs);
+    if (newfs_super.img_fd >= 0) {
+        close(newfs_super.img_fd);
+        newfs_super.img_fd = -1;
+    }
+    ddriver_close(NEWFS_DRIVER());
+    pthread_mutex_destroy(&newfs_super.rename_lock);
+    pthread_mutex_destroy(&newfs_super.pack_lock);
+    pthread_mutex_destroy(&newfs_super.cache_lock);
+    pthread_mutex_destroy(&newfs_super.dirty_lock);
+    pthread_mutex_destroy(&newfs_super.driver_lock);
+    pthread_mutex_destroy(&newfs_super.rcu_lock);
+
+    return ret;
+}
+
+/**
+ * @brief 与内核协商传输参数：大块写、写请求和预读的上限、异步读、splice，
+ *        每MB的请求数越少，每次请求分摊的映射和拷贝开销越小
+ *
+ * @param conn 连接信息，max_readahead 进来时是内核给出的上限，只能往小改
+ * @param options 对应的用户选项
+ */
+void newfs_negotiate_conn(struct fuse_conn_info* conn, struct custom_options options) {
+#ifdef FUSE_CAP_BIG_WRITES
+    if (options.big_writes && (conn->capable & FUSE_CAP_BIG_WRITES)) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+#endif
+    if (options.max_write > 0) {                /* libfuse 还会按通道缓冲区大小截断 */
+        conn->max_write = options.max_write;
+    }
+    if (options.max_readahead > 0 && options.max_readahead < conn->max_readahead) {
+        conn->max_readahead = options.max_readahead;
+    }
+    conn->async_read = options.async_read ? 1 : 0;
+#ifdef FUSE_CAP_SPLICE_WRITE
+    if (options.splice) {                       /* 读请求的回复用 splice 写进 /dev/fuse */
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    }
+#endif
+#ifdef FUSE_CAP_ASYNC_READ
+    if (options.async_read) {
+        conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+    }
+    else {
+        conn->want &= ~FUSE_CAP_ASYNC_READ;
+    }
+#endif
+}
+
+/**
+ * @brief 挂载文件系统
+ * 
+ * @param options 对应的用户选项
+ * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ */
+int newfs_mount(struct custom_options options) {
+    int ret = NEWFS_ERROR_NONE;
+    struct newfs_super_d newfs_super_d;
+    struct newfs_dentry* root_dentry;
+    struct newfs_inode* root_inode;
+    struct stat img_st;
+    boolean is_init = FALSE;
+    
+    // 1. 初始化基本信息
+    newfs_super.is_mounted = FALSE;
+    pthread_mutex_init(&newfs_super.rename_lock, NULL);
+    pthread_mutex_init(&newfs_super.pack_lock, NULL);
+    pthread_mutex_init(&newfs_super.cache_lock, NULL);
+    pthread_mutex_init(&newfs_super.dirty_lock, NULL);
+    pthread_mutex_init(&newfs_super.driver_lock, NULL);
+    pthread_mutex_init(&newfs_super.rcu_lock, NULL);
+    newfs_super.rcu_epoch       = 0;
+    newfs_super.rcu_retired     = NULL;
+    newfs_super.rcu_retired_cnt = 0;
+    newfs_super.rcu_reclaiming  = FALSE;
+    int fd = ddriver_open(options.device);
+    if (fd < 0) {
+        return fd;
+    }
+    newfs_super.fd = fd;
+
+    // 设备是普通的镜像文件时另外只读打开一次，读请求可以把磁盘上的数据段直接交给 libfuse
+    newfs_super.img_fd = -1;
+    if (options.splice && stat(options.device, &img_st) == 0 && S_ISREG(img_st.st_mode)) {
+        newfs_super.img_fd = open(options.device, O_RDONLY);
+    }
+    
+    // 2. 获取设备信息
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &newfs_super.sz_disk);
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &newfs_super.sz_io);
+    newfs_super.sz_blks = NEWFS_IO_SZ() * 2;
+
+    // 3. 创建根目录项
+    root_dentry = new_dentry("/", NEWFS_DIR);
+    
+    // 4. 读取并检查超级块
+    if (newfs_driver_read(NEWFS_SUPER_OFS, (uint8_t*)(&newfs_super_d), 
+        sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    
+    if (newfs_super_d.magic_num != NEWFS_MAGIC_NUM) {
+        init_newfs_super_d(&newfs_super_d);
+        is_init = TRUE;
+    }
+    
+    // 5. 同步超级块到内存
+    sync_super_to_memory(&newfs_super_d);
+    
+    // 6. 分配并读取位图
+    newfs_super.map_inode = (uint8_t*)malloc(NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks));
+    newfs_super.map_data = (uint8_t*)malloc(NEWFS_BLKS_SZ(newfs_super_d.map_data_blks));
+    
+    if (newfs_driver_read(newfs_super_d.map_inode_offset, newfs_super.map_inode,
+        NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks)) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    
+    if (newfs_driver_read(newfs_super_d.map_data_offset, newfs_super.map_data,
+        NEWFS_BLKS_SZ(newfs_super_d.map_data_blks)) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    
+    // 7. 读入小文件共享块表
+    if (newfs_load_packs() != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+
+    // 8. 处理根目录
+    if (is_init) {
+        root_inode = newfs_alloc_inode(root_dentry);
+        newfs_sync_inode(root_inode);
+        newfs_free_inode(root_inode);
+    }
+    
+    root_inode = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);
+    root_dentry->inode = root_inode;
+    newfs_super.root_dentry = root_dentry;
+    newfs_super.is_mounted = TRUE;
+    
+    return ret;
+}
+
+/**
+ * @brief 为inode分配一个数据块
+ * 
+ * @param inode 需要分配数据块的inode
+ * @param blk_no 分配的数据块编号
+ * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ */
+int newfs_alloc_data_blk(struct newfs_inode* inode, int blk_no) {
+    struct newfs_ptr_blk* holder;
+    int* slot;
+    int  dno;
+    int  goal = blk_no > 0 ? NEWFS_PTR_DNO(newfs_bmap(inode, blk_no - 1)) : -1;
+
+    if (blk_no < 0 || blk_no >= NEWFS_MAX_FILE_BLKS()) {
+        return -NEWFS_ERROR_FBIG;
+    }
+    // 优先紧接着前一块分配，顺序写入的文件得到连续的数据块
+    goal = goal == -1 ? -1 : goal + 1;
+
+    if (NEWFS_USE_EXTENTS(inode)) {
+        if (newfs_bmap(inode, blk_no) != -1) {
+            return NEWFS_ERROR_NONE;
+        }
+        dno = newfs_claim_data_blk(goal);
+        if (dno < 0) {
+            return dno;
+        }
+        if (newfs_insert_extent(inode, blk_no, dno, 1) != NEWFS_ERROR_NONE) {
+            newfs_release_data_blk(dno);
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        return NEWFS_ERROR_NONE;
+    }
+
+    // 找到块号表项，途中缺少的间接块一并分配
+    slot = newfs_map_slot(inode, blk_no, TRUE, &holder);
+    if (slot == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (*slot != -1) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    // 在数据块位图中寻找空闲块
+    dno = newfs_claim_data_blk(goal);
+    if (dno < 0) {
+        return dno;
+    }
+    *slot = dno;
+    if (holder != NULL) {
+        holder->dirty = TRUE;
+    }
+    return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 从磁盘超级块同步到内存超级块
+ * @brief 取得文件第 blk 块在内存中的缓冲区，没有时分配：
+ *        load 为TRUE时从磁盘读入该块的旧内容，否则清零；
+ *        调用者改动缓冲区后要用 NEWFS_DATA_MARK_DIRTY 标记，卸载时只写回脏块
+ * 
+ * @param inode 
+ * @param blk 文件块号
+ * @param load 是否读入旧内容
+ * @return uint8_t* 失败返回NULL
  */
-static void sync_super_to_memory(struct newfs_super_d* newfs_super_d) {
-    newfs_super.sz_usage = newfs_super_d->sz_usage;
-    newfs_super.super_blks = newfs_super_d->super_blks;
-    newfs_super.super_blk_offset = newfs_super_d->super_blk_offset;
-    newfs_super.map_inode_blks = newfs_super_d->map_inode_blks;
-    newfs_super.map_inode_offset = newfs_super_d->map_inode_offset;
-    newfs_super.map_data_blks = newfs_super_d->map_data_blks;
-    newfs_super.map_data_offset = newfs_super_d->map_data_offset;
-    newfs_super.ino_blks = newfs_super_d->ino_blks;
-    newfs_super.ino_offset = newfs_super_d->ino_offset;
-    newfs_super.data_blks = newfs_super_d->data_blks;
-    newfs_super.data_offset = newfs_super_d->data_offset;
-    newfs_super.max_ino = newfs_super_d->max_ino;
-    newfs_super.max_data = newfs_super_d->max_data;
+static uint8_t* newfs_get_data_buf(struct newfs_inode* inode, int blk, boolean load) {
+    uint8_t** data;
+    uint8_t*  dirty;
+    uint8_t*  prealloc;
+    uint8_t*  buf;
+    int cap, old_bytes, new_bytes;
+    int dno;
+
+    if (blk >= inode->data_cap) {
+        cap = inode->data_cap == 0 ? NEWFS_DATA_PER_FILE : inode->data_cap;
+        while (cap <= blk) {
+            cap *= 2;
+        }
+        data = (uint8_t**)realloc(inode->data, cap * sizeof(uint8_t*));
+        if (data == NULL) {
+            return NULL;
+        }
+        memset(data + inode->data_cap, 0, (cap - inode->data_cap) * sizeof(uint8_t*));
+        inode->data = data;
+
+        old_bytes = NEWFS_ROUND_UP(inode->data_cap, UINT8_BITS) / UINT8_BITS;
+        new_bytes = NEWFS_ROUND_UP(cap, UINT8_BITS) / UINT8_BITS;
+        dirty = (uint8_t*)realloc(inode->data_dirty, new_bytes);
+        if (dirty == NULL) {
+            return NULL;
+        }
+        memset(dirty + old_bytes, 0, new_bytes - old_bytes);
+        inode->data_dirty = dirty;
+        prealloc = (uint8_t*)realloc(inode->data_prealloc, new_bytes);
+        if (prealloc == NULL) {
+            return NULL;
+        }
+        memset(prealloc + old_bytes, 0, new_bytes - old_bytes);
+        inode->data_prealloc = prealloc;
+        inode->data_cap      = cap;
+    }
+    if (inode->data[blk] != NULL) {
+        return inode->data[blk];
+    }
+
+    buf = (uint8_t*)malloc(NEWFS_BLK_SZ());
+    if (buf == NULL) {
+        return NULL;
+    }
+    // 预分配未写的块内容视为全0，块进入内存后卸载时会被写回，去掉未写标记
+    dno = newfs_bmap(inode, blk);
+    if (load && dno != -1 && !NEWFS_PTR_UNWRITTEN(dno)) {
+        if (newfs_driver_read(NEWFS_DATA_OFS(dno), buf, 
+                              NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            free(buf);
+            return NULL;
+        }
+    }
+    else {
+        memset(buf, 0, NEWFS_BLK_SZ());
+    }
+    if (NEWFS_PTR_UNWRITTEN(dno)) {
+        if (newfs_remap_blk(inode, blk, NEWFS_REMAP_WRITTEN) != NEWFS_ERROR_NONE) {
+            free(buf);
+            return NULL;
+        }
+        NEWFS_DATA_MARK_DIRTY(inode, blk);      /* 去掉了未写标记，磁盘上的块必须写成全0 */
+        NEWFS_DATA_MARK_PREALLOC(inode, blk);   /* 写回时仍全为0则重新标为未写 */
+    }
+    inode->data[blk] = buf;
+    return buf;
 }
 
 /**
- * @brief 从内存超级块同步到磁盘超级块
+ * @brief 内嵌数据放不下时，把文件转成按块映射，原有的数据搬到第0块
+ * 
+ * @param inode 内嵌数据的文件inode
+ * @return int 
  */
-static void sync_super_to_disk(struct newfs_super_d* newfs_super_d) {
-    newfs_super_d->magic_num = NEWFS_MAGIC_NUM;
-    newfs_super_d->sz_usage = newfs_super.sz_usage;
-    newfs_super_d->super_blks = newfs_super.super_blks;
-    newfs_super_d->super_blk_offset = newfs_super.super_blk_offset;
-    newfs_super_d->map_inode_blks = newfs_super.map_inode_blks;
-    newfs_super_d->map_inode_offset = newfs_super.map_inode_offset;
-    newfs_super_d->map_data_blks = newfs_super.map_data_blks;
-    newfs_super_d->map_data_offset = newfs_super.map_data_offset;
-    newfs_super_d->ino_blks = newfs_super.ino_blks;
-    newfs_super_d->ino_offset = newfs_super.ino_offset;
-    newfs_super_d->data_blks = newfs_super.data_blks;
-    newfs_super_d->data_offset = newfs_super.data_offset;
-    newfs_super_d->max_ino = newfs_super.max_ino;
-    newfs_super_d->max_data = newfs_super.max_data;
+static int newfs_promote_inline(struct newfs_inode* inode) {
+    uint8_t* data;
+    int ret;
+
+    inode->flags &= ~NEWFS_INODE_INLINE_DATA;
+    if (inode->size == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    ret = newfs_alloc_data_blk(inode, 0);
+    if (ret == NEWFS_ERROR_NONE) {
+        data = newfs_get_data_buf(inode, 0, FALSE);
+        ret  = data == NULL ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        inode->flags |= NEWFS_INODE_INLINE_DATA;
+        return ret;
+    }
+    // 写合并缓冲区中暂存的写入已经计入了文件大小，内嵌的数据至多 NEWFS_INLINE_DATA_MAX 字节
+    memcpy(data, inode->inline_data, 
+           inode->size < NEWFS_INLINE_DATA_MAX ? inode->size : NEWFS_INLINE_DATA_MAX);
+    NEWFS_DATA_MARK_DIRTY(inode, 0);
+    memset(inode->inline_data, 0, NEWFS_INLINE_DATA_MAX);
+    return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 写回位图
+ * @brief 修改共享块中的小文件前，把它搬回自己的第0块，写回时再决定是否重新放进共享块
+ * 
+ * @param inode 共享块中的文件inode
+ * @return int 
  */
-static int sync_maps_to_disk(struct newfs_super_d* newfs_super_d) {
-    // 写回索引节点位图
-    if (newfs_driver_write(newfs_super_d->map_inode_offset, 
-                          (uint8_t *)(newfs_super.map_inode), 
-                          NEWFS_BLKS_SZ(newfs_super_d->map_inode_blks)) != NEWFS_ERROR_NONE) {
+static int newfs_unpack_file(struct newfs_inode* inode) {
+    uint8_t* packed;
+    uint8_t* data;
+    int len = 0;
+    int ret;
+
+    // 别的文件写回时会整理共享块，从取出数据到归还槽位都持有 pack_lock
+    pthread_mutex_lock(&newfs_super.pack_lock);
+    packed = newfs_pack_data(inode->pack_dno, inode->pack_slot, &len);
+    if (packed == NULL) {
+        pthread_mutex_unlock(&newfs_super.pack_lock);
+        return -NEWFS_ERROR_IO;
+    }
+    inode->flags &= ~NEWFS_INODE_PACKED;
+    ret = newfs_alloc_data_blk(inode, 0);
+    data = ret == NEWFS_ERROR_NONE ? newfs_get_data_buf(inode, 0, FALSE) : NULL;
+    if (data == NULL) {
+        inode->flags |= NEWFS_INODE_PACKED;
+        pthread_mutex_unlock(&newfs_super.pack_lock);
+        return ret != NEWFS_ERROR_NONE ? ret : -NEWFS_ERROR_IO;
+    }
+    memcpy(data, packed, len < inode->size ? len : inode->size);
+    NEWFS_DATA_MARK_DIRTY(inode, 0);
+    newfs_pack_release(inode->pack_dno, inode->pack_slot);
+    pthread_mutex_unlock(&newfs_super.pack_lock);
+    inode->pack_dno  = -1;
+    inode->pack_slot = -1;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把文件块 [blk, end_blk) 中的空洞尽量映射到连续的数据块上，
+ *        新映射的块标记为未写，读出全0，第一次写入时才去掉标记；已映射的块保持不变
+ * 
+ * @param inode 
+ * @param blk 起始文件块号
+ * @param end_blk 结束文件块号（不含）
+ * @return int 
+ */
+static int newfs_map_holes(struct newfs_inode* inode, int blk, int end_blk) {
+    struct newfs_ptr_blk* holder;
+    int* slot;
+    int  run, dno, got, goal, k;
+
+    while (blk < end_blk) {
+        run = newfs_bmap_run(inode, blk, end_blk - blk, &dno);
+        if (dno != -1) {                        /* 已映射的部分跳过 */
+            blk += run;
+            continue;
+        }
+        goal = blk > 0 ? NEWFS_PTR_DNO(newfs_bmap(inode, blk - 1)) : -1;
+        goal = goal == -1 ? -1 : goal + 1;      /* 前一块是空洞时从首选分配组开始找 */
+        dno  = newfs_claim_data_run(goal, run, &got);
+        if (dno < 0) {
+            return dno;
+        }
+        if (NEWFS_USE_EXTENTS(inode)) {
+            if (newfs_insert_extent(inode, blk, dno, got | NEWFS_EXT_UNWRITTEN) != NEWFS_ERROR_NONE) {
+                for (k = 0; k < got; k++) {
+                    newfs_release_data_blk(dno + k);
+                }
+                return -NEWFS_ERROR_NOSPACE;
+            }
+        }
+        else {
+            for (k = 0; k < got; k++) {
+                slot = newfs_map_slot(inode, blk + k, TRUE, &holder);
+                if (slot == NULL) {             /* 间接块分配失败，归还剩下的块 */
+                    for (; k < got; k++) {
+                        newfs_release_data_blk(dno + k);
+                    }
+                    return -NEWFS_ERROR_NOSPACE;
+                }
+                *slot = (dno + k) | NEWFS_BLK_UNWRITTEN;
+                if (holder != NULL) {
+                    holder->dirty = TRUE;
+                }
+            }
+        }
+        blk += got;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 读访问时更新 atime，类似 relatime：atime 不比修改时间新或已过了一天才更新，
+ *        只读的访问大多不会让inode变脏
+ * 
+ * @param inode 
+ */
+static void newfs_touch_atime(struct newfs_inode* inode) {
+    uint32_t now   = (uint32_t)time(NULL);
+    uint32_t atime = __atomic_load_n(&inode->atime, __ATOMIC_RELAXED);   /* 读者只持有读锁 */
+    if (atime <= inode->mtime || atime <= inode->ctime || now - atime >= NEWFS_ATIME_MAX_AGE) {
+        __atomic_store_n(&inode->atime, now, __ATOMIC_RELAXED);
+        newfs_mark_inode_dirty(inode);
+    }
+}
+
+/**
+ * @brief 从文件 offset 处读出至多 size 字节，读到文件末尾为止：
+ *        在内存中的块直接拷贝，其余块按块映射从磁盘读，未映射的块读出全0
+ * 
+ * @param inode 文件inode
+ * @param buf 输出
+ * @param size 
+ * @param offset 
+ * @return int 读出的字节数
+ */
+int newfs_inode_read(struct newfs_inode* inode, uint8_t* buf, int size, int offset) {
+    int end = offset + size > inode->size ? inode->size : offset + size;
+    int pos, blk, bias, len, dno, run;
+
+    newfs_touch_atime(inode);
+
+    // 读到写合并缓冲区中暂存的数据时先把它写进文件
+    if (inode->stage_len > 0 && offset < inode->stage_off + inode->stage_len && 
+        offset + size > inode->stage_off && newfs_inode_flush_stage(inode) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+
+    uint8_t* packed;
+    int packed_len = 0;
+
+    if (NEWFS_IS_INLINE(inode)) {
+        if (end <= offset) {
+            return 0;
+        }
+        memcpy(buf, inode->inline_data + offset, end - offset);
+        return end - offset;
+    }
+    if (NEWFS_IS_PACKED(inode)) {
+        if (end <= offset) {
+            return 0;
+        }
+        pthread_mutex_lock(&newfs_super.pack_lock);
+        packed = newfs_pack_data(inode->pack_dno, inode->pack_slot, &packed_len);
+        if (packed == NULL) {
+            pthread_mutex_unlock(&newfs_super.pack_lock);
+            return -NEWFS_ERROR_IO;
+        }
+        end = end < packed_len ? end : packed_len;
+        memcpy(buf, packed + offset, end > offset ? end - offset : 0);
+        pthread_mutex_unlock(&newfs_super.pack_lock);
+        return end > offset ? end - offset : 0;
+    }
+
+    for (pos = offset; pos < end; pos += len) {
+        blk  = pos / NEWFS_BLK_SZ();
+        bias = pos % NEWFS_BLK_SZ();
+
+        if (blk < inode->data_cap && inode->data[blk] != NULL) {
+            len = NEWFS_BLK_SZ() - bias < end - pos ? NEWFS_BLK_SZ() - bias : end - pos;
+            memcpy(buf + pos - offset, inode->data[blk] + bias, len);
+            continue;
+        }
+
+        // 不在内存中的块：连续映射的一段一次读出，遇到内存中的块为止
+        run = (end - 1) / NEWFS_BLK_SZ() - blk + 1;
+        run = newfs_bmap_run(inode, blk, run, &dno);
+        for (int i = 1; i < run; i++) {
+            if (blk + i < inode->data_cap && inode->data[blk + i] != NULL) {
+                run = i;
+                break;
+            }
+        }
+        len = NEWFS_BLKS_SZ(blk + run) - pos < end - pos ? NEWFS_BLKS_SZ(blk + run) - pos : end - pos;
+        if (dno == -1 || NEWFS_PTR_UNWRITTEN(dno)) {          /* 空洞和预分配未写的块读出全0 */
+            memset(buf + pos - offset, 0, len);
+        }
+        else if (newfs_driver_read(NEWFS_DATA_OFS(dno) + bias, buf + pos - offset, 
+                                   len) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    return pos > offset ? pos - offset : 0;
+}
+
+/**
+ * @brief 文件第 blk 块的内容是否只在磁盘上：不在内存中、已映射且写过
+ * 
+ * @param inode 
+ * @param blk 
+ * @return boolean 
+ */
+static boolean newfs_blk_on_disk(struct newfs_inode* inode, int blk) {
+    int dno;
+    if (blk < inode->data_cap && inode->data[blk] != NULL) {
+        return FALSE;
+    }
+    dno = newfs_bmap(inode, blk);
+    return dno != -1 && !NEWFS_PTR_UNWRITTEN(dno);
+}
+
+/**
+ * @brief 在 bufvec 末尾追加一个缓冲区，容量不够时扩大一倍
+ * 
+ * @param pbufv 
+ * @param cap 当前容量
+ * @param buf 
+ * @return int 
+ */
+static int newfs_bufvec_push(struct fuse_bufvec** pbufv, int* cap, const struct fuse_buf* buf) {
+    struct fuse_bufvec* bufv = *pbufv;
+    if ((int)bufv->count == *cap) {
+        bufv = (struct fuse_bufvec*)realloc(bufv, sizeof(struct fuse_bufvec) + 
+                                            (*cap * 2 - 1) * sizeof(struct fuse_buf));
+        if (bufv == NULL) {
+            return -NEWFS_ERROR_NOMEM;
+        }
+        *cap *= 2;
+        *pbufv = bufv;
+    }
+    bufv->buf[bufv->count++] = *buf;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放 newfs_inode_read_buf 返回的 bufvec 及其中的内存缓冲区
+ * 
+ * @param bufv 
+ */
+void newfs_free_bufvec(struct fuse_bufvec* bufv) {
+    if (bufv == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < bufv->count; i++) {
+        free(bufv->buf[i].mem);
+    }
+    free(bufv);
+}
+
+/**
+ * @brief 以 bufvec 的形式读出文件 offset 处至多 size 字节：只在磁盘上的整块连续段
+ *        给出镜像文件的描述符和偏移，由 libfuse 直接 splice，不经过用户态拷贝；
+ *        其余部分（内存中的块、空洞、首尾不满一块的部分）读进各自 malloc 的内存缓冲区
+ * 
+ * @param inode 文件inode
+ * @param pbufv 输出，用 newfs_free_bufvec 释放（高层接口由 libfuse 释放）
+ * @param size 
+ * @param offset 
+ * @return int 读出的字节数，失败返回负的错误号
+ */
+int newfs_inode_read_buf(struct newfs_inode* inode, struct fuse_bufvec** pbufv, int size, int offset) {
+    int end = offset + size > inode->size ? inode->size : offset + size;
+    int cap = 4;
+    int pos, next, blk, run, dno, ret;
+    boolean use_fd;
+    struct fuse_bufvec* bufv;
+    struct fuse_buf seg;
+
+    // 磁盘上的内容要包含写合并缓冲区中暂存的数据
+    if (inode->stage_len > 0 && offset < inode->stage_off + inode->stage_len && 
+        offset + size > inode->stage_off && newfs_inode_flush_stage(inode) != NEWFS_ERROR_NONE) {
         return -NEWFS_ERROR_IO;
     }
+    bufv = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec) + (cap - 1) * sizeof(struct fuse_buf));
+    if (bufv == NULL) {
+        return -NEWFS_ERROR_NOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+    newfs_touch_atime(inode);
+
+    use_fd = newfs_super.img_fd >= 0 && !NEWFS_IS_INLINE(inode) && !NEWFS_IS_PACKED(inode);
+    for (pos = offset; pos < end; pos = next) {
+        memset(&seg, 0, sizeof(struct fuse_buf));
+        blk = pos / NEWFS_BLK_SZ();
+        if (use_fd && pos % NEWFS_BLK_SZ() == 0 && end - pos >= NEWFS_BLK_SZ() && 
+            newfs_blk_on_disk(inode, blk)) {
+            run = newfs_bmap_run(inode, blk, (end - pos) / NEWFS_BLK_SZ(), &dno);
+            for (int i = 1; i < run; i++) {     /* 遇到内存中的块为止 */
+                if (blk + i < inode->data_cap && inode->data[blk + i] != NULL) {
+                    run = i;
+                    break;
+                }
+            }
+            seg.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            seg.fd    = newfs_super.img_fd;
+            seg.pos   = NEWFS_DATA_OFS(dno);
+            seg.size  = NEWFS_BLKS_SZ(run);
+            next      = pos + NEWFS_BLKS_SZ(run);
+        }
+        else {
+            // 拷贝到下一个可以直接 splice 的块为止
+            next = use_fd ? NEWFS_ROUND_DOWN(pos, NEWFS_BLK_SZ()) + NEWFS_BLK_SZ() : end;
+            while (next < end && (end - next < NEWFS_BLK_SZ() || 
+                                  !newfs_blk_on_disk(inode, next / NEWFS_BLK_SZ()))) {
+                next += NEWFS_BLK_SZ();
+            }
+            next      = next < end ? next : end;
+            seg.fd    = -1;
+            seg.size  = next - pos;
+            seg.mem   = malloc(seg.size);
+            ret = seg.mem == NULL ? -NEWFS_ERROR_NOMEM : 
+                  newfs_inode_read(inode, (uint8_t*)seg.mem, next - pos, pos);
+            if (ret < 0) {
+                free(seg.mem);
+                newfs_free_bufvec(bufv);
+                return ret;
+            }
+        }
+        if ((ret = newfs_bufvec_push(&bufv, &cap, &seg)) != NEWFS_ERROR_NONE) {
+            free(seg.mem);
+            newfs_free_bufvec(bufv);
+            return ret;
+        }
+    }
+    *pbufv = bufv;
+    return end > offset ? end - offset : 0;
+}
+
+/**
+ * @brief 将 buf 写入文件 offset 处，按需分配数据块和间接块，
+ *        数据先写入内存中的块缓冲区，卸载时写回
+ * 
+ * @param inode 文件inode
+ * @param buf 
+ * @param size 
+ * @param offset 
+ * @return int 写入的字节数，一个字节都没写入时返回错误码
+ */
+int newfs_inode_write(struct newfs_inode* inode, const uint8_t* buf, int size, int offset) {
+    int end = offset + size;
+    int ret = NEWFS_ERROR_NONE;
+    int pos, blk, bias, len, run, dno, end_blk, i;
+    boolean mapped;
+    uint8_t* data;
+
+    newfs_mark_inode_dirty(inode);
+    if (NEWFS_IS_INLINE(inode)) {
+        if (end <= NEWFS_INLINE_DATA_MAX) {
+            memcpy(inode->inline_data + offset, buf, size);
+            inode->size = end > inode->size ? end : inode->size;
+            return size;
+        }
+        ret = newfs_promote_inline(inode);
+        if (ret != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+    }
+    if (NEWFS_IS_PACKED(inode) && (ret = newfs_unpack_file(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+
+    // 跨多块的写入先按整段分配连续的数据块（未写块在下面取缓冲区时清零），分配不到的再逐块分配
+    blk = offset / NEWFS_BLK_SZ();
+    if (NEWFS_ROUND_UP(end, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ() - blk > 1) {
+        newfs_map_holes(inode, blk, NEWFS_ROUND_UP(end, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ());
+    }
+
+    // 按映射连续的一段查一次块映射，段内逐块拷贝；未映射的块逐块分配
+    end_blk = NEWFS_ROUND_UP(end, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ();
+    for (pos = offset; pos < end && ret == NEWFS_ERROR_NONE; ) {
+        blk    = pos / NEWFS_BLK_SZ();
+        run    = newfs_bmap_run(inode, blk, end_blk - blk, &dno);
+        mapped = dno != -1;
+        if (!mapped) {
+            run = 1;
+            ret = newfs_alloc_data_blk(inode, blk);
+            if (ret != NEWFS_ERROR_NONE) {
+                break;
+            }
+        }
+        for (i = 0; i < run && pos < end; i++, pos += len) {
+            bias = pos % NEWFS_BLK_SZ();
+            len  = NEWFS_BLK_SZ() - bias < end - pos ? NEWFS_BLK_SZ() - bias : end - pos;
+            // 只写块的一部分时需要保留块中原有的内容
+            data = newfs_get_data_buf(inode, blk + i, mapped && len < NEWFS_BLK_SZ());
+            if (data == NULL) {
+                ret = -NEWFS_ERROR_IO;
+                break;
+            }
+            memcpy(data + bias, buf + pos - offset, len);
+            NEWFS_DATA_MARK_DIRTY(inode, blk + i);
+        }
+    }
+
+    if (pos > inode->size) {
+        inode->size = pos;
+    }
+    return pos > offset ? pos - offset : ret;
+}
+
+/**
+ * @brief 把写合并缓冲区中暂存的数据写进文件。只写进一部分时接着写剩下的，
+ *        直到全部写完或出错；出错时没写进去的数据留在缓冲区里，之后还可以再写
+ * 
+ * @param inode 
+ * @return int 
+ */
+int newfs_inode_flush_stage(struct newfs_inode* inode) {
+    int ret;
+    while (inode->stage_len > 0) {
+        ret = newfs_inode_write(inode, inode->stage, inode->stage_len, inode->stage_off);
+        if (ret <= 0) {
+            return ret < 0 ? ret : -NEWFS_ERROR_IO;
+        }
+        memmove(inode->stage, inode->stage + ret, inode->stage_len - ret);
+        inode->stage_off += ret;
+        inode->stage_len -= ret;
+    }
+    free(inode->stage);
+    inode->stage = NULL;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 带写合并的写入：首尾相接的小块写入先攒在缓冲区里，攒满、不再相接或被读到时
+ *        才一次写进文件；文件大小立即更新。数据块在攒进缓冲区之前就映射好，
+ *        之后写进文件时不会因为空间不足丢掉已经确认写入的数据
+ * 
+ * @param inode 文件inode
+ * @param buf 写入的内容
+ * @param size 写入的字节数
+ * @param offset 相对文件的偏移
+ * @return int 写入的字节数，失败返回负的错误号
+ */
+int newfs_inode_stage_write(struct newfs_inode* inode, const uint8_t* buf, int size, int offset) {
+    int end = offset + size;
+    int ret;
+
+    // 时间在写入时更新，而不是在合并缓冲区写进文件时
+    newfs_touch_inode(inode, NEWFS_T_MTIME | NEWFS_T_CTIME);
+
+    if (inode->stage_len > 0 && 
+        (offset != inode->stage_off + inode->stage_len || 
+         inode->stage_len + size > NEWFS_BLKS_SZ(NEWFS_STAGE_BLKS))) {
+        if ((ret = newfs_inode_flush_stage(inode)) != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+    }
+    // 内嵌数据和共享块中的文件先由直接写入转成按块映射
+    if (size >= NEWFS_BLKS_SZ(NEWFS_STAGE_BLKS) || 
+        NEWFS_ROUND_UP(end, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ() > NEWFS_MAX_FILE_BLKS() ||
+        NEWFS_IS_INLINE(inode) || NEWFS_IS_PACKED(inode)) {
+        return newfs_inode_write(inode, buf, size, offset);
+    }
+    // 映射不到数据块时直接写，由它报告实际写入了多少
+    if (newfs_map_holes(inode, offset / NEWFS_BLK_SZ(), 
+                        NEWFS_ROUND_UP(end, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        return newfs_inode_write(inode, buf, size, offset);
+    }
+
+    if (inode->stage == NULL) {
+        inode->stage = (uint8_t*)malloc(NEWFS_BLKS_SZ(NEWFS_STAGE_BLKS));
+        if (inode->stage == NULL) {
+            return newfs_inode_write(inode, buf, size, offset);
+        }
+        inode->stage_off = offset;
+    }
+    memcpy(inode->stage + inode->stage_len, buf, size);
+    inode->stage_len += size;
+    inode->size       = end > inode->size ? end : inode->size;
+    newfs_mark_inode_dirty(inode);
+    return size;
+}
+
+/**
+ * @brief 写入 bufvec 中的数据：单个内存缓冲区直接写，其他形式（如从 /dev/fuse splice 
+ *        进来的管道）先由 fuse_buf_copy 拷进一块连续内存；数据最终都要进入块缓冲区
+ * 
+ * @param inode 文件inode
+ * @param src 写入的内容
+ * @param offset 相对文件的偏移
+ * @return int 写入的字节数，失败返回负的错误号
+ */
+int newfs_inode_write_buf(struct newfs_inode* inode, struct fuse_bufvec* src, int offset) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+    ssize_t got;
+    int ret;
+
+    if (src->count == 1 && src->idx == 0 && src->off == 0 && !(src->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return newfs_inode_stage_write(inode, (const uint8_t*)src->buf[0].mem, src->buf[0].size, offset);
+    }
+    dst.buf[0].mem = malloc(dst.buf[0].size);
+    if (dst.buf[0].mem == NULL) {
+        return -NEWFS_ERROR_NOMEM;
+    }
+    got = fuse_buf_copy(&dst, src, 0);
+    ret = got < 0 ? (int)got : newfs_inode_stage_write(inode, (const uint8_t*)dst.buf[0].mem, got, offset);
+    free(dst.buf[0].mem);
+    return ret;
+}
+
+
+/**
+ * @brief 删除dentry目录项
+ * 
+ * @param inode 包含当前dentry目录项的索引节点
+ * @param dentry 要删除的dentry目录项
+ * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ */
+int newfs_drop_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
+    int slot = dentry->slot;
+    int last;
 
-    // 写回数据块位图
-    if (newfs_driver_write(newfs_super_d->map_data_offset, 
-                          (uint8_t *)(newfs_super.map_data), 
-                          NEWFS_BLKS_SZ(newfs_super_d->map_data_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    if (slot < 0 || slot >= inode->dir_cnt || inode->dirents[slot].dentry != dentry) {
+        return -NEWFS_ERROR_NOTFOUND;
     }
+    inode->names_garbage += inode->dirents[slot].name_len + 1;
+    newfs_release_dir_rec(inode, &inode->dirents[slot]);
 
+    /* 用最后一个子项填补空位 */
+    last = inode->dir_cnt - 1;
+    __atomic_store_n(&inode->dir_cnt, last, __ATOMIC_RELEASE);
+    if (slot != last) {
+        inode->dirents[slot] = inode->dirents[last];
+        if (inode->dirents[slot].dentry != NULL) {
+            inode->dirents[slot].dentry->slot = slot;
+        }
+    }
+    if (inode->names_garbage > inode->names_len / 2) {
+        newfs_compact_names(inode);
+    }
+    newfs_rcu_retire(dentry, free);
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 卸载文件系统
+ * @brief 删除内存中的一个inode及其对应的dentry和data
+ * 
+ * @param inode 要删除的inode，调用者持有其写锁，锁在这里放开（推迟释放时）或随inode销毁
+ * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
  */
-int newfs_umount() {
-    struct newfs_super_d newfs_super_d; 
+int newfs_drop_inode(struct newfs_inode* inode) {
+    struct newfs_dentry* sub_dentry;
 
-    // 1. 检查文件系统是否已挂载
-    if (!newfs_super.is_mounted) {
+    if (inode == NULL) {
         return NEWFS_ERROR_NONE;
     }
 
-    // 2. 从根节点开始,递归地将所有inode写回磁盘
-    newfs_sync_inode(newfs_super.root_dentry->inode);
+    /* 目录的 seq 从此保持奇数，还在它下面无锁查找的读者一律改走加锁的查找 */
+    if (NEWFS_IS_DIR(inode)) {
+        newfs_dir_seq_begin(inode);
+    }
 
-    // 3. 将内存中的超级块信息同步到磁盘超级块结构
-    sync_super_to_disk(&newfs_super_d);
+    /* 还有打开的句柄时只从目录树上摘下，数据块和inode号留到最后一个句柄关闭时再释放 */
+    if (inode->open_cnt > 0) {
+        newfs_unlist_dirty(inode);
+        inode->unlinked = TRUE;
+        inode->dentry   = NULL;
+        NEWFS_UNLOCK(inode);
+        return NEWFS_ERROR_NONE;
+    }
 
-    // 4. 将超级块写回磁盘
-    if (newfs_driver_write(NEWFS_SUPER_OFS, 
-                          (uint8_t *)&newfs_super_d, 
-                          sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    if (NEWFS_IS_DIR(inode)) {
+        /* 递归删除目录下的所有目录项，先等子项上进行中的操作结束 */
+        for (int i = 0; i < inode->dir_cnt; i++) {
+            sub_dentry = inode->dirents[i].dentry;
+            if (sub_dentry != NULL) {
+                if (sub_dentry->inode != NULL) {
+                    NEWFS_WRLOCK(sub_dentry->inode);
+                    newfs_drop_inode(sub_dentry->inode);
+                }
+                newfs_rcu_retire(sub_dentry, free);
+            }
+        }
+        newfs_rcu_retire(inode->dirents, free);
+        newfs_rcu_retire(inode->names, free);
+        /* 释放目录块 */
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (inode->block_pointer[i] != -1) {
+                newfs_release_data_blk(inode->block_pointer[i]);
+            }
+        }
     }
+    else if (NEWFS_IS_REG(inode)) {
+        /* 释放文件对应的数据块，包括间接块映射的数据块和间接块本身 */
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (inode->block_pointer[i] != -1) {
+                /* 清除数据块位图 */
+                newfs_release_data_blk(inode->block_pointer[i]);
+            }
+        }
+        newfs_release_ptr_blk(&inode->ind, &inode->ind_pointer, FALSE);
+        newfs_release_ptr_blk(&inode->dind, &inode->dind_pointer, TRUE);
+        if (NEWFS_IS_PACKED(inode)) {
+            pthread_mutex_lock(&newfs_super.pack_lock);
+            newfs_pack_release(inode->pack_dno, inode->pack_slot);
+            pthread_mutex_unlock(&newfs_super.pack_lock);
+        }
+        for (int i = 0; i < inode->ext_cnt; i++) {
+            for (int j = 0; j < NEWFS_EXT_LEN(&inode->exts[i]); j++) {
+                newfs_release_data_blk(inode->exts[i].dno + j);
+            }
+        }
+        for (int i = 0; i < inode->ext_blk_cnt; i++) {
+            newfs_release_data_blk(inode->ext_blks[i]);
+        }
+        free(inode->exts);
+        free(inode->ext_blks);
 
-    // 5. 将位图写回磁盘
-    int ret = sync_maps_to_disk(&newfs_super_d);
-    if (ret != NEWFS_ERROR_NONE) {
-        return ret;
+        /* 释放数据块内存 */
+        for (int i = 0; i < inode->data_cap; i++) {
+            free(inode->data[i]);
+        }
+        free(inode->data);
+        free(inode->data_dirty);
+        free(inode->data_prealloc);
+        free(inode->stage);
     }
 
-    // 6. 清理资源
-    free(newfs_super.map_inode);
-    free(newfs_super.map_data);
-    ddriver_close(NEWFS_DRIVER());
+    newfs_unlist_dirty(inode);
+
+    /* 清除inode位图中对应的位 */
+    newfs_bitmap_release(newfs_super.map_inode, inode->ino);
+
+    /* 已经没有别人能通过加锁的查找找到它，无锁查找的读者离开后再释放inode内存 */
+    NEWFS_UNLOCK(inode);
+    newfs_rcu_retire(inode, newfs_rcu_free_inode);
 
     return NEWFS_ERROR_NONE;
 }
 
+
 /**
- * @brief 挂载文件系统
+ * @brief 修改文件大小：扩大时不分配任何块，新增的部分是空洞，读出全0；
+ *        缩小时归还文件末尾之后的数据块，并把最后一块中文件末尾之后的部分清零，
+ *        保证以后再扩大时读出的仍是0
  * 
- * @param options 对应的用户选项
- * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ * @param inode 文件inode
+ * @param size 新的文件大小
+ * @return int 
  */
-int newfs_mount(struct custom_options options) {
-    int ret = NEWFS_ERROR_NONE;
-    struct newfs_super_d newfs_super_d;
-    struct newfs_dentry* root_dentry;
-    struct newfs_inode* root_inode;
-    boolean is_init = FALSE;
-    
-    // 1. 初始化基本信息
-    newfs_super.is_mounted = FALSE;
-    int fd = ddriver_open(options.device);
-    if (fd < 0) {
-        return fd;
-    }
-    newfs_super.fd = fd;
-    
-    // 2. 获取设备信息
-    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &newfs_super.sz_disk);
-    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &newfs_super.sz_io);
-    newfs_super.sz_blks = NEWFS_IO_SZ() * 2;
+int newfs_inode_truncate(struct newfs_inode* inode, int size) {
+    int blk  = size / NEWFS_BLK_SZ();
+    int bias = size % NEWFS_BLK_SZ();
+    uint8_t* data;
+    int ret, dno;
 
-    // 3. 创建根目录项
-    root_dentry = new_dentry("/", NEWFS_DIR);
-    
-    // 4. 读取并检查超级块
-    if (newfs_driver_read(NEWFS_SUPER_OFS, (uint8_t*)(&newfs_super_d), 
-        sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
-    }
-    
-    if (newfs_super_d.magic_num != NEWFS_MAGIC_NUM) {
-        init_newfs_super_d(&newfs_super_d);
-        is_init = TRUE;
+    if ((ret = newfs_inode_flush_stage(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
     }
-    
-    // 5. 同步超级块到内存
-    sync_super_to_memory(&newfs_super_d);
-    
-    // 6. 分配并读取位图
-    newfs_super.map_inode = (uint8_t*)malloc(NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks));
-    newfs_super.map_data = (uint8_t*)malloc(NEWFS_BLKS_SZ(newfs_super_d.map_data_blks));
-    
-    if (newfs_driver_read(newfs_super_d.map_inode_offset, newfs_super.map_inode,
-        NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    newfs_touch_inode(inode, NEWFS_T_MTIME | NEWFS_T_CTIME);
+    if (NEWFS_IS_INLINE(inode)) {
+        if (size <= NEWFS_INLINE_DATA_MAX) {
+            if (size < inode->size) {
+                memset(inode->inline_data + size, 0, NEWFS_INLINE_DATA_MAX - size);
+            }
+            inode->size = size;
+            return NEWFS_ERROR_NONE;
+        }
+        ret = newfs_promote_inline(inode);
+        if (ret != NEWFS_ERROR_NONE) {
+            return ret;
+        }
     }
-    
-    if (newfs_driver_read(newfs_super_d.map_data_offset, newfs_super.map_data,
-        NEWFS_BLKS_SZ(newfs_super_d.map_data_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    if (NEWFS_IS_PACKED(inode) && (ret = newfs_unpack_file(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
     }
-    
-    // 7. 处理根目录
-    if (is_init) {
-        root_inode = newfs_alloc_inode(root_dentry);
-        newfs_sync_inode(root_inode);
+
+    if (size < inode->size) {
+        newfs_unmap_data_blks(inode, NEWFS_ROUND_UP(size, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ());
+        dno = newfs_bmap(inode, blk);
+        if (bias != 0 && dno != -1 && !NEWFS_PTR_UNWRITTEN(dno)) {
+            data = newfs_get_data_buf(inode, blk, TRUE);
+            if (data == NULL) {
+                return -NEWFS_ERROR_IO;
+            }
+            memset(data + bias, 0, NEWFS_BLK_SZ() - bias);
+            NEWFS_DATA_MARK_DIRTY(inode, blk);
+        }
     }
-    
-    root_inode = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);
-    root_dentry->inode = root_inode;
-    newfs_super.root_dentry = root_dentry;
-    newfs_super.is_mounted = TRUE;
-    
-    return ret;
+    inode->size = size;
+    return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 为inode分配一个数据块
+ * @brief 为 [offset, offset + len) 预分配数据块：区间内的空洞尽量映射到连续的数据块上，
+ *        这些块标记为未写，读出全0，第一次写入时才去掉标记；已映射的块保持不变
  * 
- * @param inode 需要分配数据块的inode
- * @param blk_no 分配的数据块编号
- * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ * @param inode 文件inode
+ * @param offset 起始偏移
+ * @param len 长度
+ * @param keep_size 为TRUE时不改变文件大小（FALLOC_FL_KEEP_SIZE）
+ * @return int 
  */
-int newfs_alloc_data_blk(struct newfs_inode* inode, int blk_no) {
-    // 检查参数
-    if (blk_no >= NEWFS_DATA_PER_FILE) {
-        return -NEWFS_ERROR_NOSPACE;
-    }
+int newfs_inode_fallocate(struct newfs_inode* inode, int offset, int len, boolean keep_size) {
+    int blk     = offset / NEWFS_BLK_SZ();
+    int end     = offset + len;
+    int end_blk = NEWFS_ROUND_UP(end, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ();
+    int ret;
 
-    // 在数据块位图中寻找空闲块
-    int byte_cursor = 0; 
-    int bit_cursor = 0; 
-    int data_blk_cursor = 0;
-    boolean is_find_free_blk = FALSE;
-
-    // 遍历数据块位图
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_data_blks); byte_cursor++) {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if ((newfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {
-                // 找到空闲数据块
-                newfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_blk = TRUE;
-                break;
-            }
-            data_blk_cursor++;
+    if (end_blk > NEWFS_MAX_FILE_BLKS()) {
+        return -NEWFS_ERROR_FBIG;
+    }
+    if ((ret = newfs_inode_flush_stage(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    newfs_touch_inode(inode, keep_size ? NEWFS_T_CTIME : NEWFS_T_MTIME | NEWFS_T_CTIME);
+    if (NEWFS_IS_INLINE(inode)) {
+        if (end <= NEWFS_INLINE_DATA_MAX) {     /* 内联数据放得下，无需分配 */
+            inode->size = keep_size || end <= inode->size ? inode->size : end;
+            return NEWFS_ERROR_NONE;
         }
-        if (is_find_free_blk) {
-            break;
+        if ((ret = newfs_promote_inline(inode)) != NEWFS_ERROR_NONE) {
+            return ret;
         }
     }
-
-    // 检查是否找到空闲块
-    if (!is_find_free_blk || data_blk_cursor >= newfs_super.max_data) {
-        return -NEWFS_ERROR_NOSPACE;
+    if (NEWFS_IS_PACKED(inode) && (ret = newfs_unpack_file(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
     }
 
-    // 分配数据块
-    inode->block_pointer[blk_no] = data_blk_cursor;
-    
-    // 为数据块分配内存
-    if (inode->data[blk_no] == NULL) {
-        inode->data[blk_no] = (uint8_t *)malloc(NEWFS_BLK_SZ());
-        if (inode->data[blk_no] == NULL) {
-            // 分配失败，回退位图标记
-            newfs_super.map_data[byte_cursor] &= ~(0x1 << bit_cursor);
-            return -NEWFS_ERROR_NOSPACE;
-        }
+    ret = newfs_map_holes(inode, blk, end_blk);
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
     }
 
+    if (!keep_size && end > inode->size) {
+        inode->size = end;
+    }
     return NEWFS_ERROR_NONE;
 }
 
+/**
+ * @brief 在目录下按名称查找子项，需要时从磁盘读入子项的inode
+ * 
+ * @param dir 目录inode，调用者至少持有读锁
+ * @param name 子项名称
+ * @param is_find 输出，子项存在时为TRUE
+ * @return struct newfs_dentry* 找不到返回NULL，is_find=FALSE；子项的inode读不出来返回NULL，
+ *         is_find=TRUE，同 newfs_lookup 用 NEWFS_LOOKUP_ERR 区分
+ */
+struct newfs_dentry* newfs_lookup_child(struct newfs_inode* dir, const char* name, boolean* is_find) {
+    int d = newfs_find_dirent(dir, name, strlen(name));
+    *is_find = d >= 0;
+    if (d < 0) {
+        return NULL;
+    }
+    return newfs_child_dentry(dir, d);
+}
 
 /**
- * @brief 删除dentry目录项
+ * @brief 检查能否在目录 parent 下新增名为 name 的子项
  * 
- * @param inode 包含当前dentry目录项的索引节点
- * @param dentry 要删除的dentry目录项
- * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ * @param parent 父目录的dentry，调用者持有其写锁
+ * @param name 名称
+ * @return int 
  */
-int newfs_drop_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
-    if (inode->dentrys == dentry) {
-        inode->dentrys = dentry->brother;
+static int newfs_check_new_name(struct newfs_dentry* parent, const char* name) {
+    if (!NEWFS_IS_DIR(parent->inode)) {
+        return -NEWFS_ERROR_NOTDIR;
     }
-    else {
-        struct newfs_dentry* dentry_cursor = inode->dentrys;
-        while (dentry_cursor) {
-            if (dentry_cursor->brother == dentry) {
-                //若下一个兄弟节点为删除目录项，更新指针信息
-                dentry_cursor->brother = dentry->brother;
-                break;
-            }
-            dentry_cursor = dentry_cursor->brother;
-        }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        return -NEWFS_ERROR_NAMETOOLONG;
+    }
+    if (newfs_find_dirent(parent->inode, name, strlen(name)) >= 0) {
+        return -NEWFS_ERROR_EXISTS;
     }
-    inode->dir_cnt--;
-    free(dentry);
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 删除内存中的一个inode及其对应的dentry和data
+ * @brief 把已经指向inode的dentry登记到目录 parent 下，新建和 rename 共用
  * 
- * @param inode 要删除的inode
- * @return int 成功返回NEWFS_ERROR_NONE，失败返回错误码
+ * @param parent 父目录的dentry，调用者持有其写锁
+ * @param dentry 新的dentry，ino 和 inode 已填好
+ * @return int 
  */
-int newfs_drop_inode(struct newfs_inode* inode) {
-    struct newfs_dentry* dentry_cursor;
-    struct newfs_dentry* dentry_to_free;
-    int byte_cursor = 0;
-    int bit_cursor = 0;
-    int ino_cursor = 0;
-    boolean is_find = FALSE;
+static int newfs_link_dentry(struct newfs_dentry* parent, struct newfs_dentry* dentry) {
+    int ret;
+
+    dentry->parent = parent;
+    newfs_dir_seq_begin(parent->inode);
+    ret = newfs_alloc_dentry(parent->inode, dentry);    // parent 的 inode
+    newfs_dir_seq_end(parent->inode);
+    if (ret < 0) {
+        return ret;
+    }
+    newfs_touch_inode(parent->inode, NEWFS_T_MTIME | NEWFS_T_CTIME);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在目录 parent 下新建名为 name 的文件或目录
+ * 
+ * @param parent 父目录的dentry，调用者持有其写锁
+ * @param name 名称
+ * @param ftype 文件类型
+ * @param pdentry 输出新建的dentry，可以为NULL
+ * @return int 
+ */
+int newfs_create(struct newfs_dentry* parent, const char* name, NEWFS_FILE_TYPE ftype,
+                 struct newfs_dentry** pdentry) {
+    struct newfs_dentry* dentry;
+    struct newfs_inode*  inode;
+    int ret;
+
+    if ((ret = newfs_check_new_name(parent, name)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
 
+    dentry = new_dentry((char *)name, ftype);
+    inode  = newfs_alloc_inode(dentry);                 // son 的 inode
     if (inode == NULL) {
-        return NEWFS_ERROR_NONE;
+        free(dentry);
+        return -NEWFS_ERROR_NOSPACE;
     }
+    ret = newfs_link_dentry(parent, dentry);
+    if (ret < 0) {
+        NEWFS_WRLOCK(inode);
+        newfs_drop_inode(inode);
+        free(dentry);
+        return ret;
+    }
+    if (pdentry != NULL) {
+        *pdentry = dentry;
+    }
+    return NEWFS_ERROR_NONE;
+}
 
-    if (NEWFS_IS_DIR(inode)) {
-        dentry_cursor = inode->dentrys;
-        /* 递归删除目录下的所有目录项 */
-        while (dentry_cursor) {
-            dentry_to_free = dentry_cursor;
-            dentry_cursor = dentry_cursor->brother;
-            newfs_drop_inode(dentry_to_free->inode);
-            free(dentry_to_free);
-        }
+/**
+ * @brief 删除一个子项：删除inode及其数据块（仍有打开的句柄时推迟），再从父目录中摘下dentry
+ * 
+ * @param dentry 要删除的子项，调用者保证不是根目录，并持有父目录和子项的写锁；
+ *               子项的锁随inode一起交出，父目录的锁由调用者放开
+ * @return int 
+ */
+int newfs_remove(struct newfs_dentry* dentry) {
+    struct newfs_inode* parent = dentry->parent->inode;
+    int ret;
+
+    /* 整个删除过程中父目录的 seq 为奇数，无锁查找不会拿到正在释放的子项 */
+    newfs_dir_seq_begin(parent);
+    newfs_touch_inode(parent, NEWFS_T_MTIME | NEWFS_T_CTIME);
+    newfs_drop_inode(dentry->inode);                        // 删除inode及其对应的数据块
+    ret = newfs_drop_dentry(parent, dentry);                // 从父目录的子项中删除该目录项
+    newfs_dir_seq_end(parent);
+    return ret;
+}
+
+/**
+ * @brief 把子项 from 移到目录 to_parent 下，改名为 name；inode 不变，已打开的句柄继续有效
+ * 
+ * @param from 源子项，调用者持有它和它的父目录的写锁
+ * @param to_parent 目标目录的dentry，调用者持有其写锁
+ * @param name 新名称，目标目录下不能已经存在
+ * @return int 
+ */
+int newfs_move(struct newfs_dentry* from, struct newfs_dentry* to_parent, const char* name) {
+    struct newfs_inode*  from_inode = from->inode;
+    struct newfs_inode*  from_dir   = from->parent->inode;
+    struct newfs_inode*  to_dir     = to_parent->inode;
+    struct newfs_dentry* to_dentry;
+    int ret;
+
+    if ((ret = newfs_check_new_name(to_parent, name)) != NEWFS_ERROR_NONE) {
+        return ret;                                     /* 保证目的文件不存在 */
     }
-    else if (NEWFS_IS_REG(inode)) {
-        /* 释放文件对应的数据块 */
-        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            if (inode->block_pointer[i] != -1) {
-                /* 清除数据块位图 */
-                int blk_byte = inode->block_pointer[i] / UINT8_BITS;
-                int blk_bit = inode->block_pointer[i] % UINT8_BITS;
-                newfs_super.map_data[blk_byte] &= ~(0x1 << blk_bit);
-                
-                /* 释放数据块内存 */
-                if (inode->data[i]) {
-                    free(inode->data[i]);
-                    inode->data[i] = NULL;
-                }
-            }
-        }
+
+    /* 新dentry直接指向原来的inode，不需要另外分配inode */
+    to_dentry        = new_dentry((char *)name, from_inode->ftype);
+    to_dentry->ino   = from_inode->ino;
+    to_dentry->inode = from_inode;
+
+    /* 两个目录的 seq 在整个移动过程中都是奇数，无锁查找看不到中间状态 */
+    newfs_dir_seq_begin(from_dir);
+    newfs_dir_seq_begin(to_dir);
+    ret = newfs_link_dentry(to_parent, to_dentry);
+    if (ret != NEWFS_ERROR_NONE) {
+        newfs_dir_seq_end(to_dir);
+        newfs_dir_seq_end(from_dir);
+        free(to_dentry);
+        return ret;
     }
 
-    /* 清除inode位图中对应的位 */
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_inode_blks); byte_cursor++) {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if (ino_cursor == inode->ino) {
-                newfs_super.map_inode[byte_cursor] &= (uint8_t)(~(0x1 << bit_cursor));
-                is_find = TRUE;
-                break;
+    from_inode->dentry = to_dentry;
+    if (NEWFS_IS_DIR(from_inode)) {                     /* 已创建的子项改挂到新dentry下 */
+        for (int i = 0; i < from_inode->dir_cnt; i++) {
+            if (from_inode->dirents[i].dentry != NULL) {
+                from_inode->dirents[i].dentry->parent = to_dentry;
             }
-            ino_cursor++;
-        }
-        if (is_find) {
-            break;
         }
     }
 
-    /* 释放inode内存 */
-    free(inode);
+    newfs_touch_inode(from_inode, NEWFS_T_CTIME);
+    newfs_touch_inode(from_dir, NEWFS_T_MTIME | NEWFS_T_CTIME);
+    ret = newfs_drop_dentry(from_dir, from);
+    newfs_dir_seq_end(to_dir);
+    newfs_dir_seq_end(from_dir);
+    return ret;
+}
 
-    return NEWFS_ERROR_NONE;
+/**
+ * @brief 填写文件或目录的属性
+ * 
+ * @param inode 
+ * @param st 返回状态
+ */
+void newfs_fill_stat(struct newfs_inode* inode, struct stat* st) {
+    if (NEWFS_IS_DIR(inode)) {
+        st->st_mode = S_IFDIR | NEWFS_DEFAULT_PERM;
+        st->st_size = inode->size;                      // 目录块占用的大小
+    }
+    else if (NEWFS_IS_REG(inode)) {
+        st->st_mode = S_IFREG | NEWFS_DEFAULT_PERM;
+        st->st_size = inode->size;
+    }
+
+    st->st_nlink   = 1;
+    st->st_uid     = getuid();
+    st->st_gid     = getgid();
+    st->st_ino     = NEWFS_ST_INO(inode->ino);
+    st->st_atime   = __atomic_load_n(&inode->atime, __ATOMIC_RELAXED);
+    st->st_mtime   = inode->mtime;
+    st->st_ctime   = inode->ctime;
+    st->st_blksize = NEWFS_BLK_SZ();                    // 逻辑块大小
+
+    if (inode->ino == NEWFS_ROOT_INO) {
+        st->st_size   = newfs_super.sz_usage;
+        st->st_blocks = NEWFS_DISK_SZ() / NEWFS_BLK_SZ();  // 文件块数
+        st->st_nlink  = 2;                              /* !特殊，根目录link数为2 */
+    }
+}
+
+/**
+ * @brief 增加inode的打开计数，计数不为0时inode只会被推迟释放
+ * 
+ * @param inode 调用者持有其锁，或能保证它此时不会被删除
+ */
+void newfs_inode_get(struct newfs_inode* inode) {
+    __atomic_add_fetch(&inode->open_cnt, 1, __ATOMIC_RELAXED);
 }
 
+/**
+ * @brief 减少inode的打开计数，inode已被删除且这是最后一个引用时真正释放
+ * 
+ * @param inode 调用者不持有其锁
+ */
+void newfs_inode_put(struct newfs_inode* inode) {
+    NEWFS_WRLOCK(inode);
+    if (__atomic_sub_fetch(&inode->open_cnt, 1, __ATOMIC_RELAXED) == 0 && inode->unlinked) {
+        newfs_drop_inode(inode);                        /* 锁随inode一起释放 */
+        return;
+    }
+    NEWFS_UNLOCK(inode);
+}
@@ -3,10 +3,12 @@ POINTS=0
 TOTAL_POINTS=0
 TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh)
 # mount.sh mkdir.sh touch.sh ls.sh remount.sh (read.sh write.sh cp.sh)
-ALL_TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh)
-ALL_TEST_SCORES=(1 4 5 4 16 2 2)
+ALL_TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh stress.sh openfile.sh sparse.sh)
+ALL_TEST_SCORES=(1 4 5 4 18 2 2 2 2 4)
 MNTPOINT='./mnt'
 PROJECT_NAME="newfs"
+FUSE_BINARY="newfs"     # 挂载用的可执行文件，ll 级别换成低层接口的 newfs_ll
+FUSE_OPTS=()            # 额外的挂载选项，由需要的测试阶段设置
 
 LEVEL=$1
 
@@ -35,6 +37,15 @@ elif [[ "${LEVEL}" == "6" ]]; then
     echo "开始mount, mkdir, touch, ls, read&write, cp, umount测试"
     TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh)
     sleep 1
+elif [[ "${LEVEL}" == "7" ]]; then
+    echo "开始mount, mkdir, touch, ls, read&write, cp, umount, 并发压力, 打开文件生命周期, 稀疏文件测试"
+    TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh stress.sh openfile.sh sparse.sh)
+    sleep 1
+elif [[ "${LEVEL}" == "ll" ]]; then
+    echo "开始低层接口(newfs_ll)的mount, mkdir, read&write, umount, 打开文件生命周期测试"
+    TEST_CASES=(mount.sh mkdir.sh rw.sh remount.sh openfile.sh)
+    FUSE_BINARY="newfs_ll"
+    sleep 1
 else
     echo "未知测试参数"
     exit 1
@@ -96,7 +107,7 @@ function fail() {
 
 # Utils
 function mount_fuse() {
-    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$HOME"/ddriver "${MNTPOINT}"
+    "$ROOT_PATH"/../build/"${FUSE_BINARY}" --device="$HOME"/ddriver "${FUSE_OPTS[@]}" "${MNTPOINT}"
 }
 
 function check_mount() {
@@ -0,0 +1,110 @@
+#!/bin/bash
+
+TEST_CASE="case 9 - open file lifetime"
+
+HELD_KB=2560                # 两个这么大的文件放不进磁盘，只有先释放一个才能写入另一个
+OPEN_TMP=$(mktemp -d)
+
+# 通过打开的 fd 3 从偏移 $1 处读出 $2 字节
+function fd_pread () {
+    python3 -c 'import os, sys; sys.stdout.buffer.write(os.pread(3, int(sys.argv[2]), int(sys.argv[1])))' "$1" "$2"
+}
+
+# 把标准输入通过打开的 fd 3 写到偏移 $1 处
+function fd_pwrite () {
+    python3 -c 'import os, sys; os.pwrite(3, sys.stdin.buffer.read(), int(sys.argv[1]))' "$1"
+}
+
+# 打开后删除：删除后仍能通过 fd 读写，关闭后空间被释放
+function check_unlink_open () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    head -c $((HELD_KB * 1024)) /dev/urandom > "${OPEN_TMP}"/held
+    head -c 4096 /dev/urandom > "${OPEN_TMP}"/patch
+    if ! cp "${OPEN_TMP}"/held "${MNTPOINT}"/held; then
+        fail "$_TEST_CASE: 写文件${MNTPOINT}/held失败"
+        return 1
+    fi
+
+    exec 3<>"${MNTPOINT}"/held
+    rm "${MNTPOINT}"/held
+    if [ -e "${MNTPOINT}"/held ] || ls -A "${MNTPOINT}" | grep -q '^\.fuse_hidden'; then
+        exec 3>&-
+        fail "$_TEST_CASE: 删除后${MNTPOINT}/held仍然存在或被改名隐藏"
+        return 1
+    fi
+    if ! cmp -s <(fd_pread 0 $((HELD_KB * 1024))) "${OPEN_TMP}"/held; then
+        exec 3>&-
+        fail "$_TEST_CASE: 删除后通过打开的文件读出的内容不正确"
+        return 1
+    fi
+
+    # 覆盖中间的一段，再在末尾追加一段
+    fd_pwrite 102400 < "${OPEN_TMP}"/patch
+    fd_pwrite $((HELD_KB * 1024)) < "${OPEN_TMP}"/patch
+    dd if="${OPEN_TMP}"/patch of="${OPEN_TMP}"/held bs=1024 seek=100 conv=notrunc status=none
+    cat "${OPEN_TMP}"/patch >> "${OPEN_TMP}"/held
+    if ! cmp -s <(fd_pread 0 $((HELD_KB * 1024 + 4096))) "${OPEN_TMP}"/held; then
+        exec 3>&-
+        fail "$_TEST_CASE: 删除后通过打开的文件写入的内容读出不正确"
+        return 1
+    fi
+    exec 3>&-
+
+    sleep 1
+    if ! head -c $((HELD_KB * 1024)) /dev/urandom > "${MNTPOINT}"/fill; then
+        rm -f "${MNTPOINT}"/fill
+        fail "$_TEST_CASE: 关闭后已删除文件的空间没有释放"
+        return 1
+    fi
+    rm -f "${MNTPOINT}"/fill
+    return 0
+}
+
+# 打开后改名：改名后写入的内容出现在新名字下
+function check_rename_open () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    head -c 8192 /dev/urandom > "${OPEN_TMP}"/moved
+    if ! cp "${OPEN_TMP}"/moved "${MNTPOINT}"/before; then
+        fail "$_TEST_CASE: 写文件${MNTPOINT}/before失败"
+        return 1
+    fi
+
+    exec 3<>"${MNTPOINT}"/before
+    mv "${MNTPOINT}"/before "${MNTPOINT}"/after
+    fd_pwrite 8192 < "${OPEN_TMP}"/patch
+    cat "${OPEN_TMP}"/patch >> "${OPEN_TMP}"/moved
+    if ! cmp -s <(fd_pread 0 12288) "${OPEN_TMP}"/moved; then
+        exec 3>&-
+        fail "$_TEST_CASE: 改名后通过打开的文件读写的内容不正确"
+        return 1
+    fi
+    exec 3>&-
+
+    if [ -e "${MNTPOINT}"/before ] || ! cmp -s "${MNTPOINT}"/after "${OPEN_TMP}"/moved; then
+        fail "$_TEST_CASE: 改名后${MNTPOINT}/after的内容不正确"
+        return 1
+    fi
+    return 0
+}
+
+
+# 高层接口默认把仍被打开的文件改名为 .fuse_hidden 而不转发删除，
+# 这里带 hard_remove 重新挂载，让删除直接到达文件系统；低层接口总是直接转发
+if [[ "${FUSE_BINARY}" == "newfs" ]]; then
+    clean_mount
+    FUSE_OPTS=(-o hard_remove)
+fi
+try_mount_or_fail
+
+TEST_CASE="case 9.1 - read/write after unlink"
+core_tester echo "$TEST_CASE" check_unlink_open "$TEST_CASE"
+
+TEST_CASE="case 9.2 - read/write after rename"
+core_tester echo "$TEST_CASE" check_rename_open "$TEST_CASE"
+
+rm -rf "${OPEN_TMP}"
+FUSE_OPTS=()
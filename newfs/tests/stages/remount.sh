@@ -30,6 +30,30 @@ function create_and_except_remount () {
     touch_and_check "${MNTPOINT}"/dir0/dir1/dir2/file2
 }
 
+# 给一个文件设定修改时间并记下它的 inode 号，remount 后两者都不应改变
+STAT_FILE="${MNTPOINT}"/dir0/dir1/dir2/file0
+STAT_MTIME="2020-01-02 03:04:05"
+
+function stamp_before_remount () {
+    touch -d "$STAT_MTIME" "$STAT_FILE"
+    STAT_INO=$(stat -c %i "$STAT_FILE")
+}
+
+function check_stat_remount () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    if [[ "$(stat -c %Y "$STAT_FILE")" != "$(date -d "$STAT_MTIME" +%s)" ]]; then
+        fail "$_TEST_CASE: remount后$STAT_FILE的修改时间不是touch -d设定的$STAT_MTIME"
+        return 1
+    fi
+    if [[ "$(stat -c %i "$STAT_FILE")" != "$STAT_INO" ]]; then
+        fail "$_TEST_CASE: remount后$STAT_FILE的inode号由$STAT_INO变为$(stat -c %i "$STAT_FILE")"
+        return 1
+    fi
+    return 0
+}
+
 function create_and_except_bitmap () {
     touch_and_check "${MNTPOINT}/$filename"
 }
@@ -92,6 +116,7 @@ clean_ddriver
 try_mount_or_fail
 
 create_and_except_remount
+stamp_before_remount
 
 TEST_CASE="case 5.1 - umount ${MNTPOINT}"
 core_tester ls "${MNTPOINT}" check_umount "$TEST_CASE" 1
@@ -104,6 +129,9 @@ try_mount_or_fail
 TEST_CASE="case 5.2 - remount ${MNTPOINT}"
 core_tester ls "${MNTPOINT}"/dir0/dir1/dir2 check_ls_remount "$TEST_CASE" 3
 
+TEST_CASE="case 5.3 - mtime and inode number after remount"
+core_tester ls "${MNTPOINT}" check_stat_remount "$TEST_CASE" 2
+
 clean_mount
 clean_ddriver
 
@@ -118,7 +146,7 @@ clean_mount
 sleep 1
 
 
-TEST_CASE="case 5.3 - check bitmap"
+TEST_CASE="case 5.4 - check bitmap"
 core_tester ls "${MNTPOINT}" check_bm "$TEST_CASE" 12
 
 clean_mount
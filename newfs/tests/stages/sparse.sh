@@ -0,0 +1,116 @@
+#!/bin/bash
+
+TEST_CASE="case 10 - sparse truncate/fallocate"
+
+SPARSE_TMP=$(mktemp -d)
+
+# 文件 $1 从偏移 $2 起的 $3 字节应当全为0
+function expect_zeros () {
+    cmp -s <(tail -c +$(($2 + 1)) "$1" | head -c "$3") <(head -c "$3" /dev/zero)
+}
+
+function check_truncate_grow () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    if ! truncate -s 1M "${MNTPOINT}"/grow; then
+        fail "$_TEST_CASE: truncate -s 1M ${MNTPOINT}/grow失败"
+        return 1
+    fi
+    if [[ "$(stat -c %s "${MNTPOINT}"/grow)" != "1048576" ]]; then
+        fail "$_TEST_CASE: truncate后${MNTPOINT}/grow的大小不是1048576"
+        return 1
+    fi
+    if ! expect_zeros "${MNTPOINT}"/grow 0 1048576; then
+        fail "$_TEST_CASE: truncate扩大的部分读出的不全是0"
+        return 1
+    fi
+    return 0
+}
+
+function check_truncate_regrow () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    head -c 8192 /dev/urandom > "${SPARSE_TMP}"/regrow
+    if ! cp "${SPARSE_TMP}"/regrow "${MNTPOINT}"/regrow; then
+        fail "$_TEST_CASE: 写文件${MNTPOINT}/regrow失败"
+        return 1
+    fi
+    # 先缩到块中间，再扩回原来的大小：截掉的部分不能再读出来
+    truncate -s 1000 "${MNTPOINT}"/regrow
+    truncate -s 8192 "${MNTPOINT}"/regrow
+    if ! cmp -s <(head -c 1000 "${MNTPOINT}"/regrow) <(head -c 1000 "${SPARSE_TMP}"/regrow); then
+        fail "$_TEST_CASE: 缩小再扩大后${MNTPOINT}/regrow保留的前1000字节不正确"
+        return 1
+    fi
+    if ! expect_zeros "${MNTPOINT}"/regrow 1000 7192; then
+        fail "$_TEST_CASE: 缩小再扩大后${MNTPOINT}/regrow截掉的部分没有读出0"
+        return 1
+    fi
+    return 0
+}
+
+function check_fallocate () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    if ! fallocate -l 64K "${MNTPOINT}"/falloc; then
+        fail "$_TEST_CASE: fallocate -l 64K ${MNTPOINT}/falloc失败"
+        return 1
+    fi
+    if [[ "$(stat -c %s "${MNTPOINT}"/falloc)" != "65536" ]] || ! expect_zeros "${MNTPOINT}"/falloc 0 65536; then
+        fail "$_TEST_CASE: fallocate后${MNTPOINT}/falloc的大小不是65536或读出的不全是0"
+        return 1
+    fi
+    # 在预分配的块中间写入，前后仍是0
+    head -c 4096 /dev/urandom > "${SPARSE_TMP}"/patch
+    dd if="${SPARSE_TMP}"/patch of="${MNTPOINT}"/falloc bs=1024 seek=10 conv=notrunc status=none
+    if ! cmp -s <(tail -c +10241 "${MNTPOINT}"/falloc | head -c 4096) "${SPARSE_TMP}"/patch ||
+       ! expect_zeros "${MNTPOINT}"/falloc 0 10240 || ! expect_zeros "${MNTPOINT}"/falloc 14336 51200; then
+        fail "$_TEST_CASE: 在预分配的块中写入后${MNTPOINT}/falloc的内容不正确"
+        return 1
+    fi
+    return 0
+}
+
+function check_fallocate_keep_size () {
+    _PARAM=$1
+    _TEST_CASE=$2
+
+    head -c 100 /dev/urandom > "${SPARSE_TMP}"/keep
+    cp "${SPARSE_TMP}"/keep "${MNTPOINT}"/keep
+    if ! fallocate -n -l 64K "${MNTPOINT}"/keep; then
+        fail "$_TEST_CASE: fallocate --keep-size ${MNTPOINT}/keep失败"
+        return 1
+    fi
+    if [[ "$(stat -c %s "${MNTPOINT}"/keep)" != "100" ]] || ! cmp -s "${MNTPOINT}"/keep "${SPARSE_TMP}"/keep; then
+        fail "$_TEST_CASE: fallocate --keep-size改变了${MNTPOINT}/keep的大小或内容"
+        return 1
+    fi
+    # 预分配的块在文件末尾之后，扩大文件后读出的是0
+    truncate -s 32768 "${MNTPOINT}"/keep
+    if ! cmp -s <(head -c 100 "${MNTPOINT}"/keep) "${SPARSE_TMP}"/keep ||
+       ! expect_zeros "${MNTPOINT}"/keep 100 32668; then
+        fail "$_TEST_CASE: 扩大后${MNTPOINT}/keep末尾之后的预分配块没有读出0"
+        return 1
+    fi
+    return 0
+}
+
+
+try_mount_or_fail
+
+TEST_CASE="case 10.1 - truncate grows a sparse file"
+core_tester echo "$TEST_CASE" check_truncate_grow "$TEST_CASE"
+
+TEST_CASE="case 10.2 - shrink then regrow reads zeros"
+core_tester echo "$TEST_CASE" check_truncate_regrow "$TEST_CASE"
+
+TEST_CASE="case 10.3 - fallocate"
+core_tester echo "$TEST_CASE" check_fallocate "$TEST_CASE"
+
+TEST_CASE="case 10.4 - fallocate --keep-size"
+core_tester echo "$TEST_CASE" check_fallocate_keep_size "$TEST_CASE"
+
+rm -rf "${SPARSE_TMP}"
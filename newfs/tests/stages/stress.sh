@@ -0,0 +1,110 @@
+#!/bin/bash
+
+TEST_CASE="case 8 - stress"
+
+NR_WORKERS=8
+NR_ROUNDS=20
+STRESS_TMP=$(mktemp -d)
+
+# 第 $1 个写者第 $2 轮写入的内容：32KB，每个写者、每一轮都不同
+function stress_pattern () {
+    head -c 32768 /dev/zero | tr '\0' "$(printf "\\$(printf '%03o' $((65 + ($1 * 7 + $2) % 26)))")"
+}
+
+# 每个写者反复覆盖自己的文件，读者同时读一个共享文件
+function check_parallel_rw () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    local pids=()
+
+    stress_pattern 0 0 > "${STRESS_TMP}"/shared
+    if ! cp "${STRESS_TMP}"/shared "${MNTPOINT}"/shared; then
+        fail "$_TEST_CASE: 写共享文件${MNTPOINT}/shared失败"
+        return 1
+    fi
+
+    for ((w = 0; w < NR_WORKERS; w++)); do
+        (
+            for ((r = 0; r < NR_ROUNDS; r++)); do
+                stress_pattern "$w" "$r" > "${MNTPOINT}"/stress_w"$w" || exit 1
+            done
+        ) &
+        pids+=($!)
+        (
+            for ((r = 0; r < NR_ROUNDS; r++)); do
+                cmp -s "${MNTPOINT}"/shared "${STRESS_TMP}"/shared || exit 1
+            done
+        ) &
+        pids+=($!)
+    done
+    for pid in "${pids[@]}"; do
+        if ! wait "$pid"; then
+            fail "$_TEST_CASE: 并发读写时出错"
+            return 1
+        fi
+    done
+
+    for ((w = 0; w < NR_WORKERS; w++)); do
+        if ! cmp -s <(stress_pattern "$w" $((NR_ROUNDS - 1))) "${MNTPOINT}"/stress_w"$w"; then
+            fail "$_TEST_CASE: 并发写入后${MNTPOINT}/stress_w$w的内容不正确"
+            return 1
+        fi
+    done
+    return 0
+}
+
+# 每个工作者在自己的目录里反复建、删文件和目录，并在两个公共目录之间来回 rename
+function check_parallel_tree () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    local pids=()
+
+    mkdir -p "${MNTPOINT}"/stress_a "${MNTPOINT}"/stress_b || return 1
+    for ((w = 0; w < NR_WORKERS; w++)); do
+        (
+            mkdir "${MNTPOINT}"/stress_d"$w" || exit 1
+            echo "$w" > "${MNTPOINT}"/stress_a/mv"$w" || exit 1
+            for ((r = 0; r < NR_ROUNDS; r++)); do
+                mkdir "${MNTPOINT}"/stress_d"$w"/sub || exit 1
+                echo "$r" > "${MNTPOINT}"/stress_d"$w"/sub/f || exit 1
+                rm "${MNTPOINT}"/stress_d"$w"/sub/f || exit 1
+                rmdir "${MNTPOINT}"/stress_d"$w"/sub || exit 1
+                if ((r % 2 == 0)); then
+                    mv "${MNTPOINT}"/stress_a/mv"$w" "${MNTPOINT}"/stress_b/mv"$w" || exit 1
+                else
+                    mv "${MNTPOINT}"/stress_b/mv"$w" "${MNTPOINT}"/stress_a/mv"$w" || exit 1
+                fi
+            done
+        ) &
+        pids+=($!)
+    done
+    for pid in "${pids[@]}"; do
+        if ! wait "$pid"; then
+            fail "$_TEST_CASE: 并发建删目录或 rename 时出错"
+            return 1
+        fi
+    done
+
+    for ((w = 0; w < NR_WORKERS; w++)); do
+        if [[ -n "$(ls -A "${MNTPOINT}"/stress_d"$w")" ]]; then
+            fail "$_TEST_CASE: ${MNTPOINT}/stress_d$w应当为空"
+            return 1
+        fi
+        if [[ "$(cat "${MNTPOINT}"/stress_a/mv"$w")" != "$w" ]]; then
+            fail "$_TEST_CASE: rename 后${MNTPOINT}/stress_a/mv$w的内容不正确"
+            return 1
+        fi
+    done
+    return 0
+}
+
+
+try_mount_or_fail
+
+TEST_CASE="case 8.1 - parallel read/write"
+core_tester echo "$TEST_CASE" check_parallel_rw "$TEST_CASE"
+
+TEST_CASE="case 8.2 - parallel mkdir/rm/rename"
+core_tester echo "$TEST_CASE" check_parallel_tree "$TEST_CASE"
+
+rm -rf "${STRESS_TMP}"
@@ -23,7 +23,6 @@
 * SECTION: sfs_utils.c
 *******************************************************************************/
 char* 			   sfs_get_fname(const char* path);
-int 			   sfs_calc_lvl(const char * path);
 int 			   sfs_driver_read(int offset, uint8_t *out_content, int size);
 int 			   sfs_driver_write(int offset, uint8_t *in_content, int size);
 
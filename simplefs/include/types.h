@@ -130,6 +130,39 @@ static inline struct sfs_dentry* new_dentry(char * fname, SFS_FILE_TYPE ftype) {
     dentry->parent  = NULL;
     dentry->brother = NULL;                                            
 }
+
+/**
+ * 路径分量迭代器：直接在原始路径上扫描，不拷贝、不分配内存，可重入
+ *
+ * path: //a/bc//d/  依次得到 (a,1) (bc,2) (d,1)，随后返回 0
+ */
+struct sfs_path_iter {
+    const char*        cursor;                        /* 下一次扫描的起点 */
+};
+
+static inline void sfs_path_iter_init(struct sfs_path_iter* iter, const char* path) {
+    iter->cursor = path;
+}
+
+static inline int sfs_path_next(struct sfs_path_iter* iter, const char** name) {
+    const char* cur = iter->cursor;
+    const char* start;
+    while (*cur == '/') {                             /* 跳过连续的'/' */
+        cur++;
+    }
+    start = cur;
+    while (*cur != '\0' && *cur != '/') {
+        cur++;
+    }
+    iter->cursor = cur;
+    *name = start;
+    return (int)(cur - start);                        /* 0 表示路径已结束 */
+}
+
+/* 判断 dentry 名称是否与长度为 len 的路径分量完全相同 */
+static inline boolean sfs_fname_eq(const char* fname, const char* name, int len) {
+    return len < SFS_MAX_FILE_NAME && memcmp(fname, name, len) == 0 && fname[len] == '\0';
+}
 /******************************************************************************
 * SECTION: FS Specific Structure - Disk structure
 *******************************************************************************/
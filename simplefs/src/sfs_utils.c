@@ -14,29 +14,6 @@ char* sfs_get_fname(const char* path) {
     char *q = strrchr(path, ch) + 1;
     return q;
 }
-/**
- * @brief 计算路径的层级
- * exm: /av/c/d/f
- * -> lvl = 4
- * @param path 
- * @return int 
- */
-int sfs_calc_lvl(const char * path) {
-    // char* path_cpy = (char *)malloc(strlen(path));
-    // strcpy(path_cpy, path);
-    char* str = path;
-    int   lvl = 0;
-    if (strcmp(path, "/") == 0) {
-        return lvl;
-    }
-    while (*str != NULL) {
-        if (*str == '/') {
-            lvl++;
-        }
-        str++;
-    }
-    return lvl;
-}
 /**
  * @brief 驱动读
  * 
@@ -443,64 +420,59 @@ struct sfs_dentry* sfs_get_dentry(struct sfs_inode * inode, int dir) {
  * @return struct sfs_dentry* 
  */
 struct sfs_dentry* sfs_lookup(const char * path, boolean* is_find, boolean* is_root) {
-    struct sfs_dentry* dentry_cursor = sfs_super.root_dentry;
-    struct sfs_dentry* dentry_ret = NULL;
-    struct sfs_inode*  inode; 
-    int   total_lvl = sfs_calc_lvl(path);
-    int   lvl = 0;
+    struct sfs_dentry*   dentry_cursor = sfs_super.root_dentry;
+    struct sfs_dentry*   dentry_ret = sfs_super.root_dentry;
+    struct sfs_inode*    inode; 
+    struct sfs_path_iter iter;
+    const char* fname;
+    int   fname_len;
     boolean is_hit;
-    char* fname = NULL;
-    char* path_cpy = (char*)malloc(sizeof(path));
+    *is_find = FALSE;
     *is_root = FALSE;
-    strcpy(path_cpy, path);
 
-    if (total_lvl == 0) {                           /* 根目录 */
+    sfs_path_iter_init(&iter, path);
+    fname_len = sfs_path_next(&iter, &fname);
+    if (fname_len == 0) {                           /* 根目录 */
         *is_find = TRUE;
         *is_root = TRUE;
-        dentry_ret = sfs_super.root_dentry;
     }
-    fname = strtok(path_cpy, "/");       
-    while (fname)
+    while (fname_len > 0)
     {   
-        lvl++;
         if (dentry_cursor->inode == NULL) {           /* Cache机制 */
-            sfs_read_inode(dentry_cursor, dentry_cursor->ino);
+            dentry_cursor->inode = sfs_read_inode(dentry_cursor, dentry_cursor->ino);
         }
 
         inode = dentry_cursor->inode;
 
-        if (SFS_IS_REG(inode) && lvl < total_lvl) {
+        if (!SFS_IS_DIR(inode)) {                     /* 路径未结束却遇到非目录 */
             SFS_DBG("[%s] not a dir\n", __func__);
             dentry_ret = inode->dentry;
             break;
         }
-        if (SFS_IS_DIR(inode)) {
-            dentry_cursor = inode->dentrys;
-            is_hit        = FALSE;
-
-            while (dentry_cursor)   /* 遍历子目录项 */
-            {
-                if (memcmp(dentry_cursor->fname, fname, strlen(fname)) == 0) {
-                    is_hit = TRUE;
-                    break;
-                }
-                dentry_cursor = dentry_cursor->brother;
-            }
-            
-            if (!is_hit) {
-                *is_find = FALSE;
-                SFS_DBG("[%s] not found %s\n", __func__, fname);
-                dentry_ret = inode->dentry;
-                break;
-            }
 
-            if (is_hit && lvl == total_lvl) {
-                *is_find = TRUE;
-                dentry_ret = dentry_cursor;
+        dentry_cursor = inode->dentrys;
+        is_hit        = FALSE;
+        while (dentry_cursor)   /* 遍历子目录项 */
+        {
+            if (sfs_fname_eq(dentry_cursor->fname, fname, fname_len)) {
+                is_hit = TRUE;
                 break;
             }
+            dentry_cursor = dentry_cursor->brother;
+        }
+        
+        if (!is_hit) {
+            SFS_DBG("[%s] not found %.*s\n", __func__, fname_len, fname);
+            dentry_ret = inode->dentry;
+            break;
+        }
+
+        fname_len = sfs_path_next(&iter, &fname);
+        if (fname_len == 0) {                         /* 已是最后一级 */
+            *is_find = TRUE;
+            dentry_ret = dentry_cursor;
+            break;
         }
-        fname = strtok(NULL, "/"); 
     }
 
     if (dentry_ret->inode == NULL) {